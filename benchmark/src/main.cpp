@@ -0,0 +1,365 @@
+//
+//  main.cpp - ray tracer benchmarks, results written as JSON
+//
+//  Micro benchmarks time single calls on prepared inputs (ns per call):
+//  Sphere::intersect, Plane::intersect, Box::intersect, RenderCam::getRay,
+//  and RenderScene::lambert/phong with 1 and 16 lights (shadow rays
+//  included).  Macro benchmarks render procedural scenes of random spheres
+//  over the app's wall and floor, sweeping the number of spheres, the number
+//  of point lights, and the number of render threads.
+//
+//      benchmark -o results.json [-quick] [-size WxH] [-threads 1,2,4,8]
+//      benchmark -verify
+//
+//  -verify only checks that every SIMD intersection kernel the CPU can run
+//  gives the same results as the scalar code, and exits with 1 if one
+//  doesn't.  It is meant for a build step, on the same optimized build the
+//  benchmarks run on.
+//
+//  Rays per second count the primary and shadow rays the render actually
+//  cast (RenderScene::samplesTraced and shadowRaysTraced).
+//
+
+#include "ofMain.h"
+#include "RenderScene.h"
+#include "BVH.h"
+#include "SphereSoA.h"
+#include "TriangleSoA.h"
+#include <chrono>
+#include <random>
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// keeps the compiler from dropping the work being timed
+//
+static volatile float sink;
+
+struct MicroResult {
+	string name;
+	int lights = 0;
+	double ns = 0;
+};
+
+struct MacroResult {
+	string sweep;
+	int spheres = 0;
+	int lights = 0;
+	int threads = 0;
+	double buildMs = 0;      // snapshot and BVH build
+	double ms = 0;           // render
+	long long rays = 0;
+	double mrays = 0;
+	double speedup = 0;
+};
+
+// Random rays from the render camera through the view plane, the same rays
+// a render would trace
+//
+static vector<Ray> cameraRays(RenderCam& cam, int n, std::mt19937& rng) {
+	std::uniform_real_distribution<float> uniform(0, 1);
+	vector<Ray> rays;
+	rays.reserve(n);
+	for (int i = 0; i < n; i++) rays.push_back(cam.getRay(uniform(rng), uniform(rng)));
+	return rays;
+}
+
+// Time f(i) for i in [0, n) repeated until at least minSeconds have passed,
+// returns ns per call
+//
+template<class F>
+static double timeCalls(int n, double minSeconds, F&& f) {
+	long long calls = 0;
+	Clock::time_point start = Clock::now();
+	double elapsed = 0;
+	do {
+		for (int i = 0; i < n; i++) f(i);
+		calls += n;
+		elapsed = secondsSince(start);
+	} while (elapsed < minSeconds);
+	return elapsed * 1e9 / calls;
+}
+
+// The app's wall and floor, numSpheres random spheres in front of the wall
+// and numLights point lights above them.  The sphere radius shrinks as the
+// count grows so the scene covers about the same part of the image.
+//
+static void makeScene(int numSpheres, int numLights, vector<SceneObject*>& scene, vector<Light*>& lights, uint32_t seed) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> uniform(0, 1);
+
+	scene.push_back(new Plane(glm::vec3(0, -4, -10), glm::vec3(0, 0, 1), ofColor::darkGreen, 30, 30));
+	scene.push_back(new Plane(glm::vec3(0, -2, 0), glm::vec3(0, 1, 0), ofColor::darkRed, 30, 20));
+
+	glm::vec3 lo(-6, -2, -9), hi(6, 4, 3);
+	glm::vec3 size = hi - lo;
+	float radius = 0.6f * cbrt(size.x * size.y * size.z / numSpheres);
+	for (int i = 0; i < numSpheres; i++) {
+		glm::vec3 p = lo + size * glm::vec3(uniform(rng), uniform(rng), uniform(rng));
+		Joint* joint = new Joint("sphere" + to_string(i), radius * (0.5f + uniform(rng)),
+			ofColor(uniform(rng) * 255, uniform(rng) * 255, uniform(rng) * 255));
+		joint->position = p;
+		scene.push_back(joint);
+	}
+	for (int i = 0; i < numLights; i++) {
+		Light* light = new PointLight("light" + to_string(i), 0.4f / numLights, ofColor::white);
+		light->position = glm::vec3(-10 + 20 * uniform(rng), 5 + 3 * uniform(rng), -8 + 14 * uniform(rng));
+		lights.push_back(light);
+	}
+	for (auto object : scene) object->getMatrix();
+	for (auto light : lights) light->getMatrix();
+}
+
+static void freeScene(vector<SceneObject*>& scene, vector<Light*>& lights) {
+	for (auto object : scene) delete object;
+	for (auto light : lights) delete light;
+	scene.clear();
+	lights.clear();
+}
+
+static void setupRenderScene(RenderScene& renderScene, const vector<SceneObject*>& scene, const vector<Light*>& lights, int width, int height) {
+	renderScene.copyObjects(scene, lights);
+	renderScene.buildSceneBVH();
+	renderScene.settings.lambert = true;
+	renderScene.settings.progressive = false;
+	renderScene.imageWidth = width;
+	renderScene.imageHeight = height;
+}
+
+static vector<MicroResult> runMicro(bool quick) {
+	vector<MicroResult> results;
+	double minSeconds = quick ? 0.05 : 0.5;
+	const int n = 1 << 16;
+	std::mt19937 rng(116);
+	RenderCam cam;
+	vector<Ray> rays = cameraRays(cam, n, rng);
+
+	Sphere sphere(glm::vec3(0, 0, -2), 2);
+	double ns = timeCalls(n, minSeconds, [&](int i) {
+		HitRecord hit;
+		if (sphere.intersect(rays[i], 0, std::numeric_limits<float>::infinity(), hit)) sink = hit.t;
+	});
+	results.push_back({ "Sphere::intersect", 0, ns });
+
+	Plane plane(glm::vec3(0, -2, 0), glm::vec3(0, 1, 0), ofColor::darkRed, 30, 20);
+	ns = timeCalls(n, minSeconds, [&](int i) {
+		HitRecord hit;
+		if (plane.intersect(rays[i], 0, std::numeric_limits<float>::infinity(), hit)) sink = hit.t;
+	});
+	results.push_back({ "Plane::intersect", 0, ns });
+
+	Box box(glm::vec3(-2, -2, -4), glm::vec3(2, 2, 0));
+	ns = timeCalls(n, minSeconds, [&](int i) {
+		if (box.intersect(rays[i], 0, std::numeric_limits<float>::infinity())) sink = 1;
+	});
+	results.push_back({ "Box::intersect", 0, ns });
+
+	std::uniform_real_distribution<float> uniform(0, 1);
+	vector<glm::vec2> uv(n);
+	for (auto& p : uv) p = glm::vec2(uniform(rng), uniform(rng));
+	ns = timeCalls(n, minSeconds, [&](int i) {
+		sink = cam.getRay(uv[i].x, uv[i].y).d.x;
+	});
+	results.push_back({ "RenderCam::getRay", 0, ns });
+
+	// shading at the primary hits of a small scene; every call sends one
+	// shadow ray per light
+	//
+	for (int numLights : { 1, 16 }) {
+		vector<SceneObject*> scene;
+		vector<Light*> lights;
+		makeScene(20, numLights, scene, lights, 117);
+		RenderScene renderScene;
+		setupRenderScene(renderScene, scene, lights, 640, 480);
+
+		vector<HitRecord> hits;
+		for (auto& ray : rays) {
+			HitRecord hit;
+			if (renderScene.intersectScene(ray, hit)) hits.push_back(hit);
+		}
+		int m = (int)hits.size();
+
+		ns = timeCalls(m, minSeconds, [&](int i) {
+			sink = renderScene.lambert(hits[i].point, hits[i].normal, hits[i].obj->diffuseColor).r;
+		});
+		results.push_back({ "lambert", numLights, ns });
+
+		ns = timeCalls(m, minSeconds, [&](int i) {
+			const HitRecord& hit = hits[i];
+			sink = renderScene.phong(hit.point, hit.normal, hit.obj->diffuseColor, hit.obj->specularColor, 10).r;
+		});
+		results.push_back({ "phong", numLights, ns });
+		freeScene(scene, lights);
+	}
+	return results;
+}
+
+// Render one procedural scene on a pool of numThreads and time it
+//
+static MacroResult renderMacro(const string& sweep, int numSpheres, int numLights, int numThreads, int width, int height) {
+	vector<SceneObject*> scene;
+	vector<Light*> lights;
+	makeScene(numSpheres, numLights, scene, lights, 118);
+
+	RenderScene renderScene;
+	Clock::time_point buildStart = Clock::now();
+	setupRenderScene(renderScene, scene, lights, width, height);
+	double buildSeconds = secondsSince(buildStart);
+	FrameBuffer frameBuffer;
+	frameBuffer.resize(width, height);
+	vector<GBufferSample> gBuffer((size_t)width * height);
+	renderScene.gBuffer = gBuffer.data();
+
+	ThreadPool pool(numThreads);
+	std::atomic<bool> cancel{ false };
+	Clock::time_point start = Clock::now();
+	renderScene.render(frameBuffer, pool, cancel);
+	double seconds = secondsSince(start);
+
+	MacroResult result;
+	result.sweep = sweep;
+	result.spheres = numSpheres;
+	result.lights = numLights;
+	result.threads = pool.size();
+	result.buildMs = buildSeconds * 1000;
+	result.ms = seconds * 1000;
+	result.rays = renderScene.samplesTraced + renderScene.shadowRaysTraced;
+	result.mrays = result.rays / seconds * 1e-6;
+
+	freeScene(scene, lights);
+	return result;
+}
+
+static vector<MacroResult> runMacro(bool quick, int width, int height, const vector<int>& threadCounts) {
+	vector<MacroResult> results;
+	vector<int> sphereCounts = quick ? vector<int>{ 10, 1000, 100000 } : vector<int>{ 10, 100, 1000, 10000, 100000, 1000000 };
+	vector<int> lightCounts = quick ? vector<int>{ 1, 10, 100 } : vector<int>{ 1, 10, 100, 500 };
+
+	for (int spheres : sphereCounts) {
+		results.push_back(renderMacro("spheres", spheres, 1, 0, width, height));
+		cout << "  " << spheres << " spheres: " << results.back().ms << " ms" << endl;
+	}
+	for (int lights : lightCounts) {
+		results.push_back(renderMacro("lights", 1000, lights, 0, width, height));
+		cout << "  " << lights << " lights: " << results.back().ms << " ms" << endl;
+	}
+
+	double base = 0;
+	for (int threads : threadCounts) {
+		MacroResult result = renderMacro("threads", 10000, 10, threads, width, height);
+		if (base == 0) base = result.ms;
+		result.speedup = base / result.ms;
+		results.push_back(result);
+		cout << "  " << threads << " threads: " << result.ms << " ms" << endl;
+	}
+	return results;
+}
+
+static string jsonString(const string& s) {
+	string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') out += '\\';
+		out += c;
+	}
+	return out + "\"";
+}
+
+static void writeJSON(std::ostream& out, const vector<MicroResult>& micro, const vector<MacroResult>& macro, int width, int height) {
+	out << fixed << setprecision(3);
+	out << "{\n";
+	out << "  \"hardwareThreads\": " << std::thread::hardware_concurrency() << ",\n";
+	out << "  \"sphereKernel\": " << jsonString(sphereKernelName()) << ",\n";
+	out << "  \"image\": [" << width << ", " << height << "],\n";
+	out << "  \"micro\": [\n";
+	for (int i = 0; i < (int)micro.size(); i++) {
+		const MicroResult& r = micro[i];
+		out << "    { \"name\": " << jsonString(r.name) << ", \"lights\": " << r.lights
+			<< ", \"nsPerCall\": " << r.ns << ", \"mcallsPerSecond\": " << 1000 / r.ns << " }"
+			<< (i + 1 < (int)micro.size() ? "," : "") << "\n";
+	}
+	out << "  ],\n";
+	out << "  \"macro\": [\n";
+	for (int i = 0; i < (int)macro.size(); i++) {
+		const MacroResult& r = macro[i];
+		out << "    { \"sweep\": " << jsonString(r.sweep) << ", \"spheres\": " << r.spheres << ", \"lights\": " << r.lights
+			<< ", \"threads\": " << r.threads << ", \"buildMs\": " << r.buildMs << ", \"ms\": " << r.ms << ", \"rays\": " << r.rays
+			<< ", \"mraysPerSecond\": " << r.mrays;
+		if (r.sweep == "threads") out << ", \"speedup\": " << r.speedup;
+		out << " }" << (i + 1 < (int)macro.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
+
+int main(int argc, char* argv[]) {
+	string outPath;
+	bool quick = false;
+	int width = 640;
+	int height = 480;
+	vector<int> threadCounts;
+	bool verify = false;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc) outPath = argv[++i];
+		else if (arg == "-verify") verify = true;
+		else if (arg == "-quick") quick = true;
+		else if (arg == "-size" && i + 1 < argc) {
+			if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+				cout << "bad image size " << argv[i] << endl;
+				return 1;
+			}
+		}
+		else if (arg == "-threads" && i + 1 < argc) {
+			istringstream iss(argv[++i]);
+			string item;
+			while (getline(iss, item, ',')) threadCounts.push_back(std::max(atoi(item.c_str()), 1));
+		}
+		else {
+			cout << "usage: benchmark [-o results.json] [-quick] [-size WxH] [-threads 1,2,4,8] | -verify" << endl;
+			return 1;
+		}
+	}
+
+	if (verify) {
+		bool spheresMatch = verifySphereKernels();
+		bool trianglesMatch = verifyTriangleKernels();
+		bool boxesMatch = verifyBoxKernels();
+		return spheresMatch && trianglesMatch && boxesMatch ? 0 : 1;
+	}
+
+	// thread sweep: powers of two up to the number of hardware threads
+	//
+	if (threadCounts.empty()) {
+		int hardware = std::max((int)std::thread::hardware_concurrency(), 1);
+		for (int threads = 1; threads < hardware; threads *= 2) threadCounts.push_back(threads);
+		threadCounts.push_back(hardware);
+	}
+
+	cout << "micro benchmarks" << endl;
+	vector<MicroResult> micro = runMicro(quick);
+	for (auto& r : micro) {
+		cout << "  " << r.name;
+		if (r.lights > 0) cout << " (" << r.lights << " lights)";
+		cout << ": " << r.ns << " ns" << endl;
+	}
+	cout << "macro benchmarks (" << width << "x" << height << ")" << endl;
+	vector<MacroResult> macro = runMacro(quick, width, height, threadCounts);
+
+	if (outPath.empty()) {
+		writeJSON(cout, micro, macro, width, height);
+	}
+	else {
+		std::ofstream out(outPath);
+		writeJSON(out, micro, macro, width, height);
+		if (!out) {
+			cout << "can't write " << outPath << endl;
+			return 1;
+		}
+		cout << "results written to " << outPath << endl;
+	}
+	return 0;
+}
@@ -0,0 +1,270 @@
+//
+//  main.cpp - headless renderer, renders a saved scene straight to an image
+//
+//  Same scene setup (wall and floor planes, render camera) and the same
+//  RenderScene shading as the app, but no window and no GL context, so it
+//  can batch render on servers without a display:
+//
+//      headless savedFile.txt -o frame.png -size 1920x1280 -shading phong -light 0,5,2
+//
+//  Run without arguments for the list of options.
+//
+
+#include "ofMain.h"
+#include "RenderScene.h"
+#include "SceneFile.h"
+#include "SceneBinary.h"
+#include "ImageWriter.h"
+#include "Profiler.h"
+#include <future>
+
+static void usage() {
+	cout << "usage: headless scene.txt|scene.rtscene [options]\n"
+		"  -o file                   output image, .png .ppm .pfm or .exr (default render.png)\n"
+		"  -size WxH                 image size (default 1200x800)\n"
+		"  -shading mode             flat, lambert or phong (default lambert)\n"
+		"  -threads n                render threads (default one per hardware thread)\n"
+		"  -camera x,y,z             render camera position (default 0,0,10, or the .rtscene's)\n"
+		"  -light x,y,z[,i]          add a point light of intensity i (default 0.4)\n"
+		"  -spherelight x,y,z,r[,i]  add a sphere area light of radius r\n"
+		"  -rectlight x,y,z,w,h[,i]  add a w x h rectangle area light facing down\n"
+		"  -lightintensity f         added to every light (the app's Light Intensity slider)\n"
+		"  -power f                  phong power exponent (default 10)\n"
+		"  -textures                 texture the wall and floor\n"
+		"  -aa                       adaptive antialiasing\n"
+		"  -falloff cutoff           lights fade with distance, culled below cutoff\n"
+		"  -lightsamples n           shade n lights per sample, picked by power\n"
+		"  -data folder              data folder (textures, relative scene paths)\n"
+#if RT_PROFILE
+		"  -trace file               save a Chrome trace of the render\n"
+#endif
+		;
+}
+
+// "x,y,z,..." -> up to n floats; returns how many were read
+//
+static int parseFloats(const string& s, float* values, int n) {
+	istringstream iss(s);
+	string item;
+	int count = 0;
+	while (count < n && getline(iss, item, ',')) {
+		try {
+			values[count] = stof(item);
+		}
+		catch (...) {
+			return count;
+		}
+		count++;
+	}
+	return count;
+}
+
+static bool formatFromName(const string& path, ImageFormat& format) {
+	string ext = ofToLower(ofFilePath::getFileExt(path));
+	if (ext == "png") format = ImageFormat::PNG;
+	else if (ext == "ppm") format = ImageFormat::PPM;
+	else if (ext == "pfm") format = ImageFormat::PFM;
+	else if (ext == "exr") format = ImageFormat::EXR;
+	else return false;
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+
+	string scenePath = argv[1];
+	string outPath = "render.png";
+	int imageWidth = 1200;
+	int imageHeight = 800;
+	int numThreads = 0;
+	RenderSettings settings;
+	settings.lambert = true;
+	RenderCam renderCam;
+	vector<Light*> lights;
+	bool cameraGiven = false;
+	string tracePath;
+
+	for (int i = 2; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		float v[6];
+		int n;
+
+		if (arg == "-o" && hasValue) outPath = argv[++i];
+		else if (arg == "-size" && hasValue) {
+			if (sscanf(argv[++i], "%dx%d", &imageWidth, &imageHeight) != 2 || imageWidth <= 0 || imageHeight <= 0) {
+				cout << "bad image size " << argv[i] << endl;
+				return 1;
+			}
+		}
+		else if (arg == "-shading" && hasValue) {
+			string mode = argv[++i];
+			settings.lambert = mode == "lambert";
+			settings.phong = mode == "phong";
+			if (mode != "flat" && mode != "lambert" && mode != "phong") {
+				cout << "unknown shading " << mode << endl;
+				return 1;
+			}
+		}
+		else if (arg == "-threads" && hasValue) numThreads = std::max(atoi(argv[++i]), 0);
+		else if (arg == "-camera" && hasValue) {
+			if (parseFloats(argv[++i], v, 3) != 3) {
+				cout << "bad camera position " << argv[i] << endl;
+				return 1;
+			}
+
+			// the view plane stays at the same distance in front of the camera
+			//
+			glm::vec3 offset = glm::vec3(v[0], v[1], v[2]) - renderCam.position;
+			renderCam.position += offset;
+			renderCam.view.position += offset;
+			cameraGiven = true;
+		}
+		else if (arg == "-light" && hasValue) {
+			n = parseFloats(argv[++i], v, 4);
+			if (n < 3) {
+				cout << "bad light " << argv[i] << endl;
+				return 1;
+			}
+			Light* light = new PointLight("light" + to_string(lights.size()), n > 3 ? v[3] : 0.4f, ofColor::yellow);
+			light->position = glm::vec3(v[0], v[1], v[2]);
+			lights.push_back(light);
+		}
+		else if (arg == "-spherelight" && hasValue) {
+			n = parseFloats(argv[++i], v, 5);
+			if (n < 4) {
+				cout << "bad sphere light " << argv[i] << endl;
+				return 1;
+			}
+			Light* light = new SphereLight("light" + to_string(lights.size()), v[3], n > 4 ? v[4] : 0.4f, ofColor::yellow);
+			light->position = glm::vec3(v[0], v[1], v[2]);
+			lights.push_back(light);
+		}
+		else if (arg == "-rectlight" && hasValue) {
+			n = parseFloats(argv[++i], v, 6);
+			if (n < 5) {
+				cout << "bad rectangle light " << argv[i] << endl;
+				return 1;
+			}
+			Light* light = new RectLight("light" + to_string(lights.size()), v[3], v[4], n > 5 ? v[5] : 0.4f, ofColor::yellow);
+			light->position = glm::vec3(v[0], v[1], v[2]);
+			lights.push_back(light);
+		}
+		else if (arg == "-lightintensity" && hasValue) settings.lightIntensity = atof(argv[++i]);
+		else if (arg == "-power" && hasValue) settings.powerExponent = atof(argv[++i]);
+		else if (arg == "-textures") settings.textures = true;
+		else if (arg == "-aa") settings.antialias = true;
+		else if (arg == "-falloff" && hasValue) {
+			settings.lightFalloff = true;
+			settings.lightCutoff = atof(argv[++i]);
+		}
+		else if (arg == "-lightsamples" && hasValue) {
+			settings.sampleLights = true;
+			settings.lightSamples = std::max(atoi(argv[++i]), 1);
+		}
+		else if (arg == "-data" && hasValue) ofSetDataPathRoot(argv[++i]);
+#if RT_PROFILE
+		else if (arg == "-trace" && hasValue) tracePath = argv[++i];
+#endif
+		else {
+			cout << "unknown option " << arg << endl;
+			usage();
+			return 1;
+		}
+	}
+
+	ImageFormat format;
+	if (!formatFromName(outPath, format)) {
+		cout << "unknown image format " << outPath << endl;
+		return 1;
+	}
+
+	// the same wall and floor planes as the app, then the saved objects (and
+	// for a binary scene its lights and camera)
+	//
+	vector<SceneObject*> scene;
+	scene.push_back(new Plane(glm::vec3(0, -4, -10), glm::vec3(0, 0, 1), ofColor::darkGreen, 30, 30));
+	scene.push_back(new Plane(glm::vec3(0, -2, 0), glm::vec3(0, 1, 0), ofColor::darkRed, 30, 20));
+
+	// The file is parsed on the pool, and as soon as the bounds of the
+	// objects are known the BVH is built (also on the pool) while the
+	// loader creates the objects
+	//
+	uint64_t loadStartTime = ofGetElapsedTimeMillis();
+	ThreadPool pool(numThreads);
+	std::future<BVH> tree;
+	SceneLoadOptions loadOptions;
+	loadOptions.pool = &pool;
+	loadOptions.parsed = [&](vector<AABB>& bounds) {
+		vector<AABB> all;
+		all.reserve(scene.size() + bounds.size());
+		for (auto object : scene) all.push_back(object->getBounds());
+		all.insert(all.end(), bounds.begin(), bounds.end());
+		tree = std::async(std::launch::async, [&pool, all = std::move(all)]() {
+			BVH bvh;
+			bvh.maxLeafSize = 8;
+			bvh.build(all, pool);
+			return bvh;
+		});
+	};
+	string absolutePath = ofFilePath::getAbsolutePath(scenePath, false);
+	if (ofToLower(ofFilePath::getFileExt(scenePath)) == "rtscene") {
+		if (!loadSceneBinary(absolutePath, scene, lights, cameraGiven ? NULL : &renderCam, loadOptions)) return 1;
+	}
+	else if (!loadSceneText(absolutePath, scene, loadOptions)) return 1;
+	cout << "loaded " << scene.size() - 2 << " objects in " << ofGetElapsedTimeMillis() - loadStartTime << " ms" << endl;
+	if (lights.empty()) cout << "no lights given, only flat shading will show anything" << endl;
+
+	uint64_t startTime = ofGetElapsedTimeMillis();
+	TextureCache textureCache;
+	RenderScene renderScene;
+
+	// everything before the trace, timed as one phase
+	//
+	{
+		PROFILE_SCOPE("setup");
+		for (auto object : scene) object->getMatrix();
+		for (auto light : lights) light->getMatrix();
+
+		renderScene.copyObjects(scene, lights);
+		renderScene.sceneBVH = tree.get();
+		renderScene.buildSceneSpheres();
+		renderScene.renderCam = renderCam;
+		settings.pixelSpread = renderCam.view.width() / imageWidth / fabs(renderCam.position.z - renderCam.view.position.z);
+		renderScene.settings = settings;
+		renderScene.backgroundColor = ofColor::black;
+		if (settings.textures) {
+			renderScene.floorTexture = textureCache.get("floor.jpg");
+			renderScene.wallTexture = textureCache.get("wall3.jpg");
+		}
+		renderScene.imageWidth = imageWidth;
+		renderScene.imageHeight = imageHeight;
+	}
+
+	FrameBuffer frameBuffer;
+	frameBuffer.resize(imageWidth, imageHeight);
+	vector<GBufferSample> gBuffer((size_t)imageWidth * imageHeight);
+	renderScene.gBuffer = gBuffer.data();
+
+	std::atomic<bool> cancel{ false };
+	renderScene.render(frameBuffer, pool, cancel);
+	uint64_t renderTime = ofGetElapsedTimeMillis() - startTime;
+
+	if (!ImageWriter::save(frameBuffer, outPath, format)) {
+		cout << "can't write " << outPath << endl;
+		return 1;
+	}
+#if RT_PROFILE
+	Profiler::printSummary();
+	if (!tracePath.empty() && !Profiler::writeTrace(tracePath)) cout << "can't write " << tracePath << endl;
+#endif
+	cout << "Rendered " << scene.size() - 2 << " objects, " << lights.size() << " lights at " << imageWidth << "x" << imageHeight
+		<< " in " << renderTime << " ms on " << pool.size() << " threads to " << outPath << endl;
+
+	for (auto object : scene) delete object;
+	for (auto light : lights) delete light;
+	return 0;
+}
@@ -0,0 +1,57 @@
+//
+//  AliasTable.cpp - Walker/Vose alias table construction
+//
+
+#include "AliasTable.h"
+
+// Vose's version: buckets are filled from two work lists, outcomes below
+// the average weight topped up by ones above it, so no sorting is needed
+// and round off can't leave a bucket unfilled.
+//
+bool AliasTable::build(const std::vector<float>& weights) {
+	clear();
+	int n = (int)weights.size();
+	double total = 0;
+	for (float w : weights) if (w > 0) total += w;
+	if (n == 0 || total <= 0) return false;
+
+	prob.resize(n);
+	alias.resize(n);
+	pdf.resize(n);
+
+	std::vector<double> scaled(n);
+	std::vector<int> small, large;
+	for (int i = 0; i < n; i++) {
+		double w = weights[i] > 0 ? weights[i] : 0;
+		pdf[i] = (float)(w / total);
+		scaled[i] = w * n / total;
+		if (scaled[i] < 1) small.push_back(i);
+		else large.push_back(i);
+	}
+
+	while (!small.empty() && !large.empty()) {
+		int s = small.back();
+		small.pop_back();
+		int l = large.back();
+		prob[s] = (float)scaled[s];
+		alias[s] = l;
+
+		scaled[l] -= 1 - scaled[s];
+		if (scaled[l] < 1) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	// whatever is left is full, up to round off
+	//
+	for (int i : large) {
+		prob[i] = 1;
+		alias[i] = i;
+	}
+	for (int i : small) {
+		prob[i] = 1;
+		alias[i] = i;
+	}
+	return true;
+}
@@ -0,0 +1,36 @@
+//
+//  AliasTable.h - constant time sampling from a discrete distribution
+//
+//  Walker's alias method: the n outcomes are split into n equally likely
+//  buckets, and bucket i holds outcome i with probability prob[i] and
+//  outcome alias[i] otherwise.  Building is O(n), drawing a sample takes one
+//  random number and one table lookup.
+//
+#pragma once
+
+#include <vector>
+
+class AliasTable {
+public:
+	// Set up for outcomes with the given (not normalized) weights.  Returns
+	// false, leaving the table empty, if no weight is above 0.
+	//
+	bool build(const std::vector<float>& weights);
+	void clear() { prob.clear(); alias.clear(); pdf.clear(); }
+	bool empty() const { return prob.empty(); }
+	int size() const { return (int)prob.size(); }
+
+	// outcome for a uniform random number u in [0, 1)
+	//
+	int sample(float u) const {
+		int n = (int)prob.size();
+		float x = u * n;
+		int i = (int)x;
+		if (i >= n) i = n - 1;
+		return x - i < prob[i] ? i : alias[i];
+	}
+
+	std::vector<float> prob;     // chance bucket i keeps outcome i
+	std::vector<int> alias;      // the other outcome of bucket i
+	std::vector<float> pdf;      // probability of each outcome, weight / total
+};
@@ -0,0 +1,454 @@
+//
+//  BVH.cpp - SAH build of the bounding volume hierarchy, and the scalar, SSE
+//  and AVX2 packet vs. box kernels used by closestHitPacket()
+//
+
+#include "BVH.h"
+#include "ThreadPool.h"
+#include "Simd.h"
+#include <cstring>
+#include <random>
+#include <iostream>
+
+void BVH::build(const std::vector<AABB>& primBounds) {
+	clear();
+
+	int n = (int)primBounds.size();
+	if (n == 0) return;
+
+	primIndices.resize(n);
+	std::vector<glm::vec3> centroids(n);
+	for (int i = 0; i < n; i++) {
+		primIndices[i] = i;
+		centroids[i] = primBounds[i].center();
+	}
+
+	nodes.reserve(2 * n);
+	BVHNode root;
+	root.first = 0;
+	root.count = n;
+	nodes.push_back(root);
+	subdivide(0, 0, primBounds, centroids);
+
+	this->primBounds = primBounds;
+	finishBuild();
+}
+
+// leaf of every primitive and the cost of the new tree
+//
+void BVH::finishBuild() {
+	primLeaf.resize(primIndices.size());
+	builtCost = 0;
+	for (int i = 0; i < (int)nodes.size(); i++) {
+		builtCost += nodeCost(i);
+		if (!nodes[i].isLeaf()) continue;
+		for (int k = 0; k < nodes[i].count; k++) primLeaf[primIndices[nodes[i].first + k]] = i;
+	}
+	currentCost = builtCost;
+}
+
+// Copy the subtree under "node" of part into out (preorder, so children
+// still come after their parent), moving its leaf ranges by primOffset.
+// Returns the index of the copy of "node".
+//
+static int copySubtree(BVH& out, const BVH& part, int node, int parent, int primOffset, int depth, int& deepest) {
+	int index = (int)out.nodes.size();
+	out.nodes.push_back(part.nodes[node]);
+	out.nodes[index].parent = parent;
+	out.nodes[index].first += primOffset;
+	deepest = std::max(deepest, depth);
+	if (part.nodes[node].isLeaf()) return index;
+
+	int left = copySubtree(out, part, part.nodes[node].left, index, primOffset, depth + 1, deepest);
+	int right = copySubtree(out, part, part.nodes[node].right, index, primOffset, depth + 1, deepest);
+	out.nodes[index].left = left;
+	out.nodes[index].right = right;
+	return index;
+}
+
+// Copy the top levels, putting in the subtree built for a top level leaf
+// (subtreeOf[node] >= 0) in its place
+//
+static int copyTop(BVH& out, const BVH& top, int node, const std::vector<int>& subtreeOf, const std::vector<BVH>& subtrees,
+	int parent, int depth, int& deepest) {
+	const BVHNode& topNode = top.nodes[node];
+	if (subtreeOf[node] >= 0) return copySubtree(out, subtrees[subtreeOf[node]], 0, parent, topNode.first, depth, deepest);
+
+	int index = (int)out.nodes.size();
+	out.nodes.push_back(topNode);
+	out.nodes[index].parent = parent;
+	deepest = std::max(deepest, depth);
+	if (topNode.isLeaf()) return index;
+
+	int left = copyTop(out, top, topNode.left, subtreeOf, subtrees, index, depth + 1, deepest);
+	int right = copyTop(out, top, topNode.right, subtreeOf, subtrees, index, depth + 1, deepest);
+	out.nodes[index].left = left;
+	out.nodes[index].right = right;
+	return index;
+}
+
+// A subtree sees its primitives in the order the top levels left them, and
+// the split of a node only depends on its primitives and their order, so
+// the subtrees come out exactly as build() would have made them.
+//
+void BVH::build(const std::vector<AABB>& primBounds, ThreadPool& pool) {
+	int n = (int)primBounds.size();
+	int subtreeSize = std::max(n / (8 * pool.size()), 4096);
+	if (n <= subtreeSize) {
+		build(primBounds);
+		return;
+	}
+
+	BVH top;
+	top.maxLeafSize = maxLeafSize;
+	top.stopCount = subtreeSize;
+	top.build(primBounds);
+
+	std::vector<int> subtreeOf(top.nodes.size(), -1);
+	std::vector<int> pending;
+	for (int i = 0; i < (int)top.nodes.size(); i++) {
+		if (top.nodes[i].count <= 1) continue;
+		subtreeOf[i] = (int)pending.size();
+		pending.push_back(i);
+	}
+
+	std::vector<BVH> subtrees(pending.size());
+	pool.parallelFor((int)pending.size(), [&](int task, int /*worker*/) {
+		const BVHNode& leaf = top.nodes[pending[task]];
+		std::vector<AABB> bounds(leaf.count);
+		for (int k = 0; k < leaf.count; k++) bounds[k] = primBounds[top.primIndices[leaf.first + k]];
+		subtrees[task].maxLeafSize = maxLeafSize;
+		subtrees[task].build(bounds);
+	});
+
+	// a subtree's primIndices are positions in its range of the top's
+	//
+	clear();
+	primIndices = top.primIndices;
+	for (int task = 0; task < (int)pending.size(); task++) {
+		const BVHNode& leaf = top.nodes[pending[task]];
+		const std::vector<int>& local = subtrees[task].primIndices;
+		for (int k = 0; k < leaf.count; k++) primIndices[leaf.first + k] = top.primIndices[leaf.first + local[k]];
+	}
+	int deepest = 0;
+	nodes.reserve(2 * n);
+	copyTop(*this, top, 0, subtreeOf, subtrees, -1, 0, deepest);
+
+	// the subtrees were built with the whole depth budget each
+	//
+	if (deepest > maxDepth) {
+		build(primBounds);
+		return;
+	}
+	this->primBounds = primBounds;
+	finishBuild();
+}
+
+AABB BVH::leafBounds(int i) const {
+	AABB b;
+	for (int k = 0; k < nodes[i].count; k++) b.grow(primBounds[primIndices[nodes[i].first + k]]);
+	return b;
+}
+
+// Walk from the primitive's leaf up to the root, growing or shrinking each
+// node to fit its children.  Stops early once a node comes out unchanged,
+// since nothing above it can change either.
+//
+void BVH::refit(int prim, const AABB& bounds) {
+	if (prim < 0 || prim >= (int)primLeaf.size()) return;
+	primBounds[prim] = bounds;
+
+	int i = primLeaf[prim];
+	AABB b = leafBounds(i);
+	while (i >= 0) {
+		if (b == nodes[i].bounds) break;
+		currentCost -= nodeCost(i);
+		nodes[i].bounds = b;
+		currentCost += nodeCost(i);
+
+		i = nodes[i].parent;
+		if (i >= 0) {
+			b = nodes[nodes[i].left].bounds;
+			b.grow(nodes[nodes[i].right].bounds);
+		}
+	}
+}
+
+// Children are always stored after their parent, so a single backwards
+// pass over the node array visits every child before its parent.
+//
+void BVH::refitAll(const std::vector<AABB>& bounds) {
+	if (bounds.size() != primBounds.size()) return;
+	primBounds = bounds;
+
+	currentCost = 0;
+	for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+		if (nodes[i].isLeaf()) {
+			nodes[i].bounds = leafBounds(i);
+		}
+		else {
+			nodes[i].bounds = nodes[nodes[i].left].bounds;
+			nodes[i].bounds.grow(nodes[nodes[i].right].bounds);
+		}
+		currentCost += nodeCost(i);
+	}
+}
+
+// Split a node in two using the binned surface area heuristic.  The node
+// stays a leaf if it is small enough, can not be split (all centroids in one
+// spot) or if splitting is estimated to be more expensive than not.
+//
+void BVH::subdivide(int nodeIndex, int depth, const std::vector<AABB>& primBounds, const std::vector<glm::vec3>& centroids) {
+	int first = nodes[nodeIndex].first;
+	int count = nodes[nodeIndex].count;
+
+	AABB bounds, centroidBounds;
+	for (int i = first; i < first + count; i++) {
+		bounds.grow(primBounds[primIndices[i]]);
+		centroidBounds.grow(centroids[primIndices[i]]);
+	}
+	nodes[nodeIndex].bounds = bounds;
+
+	if (count <= 1 || count <= stopCount || depth >= maxDepth) return;
+
+	// evaluate every bin boundary on every axis
+	//
+	float bestCost = std::numeric_limits<float>::max();
+	int bestAxis = -1;
+	int bestSplit = 0;
+	glm::vec3 cmin = centroidBounds.min;
+	glm::vec3 cext = centroidBounds.extent();
+
+	for (int axis = 0; axis < 3; axis++) {
+		if (cext[axis] <= 0) continue;
+
+		AABB binBounds[numBins];
+		int binCount[numBins] = { 0 };
+		float scale = numBins / cext[axis];
+		for (int i = first; i < first + count; i++) {
+			int prim = primIndices[i];
+			int b = std::min(numBins - 1, (int)((centroids[prim][axis] - cmin[axis]) * scale));
+			binCount[b]++;
+			binBounds[b].grow(primBounds[prim]);
+		}
+
+		// sweep from the right to get the area/count of every right side,
+		// then from the left to evaluate each split
+		//
+		float rightArea[numBins];
+		int rightCount[numBins];
+		AABB acc;
+		int n = 0;
+		for (int b = numBins - 1; b > 0; b--) {
+			acc.grow(binBounds[b]);
+			n += binCount[b];
+			rightArea[b] = acc.area();
+			rightCount[b] = n;
+		}
+		acc = AABB();
+		n = 0;
+		for (int b = 1; b < numBins; b++) {
+			acc.grow(binBounds[b - 1]);
+			n += binCount[b - 1];
+			if (n == 0 || rightCount[b] == 0) continue;
+			float cost = n * acc.area() + rightCount[b] * rightArea[b];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+			}
+		}
+	}
+	if (bestAxis < 0) return;
+
+	// cost of traversing one more node vs. intersecting everything in this one
+	// (both relative to the cost of one primitive test)
+	//
+	const float traversalCost = 1.0f;
+	float splitCost = traversalCost + bestCost / bounds.area();
+	if (count <= maxLeafSize && splitCost >= count) return;
+
+	float scale = numBins / cext[bestAxis];
+	int* mid = std::partition(&primIndices[first], &primIndices[first] + count, [&](int prim) {
+		int b = std::min(numBins - 1, (int)((centroids[prim][bestAxis] - cmin[bestAxis]) * scale));
+		return b < bestSplit;
+	});
+	int leftCount = (int)(mid - &primIndices[first]);
+	if (leftCount == 0 || leftCount == count) return;
+
+	BVHNode left, right;
+	left.first = first;
+	left.count = leftCount;
+	left.parent = nodeIndex;
+	right.first = first + leftCount;
+	right.count = count - leftCount;
+	right.parent = nodeIndex;
+
+	int leftIndex = (int)nodes.size();
+	nodes.push_back(left);
+	nodes.push_back(right);
+
+	nodes[nodeIndex].left = leftIndex;
+	nodes[nodeIndex].right = leftIndex + 1;
+	nodes[nodeIndex].count = 0;
+
+	subdivide(leftIndex, depth + 1, primBounds, centroids);
+	subdivide(leftIndex + 1, depth + 1, primBounds, centroids);
+}
+
+int intersectBoxPacketScalar(const AABB& bounds, const RayPacket& packet, int laneMask, const float* tMax, float& tEntry) {
+	int hitMask = 0;
+	tEntry = std::numeric_limits<float>::max();
+	for (int lane = 0; lane < RayPacket::width; lane++) {
+		if (!(laneMask & (1 << lane))) continue;
+		float t;
+		if (bounds.intersect(packet.origin(lane), packet.invDirection(lane), tMax[lane], t)) {
+			hitMask |= 1 << lane;
+			tEntry = std::min(tEntry, t);
+		}
+	}
+	return hitMask;
+}
+
+#ifdef RT_X86
+
+// The SIMD kernels leave each lane's entry distance in tNear; take the
+// minimum over the lanes that hit in lane order, as the scalar loop does.
+//
+static float nearestEntry(const float* tNear, int hitMask) {
+	float tEntry = std::numeric_limits<float>::max();
+	for (int lane = 0; lane < RayPacket::width; lane++) {
+		if (hitMask & (1 << lane)) tEntry = std::min(tEntry, tNear[lane]);
+	}
+	return tEntry;
+}
+
+// The slab test of AABB::intersect on lanes [lane, lane + 4).  std::min(a, b)
+// is "b < a ? b : a", which is _mm_min_ps(b, a) also when one of them is NaN
+// (0 * inf for a ray in the plane of a face), so the operands are swapped
+// everywhere to give the scalar results bit for bit.
+//
+static int intersectBoxLanesSSE(const AABB& b, const RayPacket& packet, int lane, const float* tMax, float* tNear) {
+	const __m128 ox = _mm_loadu_ps(packet.ox + lane), oy = _mm_loadu_ps(packet.oy + lane), oz = _mm_loadu_ps(packet.oz + lane);
+	const __m128 ix = _mm_loadu_ps(packet.ix + lane), iy = _mm_loadu_ps(packet.iy + lane), iz = _mm_loadu_ps(packet.iz + lane);
+
+	__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.min.x), ox), ix);
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.max.x), ox), ix);
+	__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.min.y), oy), iy);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.max.y), oy), iy);
+	__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.min.z), oz), iz);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.max.z), oz), iz);
+	__m128 tNear4 = _mm_max_ps(_mm_min_ps(t1z, t0z), _mm_max_ps(_mm_min_ps(t1y, t0y), _mm_min_ps(t1x, t0x)));
+	__m128 tFar4 = _mm_min_ps(_mm_max_ps(t1z, t0z), _mm_min_ps(_mm_max_ps(t1y, t0y), _mm_max_ps(t1x, t0x)));
+
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(tNear4, tFar4), _mm_cmpge_ps(tFar4, _mm_setzero_ps()));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(tNear4, _mm_loadu_ps(tMax + lane)));
+	_mm_storeu_ps(tNear + lane, tNear4);
+	return _mm_movemask_ps(hit) << lane;
+}
+
+static int intersectBoxPacketSSE(const AABB& bounds, const RayPacket& packet, int laneMask, const float* tMax, float& tEntry) {
+	alignas(16) float tNear[RayPacket::width];
+	int hitMask = 0;
+	for (int lane = 0; lane < RayPacket::width; lane += 4) {
+		if ((laneMask >> lane) & 0xf) hitMask |= intersectBoxLanesSSE(bounds, packet, lane, tMax, tNear);
+	}
+	hitMask &= laneMask;
+	tEntry = nearestEntry(tNear, hitMask);
+	return hitMask;
+}
+
+RT_TARGET_AVX2
+static int intersectBoxPacketAVX2(const AABB& b, const RayPacket& packet, int laneMask, const float* tMax, float& tEntry) {
+	const __m256 ox = _mm256_loadu_ps(packet.ox), oy = _mm256_loadu_ps(packet.oy), oz = _mm256_loadu_ps(packet.oz);
+	const __m256 ix = _mm256_loadu_ps(packet.ix), iy = _mm256_loadu_ps(packet.iy), iz = _mm256_loadu_ps(packet.iz);
+
+	__m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.min.x), ox), ix);
+	__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.max.x), ox), ix);
+	__m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.min.y), oy), iy);
+	__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.max.y), oy), iy);
+	__m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.min.z), oz), iz);
+	__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(b.max.z), oz), iz);
+	__m256 tNear8 = _mm256_max_ps(_mm256_min_ps(t1z, t0z), _mm256_max_ps(_mm256_min_ps(t1y, t0y), _mm256_min_ps(t1x, t0x)));
+	__m256 tFar8 = _mm256_min_ps(_mm256_max_ps(t1z, t0z), _mm256_min_ps(_mm256_max_ps(t1y, t0y), _mm256_max_ps(t1x, t0x)));
+
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tNear8, tFar8, _CMP_LE_OQ), _mm256_cmp_ps(tFar8, _mm256_setzero_ps(), _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tNear8, _mm256_loadu_ps(tMax), _CMP_LE_OQ));
+
+	alignas(32) float tNear[RayPacket::width];
+	_mm256_store_ps(tNear, tNear8);
+	int hitMask = _mm256_movemask_ps(hit) & laneMask;
+	tEntry = nearestEntry(tNear, hitMask);
+	return hitMask;
+}
+
+#endif // RT_X86
+
+typedef int (*BoxPacketKernel)(const AABB&, const RayPacket&, int, const float*, float&);
+
+static BoxPacketKernel chooseBoxPacketKernel() {
+#ifdef RT_X86
+	if (cpuHasAVX2()) return intersectBoxPacketAVX2;
+	return intersectBoxPacketSSE;
+#else
+	return intersectBoxPacketScalar;
+#endif
+}
+
+static BoxPacketKernel boxPacketKernel = chooseBoxPacketKernel();
+
+int intersectBoxPacket(const AABB& bounds, const RayPacket& packet, int laneMask, const float* tMax, float& tEntry) {
+	return boxPacketKernel(bounds, packet, laneMask, tMax, tEntry);
+}
+
+// Random boxes against random packets with random lanes switched off.  Some
+// boxes are flat, some origins lie on a face and some directions have +0 or
+// -0 components, so the infinite and NaN slab distances get checked too.
+//
+static bool verifyBoxKernel(const char* name, BoxPacketKernel kernel, int numPackets) {
+	std::mt19937 rng(118);
+	std::uniform_real_distribution<float> coord(-10, 10);
+	std::uniform_real_distribution<float> extent(0.1f, 6.0f);
+
+	int mismatches = 0;
+	for (int r = 0; r < numPackets; r++) {
+		AABB box;
+		box.min = glm::vec3(coord(rng), coord(rng), coord(rng));
+		box.max = box.min + glm::vec3(extent(rng), extent(rng), extent(rng));
+		if (r % 9 == 0) box.max.y = box.min.y;
+
+		glm::vec3 orig(coord(rng), coord(rng), coord(rng));
+		for (int axis = 0; axis < 3; axis++) {
+			if (rng() % 4 == 0) orig[axis] = (rng() & 1) ? box.min[axis] : box.max[axis];
+		}
+
+		RayPacket packet;
+		float tMax[RayPacket::width];
+		for (int lane = 0; lane < RayPacket::width; lane++) {
+			glm::vec3 dir = glm::normalize(box.center() - orig + glm::vec3(coord(rng), coord(rng), coord(rng)) * 0.3f);
+			for (int axis = 0; axis < 3; axis++) {
+				if (rng() % 8 == 0) dir[axis] = (rng() & 1) ? 0.0f : -0.0f;
+			}
+			packet.set(lane, orig, dir);
+			tMax[lane] = (lane % 3 == 0) ? coord(rng) + 10 : std::numeric_limits<float>::infinity();
+		}
+		int laneMask = (int)(rng() & RayPacket::allLanes);
+
+		float tScalar, tKernel;
+		int mScalar = intersectBoxPacketScalar(box, packet, laneMask, tMax, tScalar);
+		int mKernel = kernel(box, packet, laneMask, tMax, tKernel);
+		if (mScalar != mKernel || std::memcmp(&tScalar, &tKernel, sizeof(float)) != 0) mismatches++;
+	}
+	std::cout << "box packet kernel " << name << ": " << (mismatches ? "MISMATCH" : "ok") << " ("
+		<< mismatches << " of " << numPackets << " packets differ from scalar)" << std::endl;
+	return mismatches == 0;
+}
+
+bool verifyBoxKernels(int numPackets) {
+	bool ok = true;
+#ifdef RT_X86
+	ok = verifyBoxKernel("SSE", intersectBoxPacketSSE, numPackets) && ok;
+	if (cpuHasAVX2()) ok = verifyBoxKernel("AVX2", intersectBoxPacketAVX2, numPackets) && ok;
+#endif
+	return ok;
+}
@@ -0,0 +1,369 @@
+//
+//  BVH.h - bounding volume hierarchy over a list of axis aligned boxes
+//
+//  The tree only knows about the boxes it was built from; the caller supplies
+//  a callback that intersects primitive i (index into the list passed to build()).
+//  This keeps the BVH independent of SceneObject so it can be used for anything
+//  that has bounds.
+//
+//  The tree is built top down with the surface area heuristic (SAH), evaluated
+//  on 16 bins per axis.  When a primitive moves, refit() updates just its leaf
+//  and the leaf's ancestors; costRatio() tells how much the tree has degraded
+//  since it was built so the caller can decide when to rebuild.
+//
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "glm/glm.hpp"
+#include "RayPacket.h"
+#include "Profiler.h"
+
+class ThreadPool;
+
+//  Axis aligned bounding box (world space)
+//
+struct AABB {
+	AABB() {}
+	AABB(const glm::vec3& min, const glm::vec3& max) { this->min = min; this->max = max; }
+
+	void grow(const glm::vec3& p) { min = glm::min(min, p); max = glm::max(max, p); }
+	void grow(const AABB& b) { min = glm::min(min, b.min); max = glm::max(max, b.max); }
+
+	glm::vec3 center() const { return (min + max) * 0.5f; }
+	glm::vec3 extent() const { return max - min; }
+	bool isEmpty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+	bool contains(const glm::vec3& p) const {
+		return p.x >= min.x && p.y >= min.y && p.z >= min.z && p.x <= max.x && p.y <= max.y && p.z <= max.z;
+	}
+	bool operator==(const AABB& b) const { return min == b.min && max == b.max; }
+
+	// surface area, used by the SAH
+	//
+	float area() const {
+		if (isEmpty()) return 0;
+		glm::vec3 e = extent();
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
+	// slab test; tEntry is the distance at which the ray enters the box
+	// (negative if the origin is inside)
+	//
+	bool intersect(const glm::vec3& orig, const glm::vec3& invDir, float tMax, float& tEntry) const {
+		float t0x = (min.x - orig.x) * invDir.x;
+		float t1x = (max.x - orig.x) * invDir.x;
+		float t0y = (min.y - orig.y) * invDir.y;
+		float t1y = (max.y - orig.y) * invDir.y;
+		float t0z = (min.z - orig.z) * invDir.z;
+		float t1z = (max.z - orig.z) * invDir.z;
+		float tNear = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)), std::min(t0z, t1z));
+		float tFar = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)), std::max(t0z, t1z));
+		tEntry = tNear;
+		return tNear <= tFar && tFar >= 0 && tNear <= tMax;
+	}
+
+	glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+};
+
+struct BVHNode {
+	AABB bounds;
+	int left = -1;       // child nodes (interior nodes only)
+	int right = -1;
+	int parent = -1;
+	int first = 0;       // range in BVH::primIndices (leaf nodes only)
+	int count = 0;
+
+	bool isLeaf() const { return count > 0; }
+};
+
+// Lanes of laneMask whose ray enters the box before their tMax, all lanes at
+// once with SSE or AVX2.  tEntry is the nearest entry distance over those
+// lanes, used to order children.  Each lane gives exactly what
+// AABB::intersect() would for that ray alone.
+//
+int intersectBoxPacket(const AABB& bounds, const RayPacket& packet, int laneMask, const float* tMax, float& tEntry);
+
+// reference version, one lane at a time
+//
+int intersectBoxPacketScalar(const AABB& bounds, const RayPacket& packet, int laneMask, const float* tMax, float& tEntry);
+
+// Run every box kernel the CPU supports on random packets and boxes and check
+// the results match the scalar path bit for bit.  Prints a line per kernel.
+//
+bool verifyBoxKernels(int numPackets = 10000);
+
+class BVH {
+public:
+	// (re)build the tree over primBounds; primitive i is primBounds[i]
+	//
+	void build(const std::vector<AABB>& primBounds);
+
+	// Same tree as build(), with the work shared by the pool: the top levels
+	// are split here until there are a few subtrees per worker, then the
+	// workers build those and they are joined under the top levels.  Small
+	// inputs are just built here.
+	//
+	void build(const std::vector<AABB>& primBounds, ThreadPool& pool);
+
+	void clear() { nodes.clear(); primIndices.clear(); primBounds.clear(); primLeaf.clear(); builtCost = currentCost = 0; }
+	bool empty() const { return nodes.empty(); }
+
+	// Give primitive "prim" new bounds and refit its leaf and all of the leaf's
+	// ancestors, O(depth).  The topology is not changed.
+	//
+	void refit(int prim, const AABB& bounds);
+
+	// Refit every node from a full set of new bounds, O(n)
+	//
+	void refitAll(const std::vector<AABB>& bounds);
+
+	// Drop the per-primitive data only refits need, for trees over geometry
+	// that never moves relative to the tree (e.g. the triangles of a mesh).
+	// refit() and refitAll() do nothing afterwards.
+	//
+	void releaseRefitData() {
+		std::vector<AABB>().swap(primBounds);
+		std::vector<int>().swap(primLeaf);
+	}
+
+	// SAH cost of the tree now relative to right after build().  Goes up as
+	// refits make nodes larger and overlap more.
+	//
+	float costRatio() const { return builtCost > 0 ? currentCost / builtCost : 1.0f; }
+
+	// Closest hit.  intersectPrim(prim, tMax) must test primitive "prim" and, on a
+	// hit closer than tMax, shrink tMax to the hit distance and return true.
+	// Nodes further away than the current tMax are skipped, near child first.
+	//
+	template<class F>
+	bool closestHit(const glm::vec3& orig, const glm::vec3& dir, float& tMax, F&& intersectPrim) const;
+
+	// Any hit.  Stops as soon as occludes(prim) returns true.
+	//
+	template<class F>
+	bool anyHit(const glm::vec3& orig, const glm::vec3& dir, float tMax, F&& occludes) const;
+
+	// Same as above, but the callback gets a whole leaf at a time:
+	// intersectLeaf(first, count, tMax) / occludesLeaf(first, count, tMax) test
+	// primitives primIndices[first .. first + count).  A caller that stores its
+	// primitives in primIndices order can then test a leaf with SIMD.
+	//
+	template<class F>
+	bool closestHitLeaves(const glm::vec3& orig, const glm::vec3& dir, float& tMax, F&& intersectLeaf) const;
+	template<class F>
+	bool anyHitLeaves(const glm::vec3& orig, const glm::vec3& dir, float tMax, F&& occludesLeaf) const;
+
+	// every leaf whose box contains p, as visitLeaf(first, count)
+	//
+	template<class F>
+	void pointQuery(const glm::vec3& p, F&& visitLeaf) const;
+
+	// Closest hit for the lanes of a packet in activeMask; tMax[lane] is each
+	// lane's current closest hit.  A node is entered if any active lane hits
+	// its box, and only those lanes go on into the subtree.  Leaves are handed
+	// to intersectLeaf(first, count, laneMask, tMax).  Once a subtree is down
+	// to a single lane the packet has diverged and that lane finishes the
+	// subtree on its own through intersectLeafSingle(lane, first, count, tMax).
+	//
+	template<class F, class G>
+	void closestHitPacket(const RayPacket& packet, int activeMask, float* tMax, F&& intersectLeaf, G&& intersectLeafSingle) const;
+
+	std::vector<BVHNode> nodes;        // nodes[0] is the root
+	std::vector<int> primIndices;      // leaves reference ranges of this array
+	std::vector<AABB> primBounds;      // current bounds of every primitive
+	std::vector<int> primLeaf;         // leaf node holding each primitive
+
+	int maxLeafSize = 4;
+
+	static const int maxDepth = 60;    // keeps the traversal stack bounded
+	static const int numBins = 16;
+
+private:
+	template<class F>
+	bool closestHitFrom(int root, float tRoot, const glm::vec3& orig, const glm::vec3& invDir, float& tMax, F&& intersectLeaf) const;
+
+	float nodeCost(int i) const { return nodes[i].bounds.area() * (nodes[i].isLeaf() ? nodes[i].count : 1); }
+	AABB leafBounds(int i) const;
+
+	float builtCost = 0;
+	float currentCost = 0;
+	int stopCount = 0;       // nodes this small are not split (top levels of a parallel build)
+	void finishBuild();
+
+	void subdivide(int nodeIndex, int depth, const std::vector<AABB>& primBounds, const std::vector<glm::vec3>& centroids);
+};
+
+template<class F>
+bool BVH::closestHit(const glm::vec3& orig, const glm::vec3& dir, float& tMax, F&& intersectPrim) const {
+	return closestHitLeaves(orig, dir, tMax, [&](int first, int count, float& t) {
+		bool hit = false;
+		for (int i = first; i < first + count; i++) {
+			if (intersectPrim(primIndices[i], t)) hit = true;
+		}
+		return hit;
+	});
+}
+
+template<class F>
+bool BVH::anyHit(const glm::vec3& orig, const glm::vec3& dir, float tMax, F&& occludes) const {
+	return anyHitLeaves(orig, dir, tMax, [&](int first, int count, float t) {
+		for (int i = first; i < first + count; i++) {
+			if (occludes(primIndices[i])) return true;
+		}
+		return false;
+	});
+}
+
+template<class F>
+bool BVH::closestHitLeaves(const glm::vec3& orig, const glm::vec3& dir, float& tMax, F&& intersectLeaf) const {
+	if (nodes.empty()) return false;
+
+	glm::vec3 invDir = 1.0f / dir;
+	float tEntry;
+	if (!nodes[0].bounds.intersect(orig, invDir, tMax, tEntry)) return false;
+	return closestHitFrom(0, tEntry, orig, invDir, tMax, intersectLeaf);
+}
+
+// single ray traversal of the subtree under "root" (whose box the ray is
+// already known to enter at tRoot)
+//
+template<class F>
+bool BVH::closestHitFrom(int root, float tRoot, const glm::vec3& orig, const glm::vec3& invDir, float& tMax, F&& intersectLeaf) const {
+	struct Entry { int node; float t; };
+	Entry stack[maxDepth + 4];
+	int sp = 0;
+	stack[sp++] = { root, tRoot };
+
+	bool hit = false;
+	while (sp > 0) {
+		Entry e = stack[--sp];
+		if (e.t > tMax) continue;   // a closer hit was found after this node was pushed
+
+		const BVHNode& node = nodes[e.node];
+		PROFILE_COUNT(ProfileBVHNodes);
+		if (node.isLeaf()) {
+			if (intersectLeaf(node.first, node.count, tMax)) hit = true;
+			continue;
+		}
+
+		float tLeft, tRight;
+		bool hitLeft = nodes[node.left].bounds.intersect(orig, invDir, tMax, tLeft);
+		bool hitRight = nodes[node.right].bounds.intersect(orig, invDir, tMax, tRight);
+		if (hitLeft && hitRight) {
+			// push the far child first so the near one is visited next
+			//
+			if (tLeft <= tRight) {
+				stack[sp++] = { node.right, tRight };
+				stack[sp++] = { node.left, tLeft };
+			}
+			else {
+				stack[sp++] = { node.left, tLeft };
+				stack[sp++] = { node.right, tRight };
+			}
+		}
+		else if (hitLeft) stack[sp++] = { node.left, tLeft };
+		else if (hitRight) stack[sp++] = { node.right, tRight };
+	}
+	return hit;
+}
+
+template<class F, class G>
+void BVH::closestHitPacket(const RayPacket& packet, int activeMask, float* tMax, F&& intersectLeaf, G&& intersectLeafSingle) const {
+	if (nodes.empty() || activeMask == 0) return;
+
+	struct Entry { int node; int mask; float t; };
+	Entry stack[maxDepth + 4];
+	int sp = 0;
+
+	float tEntry;
+	int rootMask = intersectBoxPacket(nodes[0].bounds, packet, activeMask, tMax, tEntry);
+	if (rootMask) stack[sp++] = { 0, rootMask, tEntry };
+
+	while (sp > 0) {
+		Entry e = stack[--sp];
+		const BVHNode& node = nodes[e.node];
+		PROFILE_COUNT(ProfileBVHNodes);
+
+		// one lane left: finish this subtree as a single ray
+		//
+		if ((e.mask & (e.mask - 1)) == 0) {
+			int lane = 0;
+			while (!(e.mask & (1 << lane))) lane++;
+			if (e.t > tMax[lane]) continue;
+			closestHitFrom(e.node, e.t, packet.origin(lane), packet.invDirection(lane), tMax[lane], [&](int first, int count, float& tLane) {
+				return intersectLeafSingle(lane, first, count, tLane);
+			});
+			continue;
+		}
+
+		if (node.isLeaf()) {
+			intersectLeaf(node.first, node.count, e.mask, tMax);
+			continue;
+		}
+
+		float tLeft, tRight;
+		int maskLeft = intersectBoxPacket(nodes[node.left].bounds, packet, e.mask, tMax, tLeft);
+		int maskRight = intersectBoxPacket(nodes[node.right].bounds, packet, e.mask, tMax, tRight);
+		if (maskLeft && maskRight) {
+			if (tLeft <= tRight) {
+				stack[sp++] = { node.right, maskRight, tRight };
+				stack[sp++] = { node.left, maskLeft, tLeft };
+			}
+			else {
+				stack[sp++] = { node.left, maskLeft, tLeft };
+				stack[sp++] = { node.right, maskRight, tRight };
+			}
+		}
+		else if (maskLeft) stack[sp++] = { node.left, maskLeft, tLeft };
+		else if (maskRight) stack[sp++] = { node.right, maskRight, tRight };
+	}
+}
+
+template<class F>
+bool BVH::anyHitLeaves(const glm::vec3& orig, const glm::vec3& dir, float tMax, F&& occludesLeaf) const {
+	if (nodes.empty()) return false;
+
+	glm::vec3 invDir = 1.0f / dir;
+	float tEntry;
+	int stack[maxDepth + 4];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	while (sp > 0) {
+		const BVHNode& node = nodes[stack[--sp]];
+		PROFILE_COUNT(ProfileBVHNodes);
+		if (!node.bounds.intersect(orig, invDir, tMax, tEntry)) continue;
+
+		if (node.isLeaf()) {
+			if (occludesLeaf(node.first, node.count, tMax)) return true;
+			continue;
+		}
+		stack[sp++] = node.right;
+		stack[sp++] = node.left;
+	}
+	return false;
+}
+
+template<class F>
+void BVH::pointQuery(const glm::vec3& p, F&& visitLeaf) const {
+	if (nodes.empty()) return;
+
+	int stack[maxDepth + 4];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	while (sp > 0) {
+		const BVHNode& node = nodes[stack[--sp]];
+		PROFILE_COUNT(ProfileBVHNodes);
+		if (!node.bounds.contains(p)) continue;
+
+		if (node.isLeaf()) {
+			visitLeaf(node.first, node.count);
+			continue;
+		}
+		stack[sp++] = node.right;
+		stack[sp++] = node.left;
+	}
+}
@@ -0,0 +1,73 @@
+//
+//  FrameBuffer.cpp - aligned float framebuffer and its 8 bit conversion
+//
+
+#include "FrameBuffer.h"
+#include "Simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+void FrameBuffer::resize(int width, int height) {
+	const size_t floatsPerLine = alignment / sizeof(float);
+	size_t newStride = ((size_t)width * 4 + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+	if (width == this->width && height == this->height && pixels) return;
+
+	this->width = width;
+	this->height = height;
+	stride = newStride;
+
+	// over-allocate by one line so the first row can be moved up to a
+	// 64 byte boundary
+	//
+	storage.assign(stride * height + floatsPerLine, 0.0f);
+	uintptr_t address = (uintptr_t)storage.data();
+	uintptr_t aligned = (address + alignment - 1) & ~(uintptr_t)(alignment - 1);
+	pixels = storage.data() + (aligned - address) / sizeof(float);
+}
+
+void FrameBuffer::clear(const glm::vec4& color) {
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) set(x, y, color);
+	}
+}
+
+void FrameBuffer::copyFrom(const FrameBuffer& other) {
+	resize(other.width, other.height);
+	for (int y = 0; y < height; y++) std::memcpy(row(y), other.row(y), (size_t)width * 4 * sizeof(float));
+}
+
+void FrameBuffer::toRGBA8(uint8_t* out, int x0, int y0, int x1, int y1) const {
+	for (int y = y0; y < y1; y++) {
+		const float* src = row(y);
+		uint8_t* dst = out + (size_t)y * width * 4;
+		int x = x0;
+
+#ifdef RT_X86
+		// 4 pixels (16 floats) per step: clamp, scale, round to nearest, then
+		// saturate-pack 32 -> 16 -> 8 bits.  A rectangle may start on any
+		// pixel, so the loads are unaligned.
+		//
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 scale = _mm_set1_ps(255.0f);
+		for (; x + 4 <= x1; x += 4) {
+			const float* p = src + 4 * x;
+			__m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p), zero), one), scale));
+			__m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p + 4), zero), one), scale));
+			__m128i c = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p + 8), zero), one), scale));
+			__m128i d = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(p + 12), zero), one), scale));
+			__m128i packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+			_mm_storeu_si128((__m128i*)(dst + 4 * x), packed);
+		}
+#endif
+
+		for (; x < x1; x++) {
+			for (int k = 0; k < 4; k++) {
+				float v = src[4 * x + k];
+				v = v > 0 ? std::min(v, 1.0f) : 0.0f;   // NaN goes to 0, as above
+				dst[4 * x + k] = (uint8_t)std::nearbyint(v * 255.0f);
+			}
+		}
+	}
+}
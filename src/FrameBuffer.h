@@ -0,0 +1,68 @@
+//
+//  FrameBuffer.h - float RGBA buffer the renderer traces into
+//
+//  Pixels are 4 floats (RGBA, nominally [0, 1]) with rows stored top to
+//  bottom, the way images are written out, so nothing needs flipping after a
+//  render.  Every row starts on a 64 byte boundary and the memory is only
+//  reallocated when the size changes, so renders of the same size reuse it.
+//
+//  toRGBA8() converts the whole buffer (or a rectangle of it) to 8 bit in one
+//  pass, 4 pixels at a time with SSE, straight into the caller's pixels
+//  (e.g. the ofPixels a preview texture is loaded from).
+//
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "glm/glm.hpp"
+
+class FrameBuffer {
+public:
+	FrameBuffer() {}
+	FrameBuffer(const FrameBuffer&) = delete;   // pixels points into storage
+	FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+	// keeps the current memory if the size doesn't change
+	//
+	void resize(int width, int height);
+	void clear(const glm::vec4& color = glm::vec4(0, 0, 0, 1));
+	void copyFrom(const FrameBuffer& other);
+
+	float* row(int y) { return pixels + (size_t)y * stride; }
+	const float* row(int y) const { return pixels + (size_t)y * stride; }
+
+	void set(int x, int y, const glm::vec4& color) {
+		float* p = row(y) + 4 * x;
+		p[0] = color.x;
+		p[1] = color.y;
+		p[2] = color.z;
+		p[3] = color.w;
+	}
+	glm::vec4 get(int x, int y) const {
+		const float* p = row(y) + 4 * x;
+		return glm::vec4(p[0], p[1], p[2], p[3]);
+	}
+
+	// clamp to [0, 1], scale and round to 8 bit RGBA, rows packed tightly
+	// (width * 4 bytes each) into out
+	//
+	void toRGBA8(uint8_t* out) const { toRGBA8(out, 0, 0, width, height); }
+
+	// just the pixels x0 <= x < x1, y0 <= y < y1, to the same place in out
+	//
+	void toRGBA8(uint8_t* out, int x0, int y0, int x1, int y1) const;
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	size_t getStride() const { return stride; }   // floats per row
+
+	static const int alignment = 64;
+
+private:
+	int width = 0;
+	int height = 0;
+	size_t stride = 0;
+	std::vector<float> storage;
+	float* pixels = NULL;        // first row, aligned inside storage
+};
@@ -0,0 +1,283 @@
+//
+//  ImageWriter.cpp - background frame encoding: PNG through FreeImage, PPM,
+//  PFM and uncompressed half float EXR written directly
+//
+
+#include "ImageWriter.h"
+#include "ofMain.h"
+#include "FreeImage.h"
+#include "Profiler.h"
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+
+std::string OutputSettings::fileName(int frame) const {
+	std::string name = path;
+	if (numberFrames) {
+		char number[16];
+		snprintf(number, sizeof(number), "_%04d", frame);
+		name += number;
+	}
+	return name + ImageWriter::extension(format);
+}
+
+ImageWriter::ImageWriter() {
+	// reference counted by FreeImage, so it's fine if openFrameworks has
+	// already done this
+	//
+	FreeImage_Initialise();
+	writer = std::thread(&ImageWriter::writerLoop, this);
+}
+
+ImageWriter::~ImageWriter() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		bQuit = true;
+	}
+	changed.notify_all();
+	writer.join();
+	FreeImage_DeInitialise();
+}
+
+void ImageWriter::write(const FrameBuffer& frame, const std::string& path, ImageFormat format, int pngCompression) {
+	std::unique_ptr<Job> job(new Job());
+	job->frame.copyFrom(frame);
+	job->path = path;
+	job->format = format;
+	job->pngCompression = pngCompression;
+
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [this] { return (int)jobs.size() < maxPending; });
+	jobs.push_back(std::move(job));
+	changed.notify_all();
+}
+
+void ImageWriter::wait() {
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [this] { return jobs.empty() && !bBusy; });
+}
+
+// the queue is drained before quitting, so no frame is lost on exit
+//
+void ImageWriter::writerLoop() {
+	for (;;) {
+		std::unique_ptr<Job> job;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			changed.wait(guard, [this] { return bQuit || !jobs.empty(); });
+			if (jobs.empty()) return;
+			job = std::move(jobs.front());
+			jobs.pop_front();
+			bBusy = true;
+		}
+		changed.notify_all();
+
+		if (!save(job->frame, job->path, job->format, job->pngCompression)) {
+			ofLogError("ImageWriter") << "could not write " << job->path;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			bBusy = false;
+		}
+		changed.notify_all();
+	}
+}
+
+const char* ImageWriter::extension(ImageFormat format) {
+	switch (format) {
+	case ImageFormat::PPM: return ".ppm";
+	case ImageFormat::PFM: return ".pfm";
+	case ImageFormat::EXR: return ".exr";
+	default: return ".png";
+	}
+}
+
+// nearest half float, ties to even; overflow goes to infinity
+//
+static uint16_t toHalf(float f) {
+	uint32_t x;
+	std::memcpy(&x, &f, sizeof(x));
+	uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+	uint32_t a = x & 0x7fffffff;
+
+	if (a >= 0x7f800000) return sign | 0x7c00 | (a > 0x7f800000 ? 0x200 : 0);   // inf, NaN
+	if (a >= 0x477ff000) return sign | 0x7c00;
+	if (a < 0x38800000) {
+		// subnormal half
+		//
+		if (a < 0x33000000) return sign;
+		uint32_t mantissa = (a & 0x7fffff) | 0x800000;
+		int shift = 126 - (int)(a >> 23);
+		uint32_t h = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (h & 1))) h++;
+		return sign | (uint16_t)h;
+	}
+	uint32_t h = (a - 0x38000000) >> 13;
+	uint32_t rest = a & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;
+	return sign | (uint16_t)h;
+}
+
+static bool savePNG(const FrameBuffer& frame, const std::string& path, int compression) {
+	int width = frame.getWidth(), height = frame.getHeight();
+	std::vector<uint8_t> rgba((size_t)width * height * 4);
+	frame.toRGBA8(rgba.data());
+
+	FIBITMAP* bitmap = FreeImage_Allocate(width, height, 32);
+	if (!bitmap) return false;
+
+	// FreeImage stores rows bottom up, in the platform's channel order
+	//
+	for (int y = 0; y < height; y++) {
+		const uint8_t* src = rgba.data() + (size_t)y * width * 4;
+		BYTE* dst = FreeImage_GetScanLine(bitmap, height - 1 - y);
+		for (int x = 0; x < width; x++) {
+			dst[4 * x + FI_RGBA_RED] = src[4 * x];
+			dst[4 * x + FI_RGBA_GREEN] = src[4 * x + 1];
+			dst[4 * x + FI_RGBA_BLUE] = src[4 * x + 2];
+			dst[4 * x + FI_RGBA_ALPHA] = src[4 * x + 3];
+		}
+	}
+
+	// FreeImage takes the zlib level 1 - 9 directly as the flags
+	//
+	compression = std::min(std::max(compression, 0), 9);
+	int flags = compression == 0 ? PNG_Z_NO_COMPRESSION : compression;
+	bool ok = FreeImage_Save(FIF_PNG, bitmap, path.c_str(), flags) != 0;
+	FreeImage_Unload(bitmap);
+	return ok;
+}
+
+static bool savePPM(const FrameBuffer& frame, const std::string& path) {
+	int width = frame.getWidth(), height = frame.getHeight();
+	std::vector<uint8_t> rgba((size_t)width * height * 4);
+	frame.toRGBA8(rgba.data());
+
+	std::vector<uint8_t> rgb((size_t)width * height * 3);
+	for (size_t i = 0; i < (size_t)width * height; i++) {
+		rgb[3 * i] = rgba[4 * i];
+		rgb[3 * i + 1] = rgba[4 * i + 1];
+		rgb[3 * i + 2] = rgba[4 * i + 2];
+	}
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file) return false;
+	file << "P6\n" << width << " " << height << "\n255\n";
+	file.write((const char*)rgb.data(), rgb.size());
+	return (bool)file;
+}
+
+// PFM rows go bottom to top; a negative scale means little endian
+//
+static bool savePFM(const FrameBuffer& frame, const std::string& path) {
+	int width = frame.getWidth(), height = frame.getHeight();
+	std::ofstream file(path, std::ios::binary);
+	if (!file) return false;
+	file << "PF\n" << width << " " << height << "\n-1.0\n";
+
+	std::vector<float> line((size_t)width * 3);
+	for (int y = height - 1; y >= 0; y--) {
+		const float* src = frame.row(y);
+		for (int x = 0; x < width; x++) {
+			line[3 * x] = src[4 * x];
+			line[3 * x + 1] = src[4 * x + 1];
+			line[3 * x + 2] = src[4 * x + 2];
+		}
+		file.write((const char*)line.data(), line.size() * sizeof(float));
+	}
+	return (bool)file;
+}
+
+// Minimal single part scanline OpenEXR: channels A, B, G, R (they must be
+// sorted by name) as HALF, NO_COMPRESSION, one scanline per block.
+// Everything is little endian.
+//
+static bool saveEXR(const FrameBuffer& frame, const std::string& path) {
+	int width = frame.getWidth(), height = frame.getHeight();
+	std::vector<char> out;
+	auto bytes = [&](const void* data, size_t size) {
+		out.insert(out.end(), (const char*)data, (const char*)data + size);
+	};
+	auto i32 = [&](int32_t v) { bytes(&v, 4); };
+	auto f32 = [&](float v) { bytes(&v, 4); };
+	auto str = [&](const char* s) { bytes(s, std::strlen(s) + 1); };
+	auto attribute = [&](const char* name, const char* type, int32_t size) {
+		str(name);
+		str(type);
+		i32(size);
+	};
+
+	const uint8_t magic[4] = { 0x76, 0x2f, 0x31, 0x01 };
+	bytes(magic, 4);
+	i32(2);
+
+	const char* channels[4] = { "A", "B", "G", "R" };
+	attribute("channels", "chlist", 4 * (2 + 16) + 1);
+	for (const char* name : channels) {
+		str(name);
+		i32(1);                  // HALF
+		i32(0);                  // pLinear + reserved
+		i32(1);                  // x sampling
+		i32(1);                  // y sampling
+	}
+	out.push_back(0);
+
+	attribute("compression", "compression", 1);
+	out.push_back(0);            // NO_COMPRESSION
+	attribute("dataWindow", "box2i", 16);
+	i32(0); i32(0); i32(width - 1); i32(height - 1);
+	attribute("displayWindow", "box2i", 16);
+	i32(0); i32(0); i32(width - 1); i32(height - 1);
+	attribute("lineOrder", "lineOrder", 1);
+	out.push_back(0);            // INCREASING_Y
+	attribute("pixelAspectRatio", "float", 4);
+	f32(1);
+	attribute("screenWindowCenter", "v2f", 8);
+	f32(0); f32(0);
+	attribute("screenWindowWidth", "float", 4);
+	f32(1);
+	out.push_back(0);            // end of header
+
+	// offset table, then one block per scanline: y, size, then each
+	// channel's row in turn
+	//
+	int32_t blockData = width * 4 * 2;
+	uint64_t offset = out.size() + (uint64_t)height * 8;
+	for (int y = 0; y < height; y++) {
+		bytes(&offset, 8);
+		offset += 8 + blockData;
+	}
+
+	const int channelIndex[4] = { 3, 2, 1, 0 };
+	std::vector<uint16_t> line((size_t)width * 4);
+	for (int y = 0; y < height; y++) {
+		const float* src = frame.row(y);
+		for (int c = 0; c < 4; c++) {
+			for (int x = 0; x < width; x++) line[(size_t)c * width + x] = toHalf(src[4 * x + channelIndex[c]]);
+		}
+		i32(y);
+		i32(blockData);
+		bytes(line.data(), line.size() * sizeof(uint16_t));
+	}
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file) return false;
+	file.write(out.data(), out.size());
+	return (bool)file;
+}
+
+bool ImageWriter::save(const FrameBuffer& frame, const std::string& path, ImageFormat format, int pngCompression) {
+	PROFILE_SCOPE("save");
+	switch (format) {
+	case ImageFormat::PPM: return savePPM(frame, path);
+	case ImageFormat::PFM: return savePFM(frame, path);
+	case ImageFormat::EXR: return saveEXR(frame, path);
+	default: return savePNG(frame, path, pngCompression);
+	}
+}
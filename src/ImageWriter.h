@@ -0,0 +1,72 @@
+//
+//  ImageWriter.h - encodes and saves rendered frames on a background thread
+//
+//  write() copies the frame and returns right away; a single writer thread
+//  encodes the queued frames in order.  Formats:
+//
+//      PNG   8 bit RGBA, zlib level 0 (stored) to 9
+//      PPM   8 bit binary RGB (P6), no compression
+//      PFM   32 bit float RGB, no compression
+//      EXR   16 bit half float RGBA, scanline, no compression
+//
+//  At most maxPending frames wait in the queue; write() blocks when it is
+//  full so a slow disk can't pile up frames without bound.
+//
+#pragma once
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "FrameBuffer.h"
+
+enum class ImageFormat { PNG, PPM, PFM, EXR };
+
+struct OutputSettings {
+	ImageFormat format = ImageFormat::PNG;
+	int pngCompression = 6;       // 0 (stored) to 9 (smallest), PNG only
+	std::string path = "test";    // without extension, relative to the data folder
+	bool numberFrames = false;    // append _0000, _0001, ... per frame
+
+	// path + frame number (if numberFrames) + extension
+	//
+	std::string fileName(int frame) const;
+};
+
+class ImageWriter {
+public:
+	ImageWriter();
+	~ImageWriter();              // saves whatever is still queued
+
+	void write(const FrameBuffer& frame, const std::string& path, ImageFormat format, int pngCompression = 6);
+
+	// block until every queued frame is on disk
+	//
+	void wait();
+
+	// encode and save on the calling thread
+	//
+	static bool save(const FrameBuffer& frame, const std::string& path, ImageFormat format, int pngCompression = 6);
+	static const char* extension(ImageFormat format);
+
+	static const int maxPending = 4;
+
+private:
+	struct Job {
+		FrameBuffer frame;
+		std::string path;
+		ImageFormat format;
+		int pngCompression;
+	};
+
+	void writerLoop();
+
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<std::unique_ptr<Job>> jobs;
+	bool bBusy = false;
+	bool bQuit = false;
+};
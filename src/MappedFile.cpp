@@ -0,0 +1,88 @@
+//
+//  MappedFile.cpp - read-only file mapping (MapViewOfFile / mmap)
+//
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path) {
+	close();
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		CloseHandle(file);
+		return false;
+	}
+	fileHandle = file;
+	if (fileSize.QuadPart == 0) return true;
+
+	mappingHandle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mappingHandle) view = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		close();
+		return false;
+	}
+	length = (size_t)fileSize.QuadPart;
+	return true;
+}
+
+void MappedFile::close() {
+	if (view) UnmapViewOfFile(view);
+	if (mappingHandle) CloseHandle(mappingHandle);
+	if (fileHandle) CloseHandle(fileHandle);
+	view = NULL;
+	mappingHandle = NULL;
+	fileHandle = NULL;
+	length = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string& path) {
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		::close(fd);
+		return false;
+	}
+	if (info.st_size == 0) {
+		::close(fd);
+		return true;
+	}
+
+	// the mapping keeps the file open, the descriptor isn't needed anymore
+	//
+	void* p = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) return false;
+	madvise(p, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+	view = p;
+	length = (size_t)info.st_size;
+	return true;
+}
+
+void MappedFile::close() {
+	if (view) munmap(view, length);
+	view = NULL;
+	length = 0;
+}
+
+#endif
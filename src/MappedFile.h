@@ -0,0 +1,37 @@
+//
+//  MappedFile.h - read-only memory mapping of a whole file
+//
+//  The pages are brought in by the OS as they are touched, so opening a
+//  large file costs next to nothing and reading it is a plain memory access.
+//  The data stays valid until close() or the destructor.
+//
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+class MappedFile {
+public:
+	MappedFile() {}
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Map the file at path (not relative to the data folder).  Returns false
+	// if it can't be opened or mapped.  An empty file opens with size() 0
+	// and data() NULL.
+	//
+	bool open(const std::string& path);
+	void close();
+
+	const char* data() const { return (const char*)view; }
+	size_t size() const { return length; }
+
+private:
+	void* view = NULL;
+	size_t length = 0;
+#ifdef _WIN32
+	void* fileHandle = NULL;
+	void* mappingHandle = NULL;
+#endif
+};
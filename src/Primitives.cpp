@@ -5,8 +5,11 @@
 //  (c) Kevin M. Smith  - 24 September 2018
 //
 
-#include "ofApp.h"
 #include "Primitives.h"
+#include "Profiler.h"
+#include "assimp/cimport.h"
+#include "assimp/scene.h"
+#include "assimp/postprocess.h"
 
 // Generate a rotation matrix that rotates v1 to v2
 // v1, v2 must be normalized
@@ -42,35 +45,111 @@ void Cone::draw() {
 
 }
 
-//  Cone::intersect - test intersection with bounding box.  Note that
-//  intersection test is done in object space with an axis aligned box (AAB), 
-//  the input ray is provided in world space, so we need to transform the ray to object space.
-//  this method does NOT return a normal.
+// Bring a world space ray into object space.  The direction is transformed
+// but not normalized, so t along the object space ray is the same t as along
+// the world space one.
 //
-bool Cone::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) {
+static Ray toObjectSpace(const glm::mat4& mInv, const Ray& ray) {
+	glm::vec3 p = mInv * glm::vec4(ray.p, 1.0);
+	glm::vec3 d = glm::mat3(mInv) * ray.d;
+	return Ray(p, d);
+}
+
+// Object space normal to world space (inverse transpose of the world matrix)
+//
+static glm::vec3 normalToWorld(const glm::mat4& mInv, const glm::vec3& n) {
+	return glm::normalize(glm::transpose(glm::mat3(mInv)) * n);
+}
+
+//  Cone::intersect - the cone is the one ofDrawCone draws: its axis is
+//  object space Y, the apex is at y = -height/2 and the base (a disk of
+//  the cone's radius) at y = +height/2.  The side is
+//
+//      x^2 + z^2 = k^2 (y + height/2)^2,   k = radius / height
+//
+//  solved as a quadratic in t.  primID is 0 for the side, 1 for the base.
+//
+bool Cone::intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit) {
+	PROFILE_COUNT(ProfileConeTests);
 
 	// transform Ray to object space.  
 	//
-	glm::mat4 mInv = glm::inverse(getMatrix());
-	glm::vec4 p = mInv * glm::vec4(ray.p.x, ray.p.y, ray.p.z, 1.0);
-	glm::vec4 p1 = mInv * glm::vec4(ray.p + ray.d, 1.0);
-	glm::vec3 d = glm::normalize(p1 - p);
+	glm::mat4 mInv = getInverseMatrix();
+	Ray r = toObjectSpace(mInv, ray);
+	float h2 = height / 2;
+	float k2 = (radius / height) * (radius / height);
 
+	float tHit = tMax;
+	int face = -1;
 
-	// intesect method we use will be Willam's  (see box.h and box.cc for reference).
-	// note that this class has it's own version of Ray, Vector3  (TBD: port to GLM)
+	// side
 	//
-	_Ray boxRay = _Ray(Vector3(p.x, p.y, p.z), Vector3(d.x, d.y, d.z));
+	float y0 = r.p.y + h2;
+	float a = r.d.x * r.d.x + r.d.z * r.d.z - k2 * r.d.y * r.d.y;
+	float b = 2 * (r.p.x * r.d.x + r.p.z * r.d.z - k2 * y0 * r.d.y);
+	float c = r.p.x * r.p.x + r.p.z * r.p.z - k2 * y0 * y0;
+	float disc = b * b - 4 * a * c;
+	if (a != 0 && disc >= 0) {
+		float root = sqrt(disc);
+		float roots[2] = { (-b - root) / (2 * a), (-b + root) / (2 * a) };
+		if (roots[0] > roots[1]) std::swap(roots[0], roots[1]);
+		for (float t : roots) {
+			float y = r.p.y + t * r.d.y;
+			if (t >= tMin && t <= tHit && y >= -h2 && y <= h2) {
+				tHit = t;
+				face = 0;
+				break;
+			}
+		}
+	}
 
-	// we will test for intersection in object space (object is a "unit" cube edge is len=2)
+	// base
 	//
-	Box box = Box(Vector3(-radius, -radius, 0), Vector3(radius, radius, height));
-	return (box.intersect(boxRay, -1000, 1000));
-
+	if (r.d.y != 0) {
+		float t = (h2 - r.p.y) / r.d.y;
+		glm::vec3 q = r.evalPoint(t);
+		if (t >= tMin && t <= tHit && q.x * q.x + q.z * q.z <= radius * radius) {
+			tHit = t;
+			face = 1;
+		}
+	}
+	if (face < 0) return false;
 
+	glm::vec3 q = r.evalPoint(tHit);
+	glm::vec3 n;
+	if (face == 0) {
+		n = glm::vec3(q.x, -k2 * (q.y + h2), q.z);
+		hit.uv = glm::vec2(atan2(q.z, q.x) / (2 * PI) + 0.5f, (q.y + h2) / height);
+	}
+	else {
+		n = glm::vec3(0, 1, 0);
+		hit.uv = glm::vec2(q.x / radius, q.z / radius) * 0.5f + 0.5f;
+	}
+	hit.t = tHit;
+	hit.point = ray.evalPoint(tHit);
+	hit.normal = normalToWorld(mInv, n);
+	hit.primID = face;
+	hit.obj = this;
+	return true;
 }
 
+// Transform the 8 corners of an object space box to world space and
+// return their bounds
+//
+static AABB transformBox(const glm::mat4& m, const glm::vec3& min, const glm::vec3& max) {
+	AABB bounds;
+	for (int i = 0; i < 8; i++) {
+		glm::vec3 corner((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+		bounds.grow(glm::vec3(m * glm::vec4(corner, 1.0)));
+	}
+	return bounds;
+}
 
+// Object space box around the cone, in world space
+//
+AABB Cone::getBounds() {
+	return transformBox(getMatrix(), glm::vec3(-radius, -height / 2, -radius), glm::vec3(radius, height / 2, radius));
+}
 
 // Draw a Unit cube (size = 2) transformed 
 //
@@ -113,101 +192,211 @@ void Sphere::draw() {
 	//ofApp::drawAxis(m, 1.5);
 }
 
-bool Sphere::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) {
-	// transform Ray to object space.
-	//
-	return (glm::intersectRaySphere(ray.p, ray.d, position, radius, point, normal));
+// Same math as glm::intersectRaySphere (and the SIMD kernel in SphereSoA),
+// taking the near root unless it is before tMin
+//
+bool Sphere::intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit) {
+	PROFILE_COUNT(ProfileSphereTests);
+	glm::vec3 diff = position - ray.p;
+	float t0 = glm::dot(diff, ray.d);
+	float d2 = glm::dot(diff, diff) - t0 * t0;
+	float r2 = radius * radius;
+	if (d2 > r2) return false;
+
+	float t1 = sqrt(r2 - d2);
+	float t = t0 - t1 >= tMin ? t0 - t1 : t0 + t1;
+	if (t < tMin || t > tMax) return false;
+	setHit(ray, t, hit);
+	return true;
 }
 
-// Simply copies sphere's draw
+// Same math as Sphere::intersect, but stops at the distances: the ray is
+// blocked if it crosses the surface anywhere inside [tMin, tMax]
 //
-void Joint::draw() {
-	Sphere::draw();
+bool Sphere::occluded(const Ray& ray, float tMin, float tMax) {
+	PROFILE_COUNT(ProfileSphereTests);
+	glm::vec3 diff = position - ray.p;
+	float t0 = glm::dot(diff, ray.d);
+	float d2 = glm::dot(diff, diff) - t0 * t0;
+	float r2 = radius * radius;
+	if (d2 > r2) return false;
+
+	float t1 = sqrt(r2 - d2);
+	float t = t0 - t1 >= tMin ? t0 - t1 : t0 + t1;
+	return t >= tMin && t <= tMax;
 }
 
-// Taken from Project 2's variation rather than Project 3's, as otherwise, a bug will occur
-// where the spheres will not have any depth.
+// Fill in a hit at distance t along the ray, also used for hits found by the
+// SIMD sphere kernel.  uv is longitude/latitude.
 //
-bool Joint::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) {
-	// transform Ray to object space.
-	//
-	return (glm::intersectRaySphere(ray.p, ray.d, position, radius, point, normal));
+void Sphere::setHit(const Ray& ray, float t, HitRecord& hit) {
+	hit.t = t;
+	hit.point = ray.evalPoint(t);
+	hit.normal = (hit.point - position) / radius;
+	hit.uv = glm::vec2(atan2(hit.normal.z, hit.normal.x) / (2 * PI) + 0.5f,
+		asin(glm::clamp(hit.normal.y, -1.0f, 1.0f)) / PI + 0.5f);
+	hit.primID = 0;
+	hit.obj = this;
+}
+
+// Simply copies sphere's draw
+//
+void Joint::draw() {
+	Sphere::draw();
 }
 
-//  Cube::intersect - test intersection with the unit Cube.  Note that
-//  intersection test is done in object space with an axis aligned box (AAB), 
-//  the input ray is provided in world space, so we need to transform the ray to object space.
-//  this method does NOT return a normal.
+//  Cube::intersect - test intersection with the width x height x depth box
+//  centered on the object's origin.  Note that intersection test is done in
+//  object space with an axis aligned box (AAB), the input ray is provided in
+//  world space, so we need to transform the ray to object space.
+//  primID is the face: 2 * axis, +1 for the positive side.
 //
-bool Cube::intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) {
+bool Cube::intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit) {
+	PROFILE_COUNT(ProfileCubeTests);
 
 	// transform Ray to object space.  
 	//
-	glm::mat4 mInv = glm::inverse(getMatrix());
-	glm::vec4 p = mInv * glm::vec4(ray.p.x, ray.p.y, ray.p.z, 1.0);
-	glm::vec4 p1 = mInv * glm::vec4(ray.p + ray.d, 1.0);
-	glm::vec3 d = glm::normalize(p1 - p);
-
+	glm::mat4 mInv = getInverseMatrix();
+	Ray r = toObjectSpace(mInv, ray);
 
 	// intesect method we use will be Willam's  (see box.h and box.cc for reference).
-	// note that this class has it's own version of Ray, Vector3  (TBD: port to GLM)
 	//
-	_Ray boxRay = _Ray(Vector3(p.x, p.y, p.z), Vector3(d.x, d.y, d.z));
+	glm::vec3 half = glm::vec3(width, height, depth) / 2.0f;
+	Box box = Box(-half, half);
+	float tNear, tFar;
+	if (!box.intersect(r, tMin, tMax, tNear, tFar)) return false;
+
+	// entering the box, or leaving it if the ray starts inside
+	//
+	float t = tNear >= tMin ? tNear : tFar;
+	if (t < tMin || t > tMax) return false;
 
-	// we will test for intersection in object space (object is a "unit" cube edge is len=2)
+	// the face hit is the one the point is furthest out on
 	//
-	Box box = Box(Vector3(-width / 2.0, -height / 2.0, -depth / 2.0), Vector3(width / 2.0, height / 2.0, depth / 2.0));
-	return (box.intersect(boxRay, -1000, 1000));
+	glm::vec3 q = r.evalPoint(t) / half;
+	int axis = 0;
+	if (fabs(q.y) > fabs(q[axis])) axis = 1;
+	if (fabs(q.z) > fabs(q[axis])) axis = 2;
+	glm::vec3 n(0, 0, 0);
+	n[axis] = q[axis] > 0 ? 1.0f : -1.0f;
+
+	hit.t = t;
+	hit.point = ray.evalPoint(t);
+	hit.normal = normalToWorld(mInv, n);
+	hit.uv = glm::vec2(q[(axis + 1) % 3], q[(axis + 2) % 3]) * 0.5f + 0.5f;
+	hit.primID = 2 * axis + (n[axis] > 0 ? 1 : 0);
+	hit.obj = this;
+	return true;
+}
+
+// Does the world space segment ray(tMin)..ray(tMax) pass through the box?
+// The segment is brought into object space as a whole, so the box test runs
+// on [0, 1] and no distance has to be converted.
+//
+bool Cube::occluded(const Ray& ray, float tMin, float tMax) {
+	PROFILE_COUNT(ProfileCubeTests);
+	glm::mat4 mInv = getInverseMatrix();
+	glm::vec3 p0 = mInv * glm::vec4(ray.p + ray.d * tMin, 1.0);
+	glm::vec3 p1 = mInv * glm::vec4(ray.p + ray.d * tMax, 1.0);
+	glm::vec3 half = glm::vec3(width, height, depth) / 2.0f;
+	return Box(-half, half).intersect(Ray(p0, p1 - p0), 0, 1);
+}
 
+AABB Cube::getBounds() {
+	glm::vec3 half = glm::vec3(width, height, depth) / 2.0f;
+	return transformBox(getMatrix(), -half, half);
 }
 
+// Bounds of the rectangle that Plane::intersect accepts, padded a little
+// along the normal so the box is never flat
+//
+AABB Plane::getBounds() {
+	glm::vec3 half;
+	if (normal == glm::vec3(0, 1, 0) || normal == glm::vec3(0, -1, 0))
+		half = glm::vec3(width / 2, 0, height / 2);
+	else if (normal == glm::vec3(0, 0, 1) || normal == glm::vec3(0, 0, -1))
+		half = glm::vec3(width / 2, width / 2, 0);
+	else if (normal == glm::vec3(1, 0, 0) || normal == glm::vec3(-1, 0, 0))
+		half = glm::vec3(0, width / 2, height / 2);
+	else
+		return SceneObject::getBounds();
+	half += glm::vec3(0.001f);
+	return AABB(position - half, position + half);
+}
 
 // Intersect Ray with Plane (wrapper on glm::intersect*); repurposed from Project 2
 //
-bool Plane::intersect(const Ray& ray, glm::vec3& point, glm::vec3&
-	normalAtIntersect) {
+bool Plane::intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit) {
+	PROFILE_COUNT(ProfilePlaneTests);
 	float dist;
-	bool insidePlane = false;
-	bool hit = glm::intersectRayPlane(ray.p, ray.d, position, this->normal,
+	bool hitPlane = glm::intersectRayPlane(ray.p, ray.d, position, this->normal,
 		dist);
-	if (hit) {
-		Ray r = ray;
-		point = r.evalPoint(dist);
-		normalAtIntersect = this->normal;
-		glm::vec2 xrange = glm::vec2(position.x - width / 2, position.x + width
-			/ 2);
-		glm::vec2 yrange = glm::vec2(position.y - width / 2, position.y + width
-			/ 2);
-		glm::vec2 zrange = glm::vec2(position.z - height / 2, position.z +
-			height / 2);
-		// horizontal
-		//
-		if (normal == glm::vec3(0, 1, 0) || normal == glm::vec3(0, -1, 0)) {
-			if (point.x < xrange[1] && point.x > xrange[0] && point.z <
-				zrange[1] && point.z > zrange[0]) {
-				insidePlane = true;
-			}
-		}
-		// front or back
-		//
-		else if (normal == glm::vec3(0, 0, 1) || normal == glm::vec3(0, 0, -1))
-		{
-			if (point.x < xrange[1] && point.x > xrange[0] && point.y <
-				yrange[1] && point.y > yrange[0]) {
-				insidePlane = true;
-			}
-		}
-		// left or right
-		//
-		else if (normal == glm::vec3(1, 0, 0) || normal == glm::vec3(-1, 0, 0))
-		{
-			if (point.y < yrange[1] && point.y > yrange[0] && point.z <
-				zrange[1] && point.z > zrange[0]) {
-				insidePlane = true;
-			}
-		}
+	if (!hitPlane || dist < tMin || dist > tMax) return false;
+
+	glm::vec3 point = ray.evalPoint(dist);
+	if (!contains(point)) return false;
+
+	hit.t = dist;
+	hit.point = point;
+	hit.normal = this->normal;
+	hit.uv = getUV(point);
+	hit.primID = 0;
+	hit.obj = this;
+	return true;
+}
+
+bool Plane::occluded(const Ray& ray, float tMin, float tMax) {
+	PROFILE_COUNT(ProfilePlaneTests);
+	float dist;
+	if (!glm::intersectRayPlane(ray.p, ray.d, position, this->normal, dist)) return false;
+	if (dist < tMin || dist > tMax) return false;
+	return contains(ray.p + ray.d * dist);
+}
+
+// true if a point on the plane lies inside the width x height rectangle
+//
+bool Plane::contains(const glm::vec3& point) {
+	glm::vec2 xrange = glm::vec2(position.x - width / 2, position.x + width
+		/ 2);
+	glm::vec2 yrange = glm::vec2(position.y - width / 2, position.y + width
+		/ 2);
+	glm::vec2 zrange = glm::vec2(position.z - height / 2, position.z +
+		height / 2);
+	// horizontal
+	//
+	if (normal == glm::vec3(0, 1, 0) || normal == glm::vec3(0, -1, 0)) {
+		return (point.x < xrange[1] && point.x > xrange[0] && point.z <
+			zrange[1] && point.z > zrange[0]);
+	}
+	// front or back
+	//
+	else if (normal == glm::vec3(0, 0, 1) || normal == glm::vec3(0, 0, -1))
+	{
+		return (point.x < xrange[1] && point.x > xrange[0] && point.y <
+			yrange[1] && point.y > yrange[0]);
+	}
+	// left or right
+	//
+	else if (normal == glm::vec3(1, 0, 0) || normal == glm::vec3(-1, 0, 0))
+	{
+		return (point.y < yrange[1] && point.y > yrange[0] && point.z <
+			zrange[1] && point.z > zrange[0]);
+	}
+	return false;
+}
+
+// (u, v) in [0, 1] across the rectangle: x and z for horizontal planes, x
+// and y for front/back, z and y for left/right (same ranges as contains())
+//
+glm::vec2 Plane::getUV(const glm::vec3& point) {
+	float u = (point.x - (position.x - width / 2)) / width;
+	if (normal == glm::vec3(0, 1, 0) || normal == glm::vec3(0, -1, 0)) {
+		return glm::vec2(u, (point.z - (position.z - height / 2)) / height);
 	}
-	return insidePlane;
+	else if (normal == glm::vec3(0, 0, 1) || normal == glm::vec3(0, 0, -1)) {
+		return glm::vec2(u, (point.y - (position.y - height / 2)) / height);
+	}
+	return glm::vec2((point.z - (position.z - height / 2)) / height, (point.y - (position.y - width / 2)) / width);
 }
 
 // Convert (u, v) to (x, y, z) 
@@ -235,3 +424,266 @@ Ray RenderCam::getRay(float u, float v) {
 	glm::vec3 pointOnPlane = view.toWorld(u, v);
 	return(Ray(position, glm::normalize(pointOnPlane - position)));
 }
+
+// Load every mesh of a model file into one indexed triangle list and build
+// the mesh's BVH.  Normals and texture coordinates are only kept if every
+// part of the model has them.  Node transforms inside the file are not
+// applied; the mesh is positioned like any other scene object.
+//
+// The model is read with Assimp directly instead of ofxAssimpModelLoader,
+// which also uploads VBOs and textures and so needs a GL context that the
+// headless renderer doesn't have.  Same post processing as the loader's
+// loadModel(path, true); faces that aren't triangles (lines, points) are
+// skipped.
+//
+bool Mesh::load(const string& path) {
+	unsigned int flags = aiProcessPreset_TargetRealtime_MaxQuality | aiProcess_Triangulate | aiProcess_FlipUVs |
+		aiProcess_ImproveCacheLocality | aiProcess_OptimizeGraph | aiProcess_OptimizeMeshes |
+		aiProcess_JoinIdenticalVertices | aiProcess_RemoveRedundantMaterials;
+	const aiScene* model = aiImportFile(ofToDataPath(path, true).c_str(), flags);
+	if (!model) {
+		cout << "could not load model " << path << ": " << aiGetErrorString() << endl;
+		return false;
+	}
+
+	// fresh geometry, clones made before this keep the old one
+	//
+	geometry = std::make_shared<MeshGeometry>();
+	vector<glm::vec3>& vertices = geometry->vertices;
+	vector<glm::vec3>& normals = geometry->normals;
+	vector<glm::vec2>& texCoords = geometry->texCoords;
+	vector<uint32_t>& indices = geometry->indices;
+	bool hasNormals = true;
+	bool hasTexCoords = true;
+
+	for (unsigned int i = 0; i < model->mNumMeshes; i++) {
+		const aiMesh* m = model->mMeshes[i];
+		uint32_t base = (uint32_t)vertices.size();
+		for (unsigned int k = 0; k < m->mNumVertices; k++) {
+			vertices.push_back(glm::vec3(m->mVertices[k].x, m->mVertices[k].y, m->mVertices[k].z));
+		}
+
+		hasNormals = hasNormals && m->HasNormals();
+		if (hasNormals) {
+			for (unsigned int k = 0; k < m->mNumVertices; k++) {
+				normals.push_back(glm::vec3(m->mNormals[k].x, m->mNormals[k].y, m->mNormals[k].z));
+			}
+		}
+		hasTexCoords = hasTexCoords && m->HasTextureCoords(0);
+		if (hasTexCoords) {
+			for (unsigned int k = 0; k < m->mNumVertices; k++) {
+				texCoords.push_back(glm::vec2(m->mTextureCoords[0][k].x, m->mTextureCoords[0][k].y));
+			}
+		}
+
+		for (unsigned int f = 0; f < m->mNumFaces; f++) {
+			const aiFace& face = m->mFaces[f];
+			if (face.mNumIndices != 3) continue;
+			indices.push_back(base + face.mIndices[0]);
+			indices.push_back(base + face.mIndices[1]);
+			indices.push_back(base + face.mIndices[2]);
+		}
+	}
+	aiReleaseImport(model);
+	if (!hasNormals) normals.clear();
+	if (!hasTexCoords) texCoords.clear();
+
+	if (indices.empty()) {
+		cout << path << " has no triangles" << endl;
+		return false;
+	}
+	name = ofFilePath::getBaseName(path);
+	this->path = path;
+	build();
+	return true;
+}
+
+// Build the BVH over the triangles, then store the index list and the SoA
+// copy of the triangles in leaf order
+//
+void Mesh::build() {
+	const vector<glm::vec3>& vertices = geometry->vertices;
+	vector<uint32_t>& indices = geometry->indices;
+	BVH& bvh = geometry->bvh;
+	TriangleSoA& triangles = geometry->triangles;
+	int n = numTriangles();
+	vector<AABB> bounds(n);
+	for (int i = 0; i < n; i++) {
+		bounds[i].grow(vertices[indices[3 * i]]);
+		bounds[i].grow(vertices[indices[3 * i + 1]]);
+		bounds[i].grow(vertices[indices[3 * i + 2]]);
+	}
+
+	// leaves hold up to one AVX2 register worth of triangles
+	//
+	bvh.maxLeafSize = 8;
+	bvh.build(bounds);
+
+	vector<uint32_t> sorted(indices.size());
+	triangles.resize(n);
+	for (int slot = 0; slot < n; slot++) {
+		int tri = bvh.primIndices[slot];
+		for (int k = 0; k < 3; k++) sorted[3 * slot + k] = indices[3 * tri + k];
+		triangles.set(slot, vertices[sorted[3 * slot]], vertices[sorted[3 * slot + 1]], vertices[sorted[3 * slot + 2]]);
+	}
+	indices.swap(sorted);
+
+	// the triangles never move relative to the mesh, so the tree is never refit
+	//
+	bvh.releaseRefitData();
+
+	drawMesh.clear();
+	drawMesh.addVertices(vertices);
+	if (!geometry->normals.empty()) drawMesh.addNormals(geometry->normals);
+	if (!geometry->texCoords.empty()) drawMesh.addTexCoords(geometry->texCoords);
+	drawMesh.addIndices(indices);
+}
+
+// the copy shares the geometry and leaves out the GL mesh, which a render
+// snapshot never draws
+//
+SceneObject* Mesh::clone() {
+	Mesh* copy = new Mesh(diffuseColor);
+	static_cast<SceneObject&>(*copy) = *this;
+	copy->geometry = geometry;
+	return copy;
+}
+
+// Closest triangle through the mesh BVH, in object space.  The normal is
+// interpolated from the vertex normals when the model has them and is
+// flipped to face the ray, since CAD models are rarely closed or
+// consistently wound.
+//
+bool Mesh::intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit) {
+	const MeshGeometry& g = *geometry;
+	if (g.bvh.empty()) return false;
+
+	glm::mat4 mInv = getInverseMatrix();
+	Ray r = toObjectSpace(mInv, ray);
+
+	float t = tMax;
+	int slot = -1;
+	glm::vec2 bary;
+	g.bvh.closestHitLeaves(r.p, r.d, t, [&](int first, int count, float& tLeaf) {
+		glm::vec2 uv;
+		int s = intersectTriangles(g.triangles, first, count, r.p, r.d, tMin, tLeaf, uv);
+		if (s < 0) return false;
+		slot = s;
+		bary = uv;
+		return true;
+	});
+	if (slot < 0) return false;
+
+	uint32_t i0 = g.indices[3 * slot], i1 = g.indices[3 * slot + 1], i2 = g.indices[3 * slot + 2];
+	float w0 = 1 - bary.x - bary.y;
+	glm::vec3 n;
+	if (g.normals.empty()) n = glm::cross(g.vertices[i1] - g.vertices[i0], g.vertices[i2] - g.vertices[i0]);
+	else n = g.normals[i0] * w0 + g.normals[i1] * bary.x + g.normals[i2] * bary.y;
+	n = normalToWorld(mInv, n);
+	if (glm::dot(n, ray.d) > 0) n = -n;
+
+	hit.t = t;
+	hit.point = ray.evalPoint(t);
+	hit.normal = n;
+	if (g.texCoords.empty()) hit.uv = bary;
+	else hit.uv = g.texCoords[i0] * w0 + g.texCoords[i1] * bary.x + g.texCoords[i2] * bary.y;
+	hit.primID = slot;
+	hit.obj = this;
+	return true;
+}
+
+bool Mesh::occluded(const Ray& ray, float tMin, float tMax) {
+	const MeshGeometry& g = *geometry;
+	if (g.bvh.empty()) return false;
+
+	Ray r = toObjectSpace(getInverseMatrix(), ray);
+	return g.bvh.anyHitLeaves(r.p, r.d, tMax, [&](int first, int count, float tLeaf) {
+		glm::vec2 uv;
+		return intersectTriangles(g.triangles, first, count, r.p, r.d, tMin, tLeaf, uv) >= 0;
+	});
+}
+
+AABB Mesh::getBounds() {
+	const BVH& bvh = geometry->bvh;
+	if (bvh.empty()) return SceneObject::getBounds();
+	return transformBox(getMatrix(), bvh.nodes[0].bounds.min, bvh.nodes[0].bounds.max);
+}
+
+void Mesh::draw() {
+	ofPushMatrix();
+	ofMultMatrix(getMatrix());
+	material.begin();
+	material.setDiffuseColor(diffuseColor);
+	drawMesh.draw();
+	material.end();
+	ofPopMatrix();
+}
+
+// van der Corput radical inverse in base 2: the bits of i mirrored around
+// the binary point
+//
+static float radicalInverse(unsigned int i) {
+	i = (i << 16) | (i >> 16);
+	i = ((i & 0x00ff00ff) << 8) | ((i & 0xff00ff00) >> 8);
+	i = ((i & 0x0f0f0f0f) << 4) | ((i & 0xf0f0f0f0) >> 4);
+	i = ((i & 0x33333333) << 2) | ((i & 0xcccccccc) >> 2);
+	i = ((i & 0x55555555) << 1) | ((i & 0xaaaaaaaa) >> 1);
+	return (float)(i * 2.3283064365386963e-10);
+}
+
+void Light::setNumSamples(int n) {
+	n = glm::clamp(n, 1, maxSamples);
+	sampleTable.resize(n);
+	for (int i = 0; i < n; i++) {
+		sampleTable[i] = glm::vec2((i + 0.5f) / n, radicalInverse(i));
+	}
+}
+
+// Only the cap of the sphere within the cone of directions from p to the
+// sphere can be seen, cos(angle from the axis) >= radius / distance; the
+// samples are spread evenly over that cap.
+//
+int SphereLight::getSamples(const glm::vec3& p, glm::vec3* samples, int capacity, const glm::vec2& rotation) const {
+	glm::vec3 axis = p - position;
+	float dist = glm::length(axis);
+	if (dist <= radius) return 0;
+	axis /= dist;
+
+	glm::vec3 a = glm::normalize(glm::cross(fabs(axis.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0), axis));
+	glm::vec3 b = glm::cross(axis, a);
+	float cosMax = radius / dist;
+
+	int n = glm::min(numSamples(), capacity);
+	for (int i = 0; i < n; i++) {
+		glm::vec2 uv = tableSample(i, rotation);
+		float z = cosMax + uv.x * (1 - cosMax);
+		float r = sqrt(glm::max(1 - z * z, 0.0f));
+		float phi = 2 * PI * uv.y;
+		samples[i] = position + radius * (r * cos(phi) * a + r * sin(phi) * b + z * axis);
+	}
+	return n;
+}
+
+int RectLight::getSamples(const glm::vec3& p, glm::vec3* samples, int capacity, const glm::vec2& rotation) const {
+	glm::vec3 center = glm::vec3(worldMatrix[3]);
+	glm::vec3 facing = -glm::vec3(worldMatrix[1]);
+	if (glm::dot(p - center, facing) <= 0) return 0;
+
+	int n = glm::min(numSamples(), capacity);
+	for (int i = 0; i < n; i++) {
+		glm::vec2 uv = tableSample(i, rotation);
+		samples[i] = glm::vec3(worldMatrix * glm::vec4((uv.x - 0.5f) * width, 0, (uv.y - 0.5f) * height, 1));
+	}
+	return n;
+}
+
+AABB RectLight::getBounds() {
+	return transformBox(getMatrix(), glm::vec3(-width / 2, 0, -height / 2), glm::vec3(width / 2, 0, height / 2));
+}
+
+void RectLight::draw() {
+	ofPushMatrix();
+	ofMultMatrix(getMatrix());
+	ofDrawBox(width, 0.02f, height);
+	ofPopMatrix();
+}
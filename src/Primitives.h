@@ -8,30 +8,65 @@
 
 #include "ofMain.h"
 #include "box.h"
+#include "BVH.h"
+#include "TriangleSoA.h"
 #include "glm/gtx/euler_angles.hpp"
 #include "glm/gtx/intersect.hpp"
 
 
-//  General Purpose Ray class 
-//
-class Ray {
-public:
-	Ray(glm::vec3 p, glm::vec3 d) { this->p = p; this->d = d; }
-	void draw(float t) { ofDrawLine(p, p + t * d); }
+class SceneObject;
 
-	glm::vec3 evalPoint(float t) {
-		return (p + t * d);
-	}
-
-	glm::vec3 p, d;
+//  Result of a ray query.  t is the ray parameter of the hit (a distance,
+//  since rays are normalized), uv the surface coordinates in [0, 1] and
+//  primID which part of the object was hit (face of a cube, side or cap of
+//  a cone, ...).  Each render worker keeps its own record so tracing a pixel
+//  never writes shared state.
+//
+struct HitRecord {
+	float t = std::numeric_limits<float>::infinity();
+	glm::vec3 point;
+	glm::vec3 normal;
+	glm::vec2 uv = glm::vec2(0, 0);
+	int primID = 0;
+	SceneObject* obj = NULL;
 };
 
 //  Base class for any renderable object in the scene
 //
 class SceneObject {
 public:
+	virtual ~SceneObject() {}
 	virtual void draw() = 0;    // pure virtual funcs - must be overloaded
-	virtual bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) { return false; }
+
+	// copy of the object for a render snapshot (see RenderScene).  The copy
+	// still points at the same parent and children.
+	//
+	virtual SceneObject* clone() = 0;
+
+	// Nearest hit with t in [tMin, tMax].  On a hit the record is filled in
+	// and true is returned; otherwise the record is left alone, so a caller
+	// can pass its current closest hit's t as tMax and the record with it.
+	//
+	virtual bool intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit) { return false; }
+
+	// true if the ray hits the object anywhere between distance tMin and tMax.
+	// Used for shadow rays, so it only has to answer yes or no; objects that
+	// can do this without building a hit point and normal should override it.
+	//
+	virtual bool occluded(const Ray& ray, float tMin, float tMax) {
+		HitRecord hit;
+		return intersect(ray, tMin, tMax, hit);
+	}
+
+	// world space bounds, used to build the scene BVH.  Objects that don't
+	// know their extent return a huge box so they are always tested.
+	//
+	virtual AABB getBounds() { return AABB(glm::vec3(-1e15f), glm::vec3(1e15f)); }
+
+	// true if the object is a Sphere at (position, radius), so it can go
+	// through the SIMD sphere kernel instead of intersect()
+	//
+	virtual bool isSphere() { return false; }
 
 	// commonly used transformations
 	//
@@ -65,28 +100,53 @@ public:
 
 	}
 
+	// world matrix of this object (parent's matrix * local matrix), cached
+	// until markDirty() is called on this object or one of its ancestors
+	//
 	glm::mat4 getMatrix() {
+		if (bMatrixDirty) updateMatrices();
+		return worldMatrix;
+	}
 
-		// if we have a parent (we are not the root),
-		// concatenate parent's transform (this is recursive)
-		// 
-		if (parent) {
-			glm::mat4 M = parent->getMatrix();
-			return (M * getLocalMatrix());
-		}
-		else return getLocalMatrix();  // priority order is SRT
+	// cached inverse of getMatrix(), used to bring rays into object space
+	//
+	glm::mat4 getInverseMatrix() {
+		if (bMatrixDirty) updateMatrices();
+		return inverseWorldMatrix;
+	}
+
+	// Recompute the cached local, world and inverse world matrices.
+	// if we have a parent (we are not the root), concatenate parent's
+	// transform (this is recursive, but the parent's matrix is cached too)
+	//
+	void updateMatrices() {
+		localMatrix = getLocalMatrix();
+		if (parent) worldMatrix = parent->getMatrix() * localMatrix;
+		else worldMatrix = localMatrix;   // priority order is SRT
+		inverseWorldMatrix = glm::inverse(worldMatrix);
+		bMatrixDirty = false;
+	}
+
+	// Must be called after changing position, rotation, scale or pivot
+	// directly.  Invalidates the cached matrices of this object and of
+	// everything below it in the hierarchy.
+	//
+	void markDirty() {
+		bMatrixDirty = true;
+		for (auto child : childList) child->markDirty();
 	}
 
 	// get current Position in World Space
 	//
 	glm::vec3 getPosition() {
-		return (getMatrix() * glm::vec4(0.0, 0.0, 0.0, 1.0));
+		return glm::vec3(getMatrix()[3]);
 	}
 
 	// set position (pos is in world space)
 	//
 	void setPosition(glm::vec3 pos) {
-		position = glm::inverse(getMatrix()) * glm::vec4(pos, 1.0);
+		position = getInverseMatrix() * glm::vec4(pos, 1.0);
+		markDirty();
 	}
 
 	// return a rotation  matrix that rotates one vector to another
@@ -98,6 +158,7 @@ public:
 	void addChild(SceneObject* child) {
 		childList.push_back(child);
 		child->parent = this;
+		child->markDirty();
 	}
 
 	SceneObject* parent = NULL;        // if parent = NULL, then this obj is the ROOT
@@ -117,6 +178,13 @@ public:
 	//
 	glm::vec3 pivot = glm::vec3(0, 0, 0);
 
+	// cached transforms (see getMatrix)
+	//
+	glm::mat4 localMatrix = glm::mat4(1.0);
+	glm::mat4 worldMatrix = glm::mat4(1.0);
+	glm::mat4 inverseWorldMatrix = glm::mat4(1.0);
+	bool bMatrixDirty = true;
+
 	// material properties (we will ultimately replace this with a Material class - TBD)
 	//
 	ofColor diffuseColor = ofColor::grey;    // default colors - can be changed.
@@ -126,6 +194,10 @@ public:
 	//
 	bool isSelectable = true;
 	string name = "SceneObject";
+
+	// for a clone in a render snapshot, the object it was copied from
+	//
+	SceneObject* source = NULL;
 };
 
 class Cone : public SceneObject {
@@ -140,7 +212,9 @@ public:
 		diffuseColor = color;
 	}
 	void draw();
-	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);
+	SceneObject* clone() { return new Cone(*this); }
+	bool intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit);
+	AABB getBounds();
 
 	void setRadius(float rad) {
 		radius = rad;
@@ -162,7 +236,10 @@ public:
 		diffuseColor = color;
 	}
 	void draw();
-	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);
+	SceneObject* clone() { return new Cube(*this); }
+	bool intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit);
+	bool occluded(const Ray& ray, float tMin, float tMax);
+	AABB getBounds();
 };
 
 //  General purpose sphere  (assume parametric)
@@ -171,8 +248,12 @@ class Sphere : public SceneObject {
 public:
 	Sphere(glm::vec3 p, float r, ofColor diffuse = ofColor::lightGray) { position = p; radius = r; diffuseColor = diffuse; }
 	Sphere() {}
-	~Sphere() { cout << "in Sphere destructor (~Sphere)" << endl; }
-	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);
+	SceneObject* clone() { return new Sphere(*this); }
+	bool intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit);
+	bool occluded(const Ray& ray, float tMin, float tMax);
+	void setHit(const Ray& ray, float t, HitRecord& hit);
+	AABB getBounds() { return AABB(position - glm::vec3(radius), position + glm::vec3(radius)); }
+	bool isSphere() { return true; }
 	void draw();
 };
 
@@ -187,14 +268,48 @@ public:
 		this->radius = r;
 		this->diffuseColor = diffuse;
 	}
-	~Joint() { cout << "in Joint destructor (~Joint)" << endl; } // Used when destroying the sphere
-	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal); // Used for when ray intersects sphere
+	SceneObject* clone() { return new Joint(*this); }
 	void draw(); // Draws the sphere when called
 };
 
+//  Triangle mesh read with Assimp (OBJ, PLY, glTF, ...).
+//  Geometry is kept in object space as an indexed triangle list with its own
+//  BVH; rays are brought into object space, so moving the mesh never touches
+//  the triangles.  The index list is stored in BVH leaf order, so the
+//  triangles of a leaf are consecutive slots of "triangles" and can be tested
+//  together by the SIMD kernel.  primID of a hit is the triangle's slot.
+//
+//  The geometry never changes once built, so clones (render snapshots) share
+//  it instead of copying it.
+//
+struct MeshGeometry {
+	// indexed triangle list (normals and texCoords are optional, one per vertex)
+	//
+	vector<glm::vec3> vertices;
+	vector<glm::vec3> normals;
+	vector<glm::vec2> texCoords;
+	vector<uint32_t> indices;
+
+	BVH bvh;
+	TriangleSoA triangles;
+};
+
 class Mesh : public SceneObject {
-	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) { return false; }
-	void draw() { }
+public:
+	Mesh(ofColor diffuse = ofColor::lightGray) { diffuseColor = diffuse; }
+	bool load(const string& path);
+	void build();
+	SceneObject* clone();
+	bool intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit);
+	bool occluded(const Ray& ray, float tMin, float tMax);
+	AABB getBounds();
+	void draw();
+	int numTriangles() const { return (int)geometry->indices.size() / 3; }
+
+	std::shared_ptr<MeshGeometry> geometry = std::make_shared<MeshGeometry>();
+	string path;              // model file it was loaded from, for saving
+	ofVboMesh drawMesh;
+	ofMaterial material;
 };
 
 
@@ -223,8 +338,12 @@ public:
 		normal = glm::vec3(0, 1, 0);
 		plane.rotateDeg(90, 1, 0, 0);
 	}
-	~Plane() { cout << "in Plane destructor (~Plane)" << endl; }
-	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal);
+	SceneObject* clone() { return new Plane(*this); }
+	bool intersect(const Ray& ray, float tMin, float tMax, HitRecord& hit);
+	bool occluded(const Ray& ray, float tMin, float tMax);
+	bool contains(const glm::vec3& point);
+	glm::vec2 getUV(const glm::vec3& point);
+	AABB getBounds();
 	float sdf(const glm::vec3& p);
 	glm::vec3 getNormal(const glm::vec3& p) { return this->normal; }
 	void draw() {
@@ -260,6 +379,7 @@ public:
 		normal = glm::vec3(0, 0, 1);      // viewplane currently limited to Z axis orientation
 	}
 
+	SceneObject* clone() { return new ViewPlane(*this); }
 	void setSize(glm::vec2 min, glm::vec2 max) { this->min = min; this->max = max; }
 	float getAspect() { return width() / height(); }
 
@@ -322,6 +442,7 @@ public:
 		aim = glm::vec3(0, 0, -1);
 	}
 	Ray getRay(float u, float v);
+	SceneObject* clone() { return new RenderCam(*this); }
 	void draw() { 
 		glm::mat4 m = getMatrix();
 
@@ -341,6 +462,13 @@ public:
 
 // Light Class repurposed from Project 2 to extend the Point Light Class, seen below
 //
+//  Shading asks a light for the points on it that shadow rays from a surface
+//  point should be sent to (getSamples), and averages over them, so every
+//  sample has the same weight.  Area lights draw their samples from a table
+//  of stratified, low-discrepancy points in [0, 1)^2 built once per light
+//  (setNumSamples) and written into storage owned by the caller, so a soft
+//  shadow costs no allocations.
+//
 class Light : public Sphere {
 public:
 	Light(glm::vec3 p, float i, ofColor diffuse) {
@@ -357,16 +485,37 @@ public:
 		isSelectable = true;
 	}
 
-	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) {
-		return (glm::intersectRaySphere(ray.p, ray.d, position, radius, point, normal));
-	}
+	SceneObject* clone() { return new Light(*this); }
 
-	virtual int getRaySamples(glm::vec3 p, std::vector<Ray>& samples) {
+	// Write up to capacity sample points on the light, as seen from p, into
+	// samples and return how many were written (0 if p can't see the light).
+	// rotation is added (mod 1) to the table's points, so nearby shading
+	// points don't all use the same pattern.  A light without area has one
+	// sample, its position.
+	//
+	virtual int getSamples(const glm::vec3& /*p*/, glm::vec3* samples, int capacity, const glm::vec2& /*rotation*/) const {
+		if (capacity < 1) return 0;
+		samples[0] = position;
 		return 1;
 	}
 
+	// build the sample table with n points (at most maxSamples): a Hammersley
+	// set, one point in each of n columns and evenly spread over the rows
+	//
+	void setNumSamples(int n);
+	int numSamples() const { return (int)sampleTable.size(); }
+
+	static const int maxSamples = 64;
+
 	ofColor color = ofColor::white;
 	float intensity;
+	vector<glm::vec2> sampleTable;
+
+protected:
+	glm::vec2 tableSample(int i, const glm::vec2& rotation) const {
+		glm::vec2 uv = sampleTable[i] + rotation;
+		return uv - glm::floor(uv);
+	}
 };
 
 // Point Light Class, which is used to create light spheres
@@ -387,21 +536,49 @@ public:
 		intensity = 0;
 		isSelectable = true;
 	}
-
-	bool intersect(const Ray& ray, glm::vec3& point, glm::vec3& normal) {
-		return (glm::intersectRaySphere(ray.p, ray.d, position, radius, point, normal));
-	}
 	
-	int getRaySamples(glm::vec3 p, std::vector<Ray>& samples) {
-		int numSamples = 1;
+	SceneObject* clone() { return new PointLight(*this); }
+};
 
-		samples.clear();
+// Spherical area light.  Samples are spread over the half of the sphere that
+// faces the shading point, evenly in area (z = u, angle = 2 pi v), which is
+// the part that can light it.
+//
+class SphereLight : public Light {
+public:
+	SphereLight(string n, float r, float i, ofColor diffuse, int samples = 16) {
+		this->name = n;
+		radius = r;
+		intensity = i;
+		diffuseColor = diffuse;
+		isSelectable = true;
+		setNumSamples(samples);
+	}
 
-		for (int i = 0; i < numSamples; i++) {
-			Ray sampleRay(p + (glm::normalize(position - p) * 0.001f), glm::normalize(position - p));
-			samples.push_back(sampleRay);
-		}
+	SceneObject* clone() { return new SphereLight(*this); }
+	int getSamples(const glm::vec3& p, glm::vec3* samples, int capacity, const glm::vec2& rotation) const;
+};
 
-		return numSamples;
+// Rectangular area light, width x height, lying in the object's xz plane and
+// shining down (-y) from its front side only.  Samples are stratified over
+// the rectangle.  Uses the cached world matrix, so getMatrix() must have been
+// called since the light last changed (render snapshots do this).
+//
+class RectLight : public Light {
+public:
+	RectLight(string n, float w, float h, float i, ofColor diffuse, int samples = 16) {
+		this->name = n;
+		width = w;
+		height = h;
+		radius = 0.5f * sqrt(w * w + h * h);   // for picking
+		intensity = i;
+		diffuseColor = diffuse;
+		isSelectable = true;
+		setNumSamples(samples);
 	}
+
+	SceneObject* clone() { return new RectLight(*this); }
+	int getSamples(const glm::vec3& p, glm::vec3* samples, int capacity, const glm::vec2& rotation) const;
+	AABB getBounds();
+	void draw();
 };
\ No newline at end of file
@@ -0,0 +1,139 @@
+//
+//  Profiler.cpp - per-thread counters, phase events and trace export
+//
+
+#include "Profiler.h"
+
+#if RT_PROFILE
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+
+namespace Profiler {
+
+	static const char* counterNames[NumProfileCounters] = {
+		"primary rays",
+		"shadow rays",
+		"sphere tests",
+		"plane tests",
+		"cube tests",
+		"cone tests",
+		"triangle tests",
+		"BVH nodes",
+		"texture fetches",
+		"shade ns",
+	};
+
+	static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+	// Every thread that ever counted something.  Entries are never removed,
+	// a thread's thread_local pointer stays valid for its whole life and the
+	// counts of finished threads still show up in the totals.
+	//
+	static std::mutex registryLock;
+	static std::vector<std::unique_ptr<ThreadData>> registry;
+
+	ThreadData* registerThread() {
+		std::lock_guard<std::mutex> lock(registryLock);
+		registry.emplace_back(new ThreadData());
+		ThreadData* data = registry.back().get();
+		data->id = (int)registry.size();
+		for (auto& c : data->counters) c.store(0, std::memory_order_relaxed);
+		return data;
+	}
+
+	int64_t nowNanos() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+	}
+
+	void addEvent(const char* name, int64_t startNanos, int64_t endNanos) {
+		ThreadData& data = threadData();
+		std::lock_guard<std::mutex> lock(data.eventLock);
+		data.events.push_back({ name, startNanos / 1000, (endNanos - startNanos) / 1000 });
+	}
+
+	void reset() {
+		std::lock_guard<std::mutex> lock(registryLock);
+		for (auto& data : registry) {
+			for (auto& c : data->counters) c.store(0, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> eventLock(data->eventLock);
+			data->events.clear();
+		}
+	}
+
+	uint64_t total(ProfileCounter counter) {
+		std::lock_guard<std::mutex> lock(registryLock);
+		uint64_t sum = 0;
+		for (auto& data : registry) sum += data->counters[counter].load(std::memory_order_relaxed);
+		return sum;
+	}
+
+	// Counter totals, then per event name the number of events and their
+	// total and longest time.  Phases that run on several threads at once
+	// (trace) add up to more than the wall clock time.
+	//
+	void printSummary() {
+		struct Phase { int count = 0; int64_t total = 0; int64_t longest = 0; };
+		std::map<std::string, Phase> phases;
+		{
+			std::lock_guard<std::mutex> lock(registryLock);
+			for (auto& data : registry) {
+				std::lock_guard<std::mutex> eventLock(data->eventLock);
+				for (auto& e : data->events) {
+					Phase& p = phases[e.name];
+					p.count++;
+					p.total += e.duration;
+					p.longest = std::max(p.longest, e.duration);
+				}
+			}
+		}
+
+		std::cout << "Render profile" << std::endl;
+		for (int c = 0; c < NumProfileCounters; c++) {
+			std::cout << "  " << std::left << std::setw(18) << counterNames[c] << std::right << total((ProfileCounter)c) << std::endl;
+		}
+		std::cout << std::fixed << std::setprecision(2);
+		for (auto& phase : phases) {
+			std::cout << "  " << std::left << std::setw(18) << phase.first << std::right << phase.second.count << " x, "
+				<< phase.second.total / 1000.0 << " ms total, " << phase.second.longest / 1000.0 << " ms longest" << std::endl;
+		}
+		std::cout << std::defaultfloat;
+	}
+
+	// complete ("X") events, one track per thread, counter totals in the
+	// metadata
+	//
+	bool writeTrace(const std::string& path) {
+		std::ofstream out(path);
+		if (!out) return false;
+
+		out << "{\"traceEvents\":[\n";
+		bool first = true;
+		{
+			std::lock_guard<std::mutex> lock(registryLock);
+			for (auto& data : registry) {
+				std::lock_guard<std::mutex> eventLock(data->eventLock);
+				if (data->events.empty()) continue;
+				out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << data->id
+					<< ",\"args\":{\"name\":\"thread " << data->id << "\"}}";
+				first = false;
+				for (auto& e : data->events) {
+					out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << data->id
+						<< ",\"ts\":" << e.start << ",\"dur\":" << e.duration << "}";
+				}
+			}
+		}
+		out << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{";
+		for (int c = 0; c < NumProfileCounters; c++) {
+			out << (c ? "," : "") << "\"" << counterNames[c] << "\":\"" << total((ProfileCounter)c) << "\"";
+		}
+		out << "}}\n";
+		return (bool)out;
+	}
+}
+
+#endif
@@ -0,0 +1,123 @@
+//
+//  Profiler.h - render counters and a timeline of render phases
+//
+//  Built only when RT_PROFILE is defined to 1 (add it to the preprocessor
+//  definitions of the project); otherwise every PROFILE_ macro expands to
+//  nothing and the hot paths are exactly as without it.
+//
+//  PROFILE_COUNT(counter) and PROFILE_COUNT_N(counter, n) bump a counter of
+//  the calling thread.  Every thread has its own set, so counting costs a
+//  plain add on memory no other thread writes.  PROFILE_SCOPE("name") records
+//  the time from there to the end of the scope as an event on the calling
+//  thread's timeline, and PROFILE_TIMER(counter) adds it (in ns) to a
+//  counter instead, for scopes too short and many to keep one event each.
+//
+//  Profiler::printSummary() prints the totals over all threads and
+//  Profiler::writeTrace() saves the events as a Chrome trace_event JSON
+//  file (open it in chrome://tracing or ui.perfetto.dev).
+//
+#pragma once
+
+#ifndef RT_PROFILE
+#define RT_PROFILE 0
+#endif
+
+enum ProfileCounter {
+	ProfilePrimaryRays,
+	ProfileShadowRays,
+	ProfileSphereTests,       // one per SIMD slot in the sphere kernels
+	ProfilePlaneTests,
+	ProfileCubeTests,
+	ProfileConeTests,
+	ProfileTriangleTests,
+	ProfileBVHNodes,          // nodes visited, scene and mesh BVHs
+	ProfileTextureFetches,
+	ProfileShadeNanos,        // time spent in shadeHit
+	NumProfileCounters
+};
+
+#if RT_PROFILE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Profiler {
+
+	struct Event {
+		const char* name;     // string literal
+		int64_t start;        // us since the profiler started
+		int64_t duration;     // us
+	};
+
+	// Counters and events of one thread.  Only the owning thread writes
+	// them; the counters are relaxed atomics (load, add, store, no locked
+	// instruction) so a summary can read them while threads still run.
+	//
+	struct ThreadData {
+		int id = 0;
+		std::atomic<uint64_t> counters[NumProfileCounters];
+		std::mutex eventLock;
+		std::vector<Event> events;
+	};
+
+	ThreadData* registerThread();
+
+	inline ThreadData& threadData() {
+		thread_local ThreadData* data = registerThread();
+		return *data;
+	}
+
+	inline void count(ProfileCounter counter, uint64_t n) {
+		std::atomic<uint64_t>& c = threadData().counters[counter];
+		c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	int64_t nowNanos();
+	void addEvent(const char* name, int64_t startNanos, int64_t endNanos);
+
+	class Scope {
+	public:
+		Scope(const char* name) : name(name), start(nowNanos()) {}
+		~Scope() { addEvent(name, start, nowNanos()); }
+	private:
+		const char* name;
+		int64_t start;
+	};
+
+	class Timer {
+	public:
+		Timer(ProfileCounter counter) : counter(counter), start(nowNanos()) {}
+		~Timer() { count(counter, nowNanos() - start); }
+	private:
+		ProfileCounter counter;
+		int64_t start;
+	};
+
+	// zero the counters and drop the events of every thread
+	//
+	void reset();
+
+	uint64_t total(ProfileCounter counter);
+	void printSummary();
+	bool writeTrace(const std::string& path);
+}
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_COUNT(counter) Profiler::count(counter, 1)
+#define PROFILE_COUNT_N(counter, n) Profiler::count(counter, (n))
+#define PROFILE_SCOPE(name) Profiler::Scope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_TIMER(counter) Profiler::Timer PROFILE_CONCAT(profileTimer, __LINE__)(counter)
+
+#else
+
+#define PROFILE_COUNT(counter) ((void)0)
+#define PROFILE_COUNT_N(counter, n) ((void)0)
+#define PROFILE_SCOPE(name) ((void)0)
+#define PROFILE_TIMER(counter) ((void)0)
+
+#endif
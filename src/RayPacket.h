@@ -0,0 +1,37 @@
+//
+//  RayPacket.h - a small bundle of coherent rays traced together
+//
+//  Primary rays for a 4x2 block of neighboring pixels start at the camera and
+//  point in almost the same direction, so they tend to visit the same BVH
+//  nodes.  Tracing them as a packet fetches and tests each node once for the
+//  whole bundle.  Lanes are stored structure-of-arrays so the SIMD kernels can
+//  load all of them at once; a bit mask says which lanes are in use.
+//
+#pragma once
+
+#include "glm/glm.hpp"
+
+struct RayPacket {
+	static const int width = 8;
+	static const int allLanes = (1 << width) - 1;
+
+	void set(int lane, const glm::vec3& orig, const glm::vec3& dir) {
+		ox[lane] = orig.x; oy[lane] = orig.y; oz[lane] = orig.z;
+		dx[lane] = dir.x; dy[lane] = dir.y; dz[lane] = dir.z;
+		ix[lane] = 1.0f / dir.x; iy[lane] = 1.0f / dir.y; iz[lane] = 1.0f / dir.z;
+	}
+
+	glm::vec3 origin(int lane) const { return glm::vec3(ox[lane], oy[lane], oz[lane]); }
+	glm::vec3 direction(int lane) const { return glm::vec3(dx[lane], dy[lane], dz[lane]); }
+	glm::vec3 invDirection(int lane) const { return glm::vec3(ix[lane], iy[lane], iz[lane]); }
+
+	alignas(32) float ox[width];
+	alignas(32) float oy[width];
+	alignas(32) float oz[width];
+	alignas(32) float dx[width];
+	alignas(32) float dy[width];
+	alignas(32) float dz[width];
+	alignas(32) float ix[width];   // 1 / direction
+	alignas(32) float iy[width];
+	alignas(32) float iz[width];
+};
@@ -0,0 +1,688 @@
+//
+//  RenderScene.cpp - tracing and shading against a scene snapshot
+//
+
+#include "RenderScene.h"
+#include "Profiler.h"
+#include <algorithm>
+#include <cstring>
+
+// Shadow rays cast by this thread, ever.  Render tasks add what they cast
+// to shadowRaysTraced when they finish, so the shared counter isn't touched
+// once per ray.
+//
+static thread_local long long shadowRaysCast = 0;
+
+RenderScene::~RenderScene() {
+	for (auto object : scene) delete object;
+	for (auto light : pointLightObjs) delete light;
+}
+
+// a clone detached from the hierarchy, pointing back at the original
+//
+template<class T>
+static T* detachedClone(T* object) {
+	T* copy = static_cast<T*>(object->clone());
+	copy->parent = NULL;
+	copy->childList.clear();
+	copy->source = object;
+	return copy;
+}
+
+void RenderScene::copyObjects(const vector<SceneObject*>& objects, const vector<Light*>& lights) {
+	for (auto object : objects) {
+		SceneObject* copy = detachedClone(object);
+		clones[object] = copy;
+		scene.push_back(copy);
+	}
+	for (auto light : lights) pointLightObjs.push_back(detachedClone(light));
+}
+
+void RenderScene::syncObjects(const vector<SceneObject*>& objects, const vector<Light*>& lights, const vector<int>& changed, const BVH& bvh, const vector<int>& slots) {
+	for (int k : changed) {
+		SceneObject* copy = detachedClone(objects[k]);
+		delete scene[k];
+		scene[k] = copy;
+		clones[objects[k]] = copy;
+		sceneBVH.refit(k, bvh.primBounds[k]);
+		if (copy->isSphere()) sceneSpheres.set(slots[k], copy->position, copy->radius);
+	}
+
+	for (auto light : pointLightObjs) delete light;
+	pointLightObjs.clear();
+	for (auto light : lights) pointLightObjs.push_back(detachedClone(light));
+}
+
+void RenderScene::resetWork() {
+	bFullFrame = true;
+	tiles.clear();
+	recolored.clear();
+	samplesTraced = 0;
+	shadowRaysTraced = 0;
+}
+
+void RenderScene::buildSceneBVH(ThreadPool* pool) {
+	vector<AABB> bounds;
+	bounds.reserve(scene.size());
+	for (auto object : scene) bounds.push_back(object->getBounds());
+	sceneBVH.maxLeafSize = 8;
+	if (pool) sceneBVH.build(bounds, *pool);
+	else sceneBVH.build(bounds);
+	buildSceneSpheres();
+}
+
+void RenderScene::buildSceneSpheres() {
+	int n = sceneBVH.primIndices.size();
+	sceneSpheres.resize(n);
+	for (int slot = 0; slot < n; slot++) {
+		int k = sceneBVH.primIndices[slot];
+		if (scene[k]->isSphere()) sceneSpheres.set(slot, scene[k]->position, scene[k]->radius);
+	}
+}
+
+// Progressive renders trace one pixel per 4x4 block and fill the block with
+// it, then one per 2x2 block, then every pixel.  The sample of a block is
+// its corner pixel, so each pass skips the pixels the pass before it
+// traced and the three passes together cost the same as a single one.
+//
+bool RenderScene::render(FrameBuffer& target, ThreadPool& pool, const std::atomic<bool>& cancel) {
+	PROFILE_SCOPE("render");
+	int tilesX = (imageWidth + tileSize - 1) / tileSize;
+	int tilesY = (imageHeight + tileSize - 1) / tileSize;
+	if (settings.lightFalloff) buildLightBVH();
+	if (settings.sampleLights) buildLightTable();
+	if (bFullFrame) {
+		tiles.resize(tilesX * tilesY);
+		for (int tile = 0; tile < tilesX * tilesY; tile++) tiles[tile] = tile;
+	}
+
+	// recolored objects first, the traced tiles then overwrite their share
+	//
+	if (!recolored.empty()) {
+		reshadePass(target, pool, cancel);
+		if (cancel) return false;
+	}
+	if (tiles.empty()) return true;
+
+	if (!settings.progressive) {
+		renderPass(target, pool, cancel, 1, 0);
+		return !cancel;
+	}
+
+	// antialiased pixels don't use the center sample of the coarse passes,
+	// so the last pass does every pixel
+	//
+	const int blockSizes[] = { 4, 2, 1 };
+	int previous = 0;
+	for (int block : blockSizes) {
+		renderPass(target, pool, cancel, block, block == 1 && settings.antialias ? 0 : previous);
+		if (cancel) return false;
+		previous = block;
+	}
+	return true;
+}
+
+// The image is cut into tileSize x tileSize tiles and the ones listed in
+// "tiles" are handed out to the render pool; idle workers steal tiles from
+// busy ones.  Tiles are a multiple of every block size, so blocks never
+// straddle two tiles.
+//
+void RenderScene::renderPass(FrameBuffer& target, ThreadPool& pool, const std::atomic<bool>& cancel, int block, int skip) {
+	int tilesX = (imageWidth + tileSize - 1) / tileSize;
+
+	pool.parallelFor((int)tiles.size(), [&](int task, int /*worker*/) {
+		if (cancel) return;
+		PROFILE_SCOPE("trace");
+
+		int tile = tiles[task];
+		long long shadowRaysBefore = shadowRaysCast;
+		int x0 = (tile % tilesX) * tileSize;
+		int y0 = (tile / tilesX) * tileSize;
+		int x1 = std::min(x0 + tileSize, imageWidth);
+		int y1 = std::min(y0 + tileSize, imageHeight);
+		long long samples = 0;
+
+		if (block == 1 && settings.antialias) {
+			for (int j = y0; j < y1; j++) {
+				for (int i = x0; i < x1; i++) {
+					HitRecord hit;
+					int n;
+					writePixel(target, i, j, samplePixel(i, j, hit, n));
+					writeSample(i, j, hit);
+					samples += n;
+				}
+			}
+		}
+		else if (block == 1 && settings.packets) {
+			for (int j = y0; j < y1; j += packetHeight) {
+				for (int i = x0; i < x1; i += packetWidth) {
+					samples += tracePacket(i, j, std::min(i + packetWidth, x1), std::min(j + packetHeight, y1), target, skip);
+				}
+			}
+		}
+		else {
+			for (int j = y0; j < y1; j += block) {
+				for (int i = x0; i < x1; i += block) {
+					if (skip && i % skip == 0 && j % skip == 0) continue;
+
+					HitRecord hit;
+					ofColor color = tracePixel(i, j, hit);
+					writeSample(i, j, hit);
+					samples++;
+					for (int y = j; y < std::min(j + block, y1); y++) {
+						for (int x = i; x < std::min(i + block, x1); x++) writePixel(target, x, y, color);
+					}
+				}
+			}
+		}
+		samplesTraced += samples;
+		shadowRaysTraced += shadowRaysCast - shadowRaysBefore;
+		PROFILE_COUNT_N(ProfilePrimaryRays, samples);
+
+		// j counts up from the bottom, frame buffer rows go down
+		//
+		if (regionDone) regionDone(x0, imageHeight - y1, x1, imageHeight - y0);
+	});
+}
+
+// hash of a sample number to [0, 1), so a pixel always gets the same jitter
+// and re-rendering part of the image matches rendering all of it
+//
+static float sampleHash(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// Adaptive supersampling.  The pixel is split into 4x4 cells and sampled in
+// batches of four, one jittered sample per quadrant in each batch.  After
+// aaMinSamples, more batches are taken only while the samples disagree:
+// the color variance of a channel is above aaThreshold, or the samples hit
+// different objects or differently facing surfaces.  hit is the first
+// sample's hit (for the G-buffer).
+//
+ofColor RenderScene::samplePixel(int i, int j, HitRecord& hit, int& numSamples) {
+	glm::vec3 sum(0), sumSquares(0);
+	SceneObject* firstObj = NULL;
+	glm::vec3 firstNormal;
+	bool geometryVaries = false;
+	uint32_t seed = ((uint32_t)j * imageWidth + i) * 32;
+
+	int n = 0;
+	while (n < settings.aaMaxSamples) {
+		for (int k = n; k < n + 4; k++) {
+			int quadrant = k & 3;
+			int cell = (k >> 2) & 3;
+			float sx = ((quadrant & 1) * 2 + (cell & 1) + sampleHash(seed + 2 * k)) / 4;
+			float sy = ((quadrant >> 1) * 2 + (cell >> 1) + sampleHash(seed + 2 * k + 1)) / 4;
+			Ray ray = renderCam.getRay((i + sx) / imageWidth, (j + sy) / imageHeight);
+
+			HitRecord sample;
+			ofColor color = intersectScene(ray, sample) ? shadeHit(sample) : backgroundColor;
+			glm::vec3 c(color.r / 255.0f, color.g / 255.0f, color.b / 255.0f);
+			sum += c;
+			sumSquares += c * c;
+
+			if (k == 0) {
+				hit = sample;
+				firstObj = sample.obj;
+				firstNormal = sample.normal;
+			}
+			else if (sample.obj != firstObj || (sample.obj && glm::dot(sample.normal, firstNormal) < 0.9f)) {
+				geometryVaries = true;
+			}
+		}
+		n += 4;
+		if (n < settings.aaMinSamples) continue;
+
+		glm::vec3 mean = sum / (float)n;
+		glm::vec3 variance = sumSquares / (float)n - mean * mean;
+		float maxVariance = std::max(variance.x, std::max(variance.y, variance.z));
+		if (!geometryVaries && maxVariance <= settings.aaThreshold) break;
+	}
+
+	numSamples = n;
+	glm::vec3 mean = sum / (float)n * 255.0f;
+	return ofColor(mean.x + 0.5f, mean.y + 0.5f, mean.z + 0.5f);
+}
+
+// Shade the pixels of the recolored objects again from the G-buffer.  The
+// hits are the same, so only the shading (and its shadow rays) is redone.
+//
+void RenderScene::reshadePass(FrameBuffer& target, ThreadPool& pool, const std::atomic<bool>& cancel) {
+	pool.parallelFor(imageHeight, [&](int y, int /*worker*/) {
+		if (cancel) return;
+		PROFILE_SCOPE("reshade");
+		long long shadowRaysBefore = shadowRaysCast;
+
+		const GBufferSample* row = gBuffer + (size_t)y * imageWidth;
+		for (int x = 0; x < imageWidth; x++) {
+			const GBufferSample& sample = row[x];
+			if (!sample.object) continue;
+			if (std::find(recolored.begin(), recolored.end(), sample.object) == recolored.end()) continue;
+
+			auto clone = clones.find(sample.object);
+			if (clone == clones.end()) continue;
+
+			HitRecord hit;
+			hit.t = sample.t;
+			hit.point = sample.point;
+			hit.normal = sample.normal;
+			hit.uv = sample.uv;
+			hit.primID = sample.primID;
+			hit.obj = clone->second;
+			writePixel(target, x, imageHeight - 1 - y, shadeHit(hit));
+		}
+		shadowRaysTraced += shadowRaysCast - shadowRaysBefore;
+		if (regionDone) regionDone(0, y, imageWidth, y + 1);
+	});
+}
+
+void RenderScene::buildLightBVH() {
+	lightRanges.assign(pointLightObjs.size(), 0.0f);
+	influenceLights.clear();
+	vector<AABB> bounds;
+	for (int k = 0; k < (int)pointLightObjs.size(); k++) {
+		const Light* light = pointLightObjs[k];
+		float range2 = lightStrength(light) / glm::max(settings.lightCutoff, 1e-6f) - 1;
+		if (range2 <= 0) continue;
+
+		lightRanges[k] = sqrt(range2);
+		glm::vec3 reach(lightRanges[k] + light->radius);
+		bounds.push_back(AABB(light->position - reach, light->position + reach));
+		influenceLights.push_back(k);
+	}
+	lightBVH.build(bounds);
+}
+
+// Lights that don't add anything (black, or no intensity) are never picked
+//
+void RenderScene::buildLightTable() {
+	vector<float> weights(pointLightObjs.size());
+	for (int k = 0; k < (int)pointLightObjs.size(); k++) weights[k] = lightStrength(pointLightObjs[k]);
+	lightTable.build(weights);
+}
+
+template<class F>
+void RenderScene::forEachLight(const glm::vec3& p, uint32_t seed, F&& f) const {
+	if (settings.sampleLights) {
+		if (lightTable.empty()) return;
+		int m = glm::max(settings.lightSamples, 1);
+		for (int s = 0; s < m; s++) {
+			int k = lightTable.sample(sampleHash(seed + s));
+			f(k, 1.0f / (m * lightTable.pdf[k]));
+		}
+		return;
+	}
+	if (!settings.lightFalloff) {
+		for (int k = 0; k < (int)pointLightObjs.size(); k++) f(k, 1.0f);
+		return;
+	}
+	lightBVH.pointQuery(p, [&](int first, int count) {
+		for (int i = first; i < first + count; i++) {
+			int k = influenceLights[lightBVH.primIndices[i]];
+			float r = lightRanges[k] + pointLightObjs[k]->radius;
+			glm::vec3 d = p - pointLightObjs[k]->position;
+			if (glm::dot(d, d) < r * r) f(k, 1.0f);
+		}
+	});
+}
+
+// Per shading point random numbers come from a hash of its position, so a
+// point is always shaded the same way (re-shading from the G-buffer gives
+// the pixel it had) while neighboring points get unrelated numbers.
+//
+static uint32_t pointSeed(const glm::vec3& p) {
+	uint32_t bits[3];
+	memcpy(bits, &p, sizeof(bits));
+	return bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u;
+}
+
+// Rotation of the lights' sample tables for a shading point, so neighboring
+// points see different sample patterns and the error of a soft shadow turns
+// into fine noise instead of banding.
+//
+static glm::vec2 sampleRotation(uint32_t seed) {
+	return glm::vec2(sampleHash(seed), sampleHash(seed + 1));
+}
+
+// Lights are averaged over their samples: each sample that isn't blocked
+// adds its cosine (and for phong, its highlight) divided by the number of
+// samples.  A point light has a single sample at its position.  Each light
+// is scaled by the weight forEachLight() gives it.  The lights are summed
+// in floating point and clamped once at the end, so many dim lights add up
+// instead of each being rounded down to 8 bits.
+//
+static glm::vec3 colorToVec(const ofColor& c) {
+	return glm::vec3(c.r, c.g, c.b) * (1.0f / 255);
+}
+
+static ofColor vecToColor(const glm::vec3& c) {
+	glm::vec3 v = glm::clamp(c, 0.0f, 1.0f) * 255.0f;
+	return ofColor(v.x + 0.5f, v.y + 0.5f, v.z + 0.5f);
+}
+
+ofColor RenderScene::lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor& diffuse) const {
+	float intensity = settings.lightIntensity;
+	glm::vec3 lighting(0);
+	glm::vec3 diffuseColor = colorToVec(diffuse);
+	glm::vec3 samples[Light::maxSamples];
+	uint32_t seed = pointSeed(p);
+	glm::vec2 rotation = sampleRotation(seed);
+
+	forEachLight(p, seed + 2, [&](int k, float weight) {
+		const Light* light = pointLightObjs[k];
+		int n = light->getSamples(p, samples, Light::maxSamples, rotation);
+
+		// Shadows are created here.  Only objects between the point and the
+		// light sample can block it.
+		//
+		glm::vec3 shadowOrigin = p + norm * 0.0001f;
+		float diffuseSum = 0;
+
+		for (int i = 0; i < n; i++) {
+			glm::vec3 lightPos = glm::normalize(samples[i] - p);
+			float dotProd = glm::dot(norm, lightPos);
+			if (dotProd <= 0) continue;
+
+			float lightDist = glm::distance(shadowOrigin, samples[i]);
+			float falloff = attenuation(k, lightDist);
+			if (falloff <= 0) continue;
+
+			Ray shadowRay(shadowOrigin, lightPos);
+			if (!occludedScene(shadowRay, 0, lightDist)) diffuseSum += dotProd * falloff;
+		}
+
+		// Lambert lighting is made here
+		//
+		if (diffuseSum > 0) {
+			lighting += diffuseColor * colorToVec(light->color) * ((light->intensity + intensity) * diffuseSum / n * weight);
+		}
+	});
+
+	return vecToColor(lighting);
+}
+
+ofColor RenderScene::phong(const glm::vec3& p, const glm::vec3& norm, const ofColor& diffuse, const ofColor& specular, float power) const {
+	float intensity = settings.lightIntensity;
+	power = settings.powerExponent;
+	glm::vec3 lighting(0);
+	glm::vec3 diffuseColor = colorToVec(diffuse);
+	glm::vec3 specularColor = colorToVec(specular);
+	glm::vec3 samples[Light::maxSamples];
+	uint32_t seed = pointSeed(p);
+	glm::vec2 rotation = sampleRotation(seed);
+	glm::vec3 viewDir = glm::normalize(renderCam.view.position);
+
+	forEachLight(p, seed + 2, [&](int k, float weight) {
+		const Light* light = pointLightObjs[k];
+		int n = light->getSamples(p, samples, Light::maxSamples, rotation);
+
+		// Shadows are created here.  Only objects between the point and the
+		// light sample can block it.
+		//
+		glm::vec3 shadowOrigin = p + norm * 0.0001f;
+		float diffuseSum = 0;
+		float specularSum = 0;
+
+		for (int i = 0; i < n; i++) {
+			float lightDist = glm::distance(shadowOrigin, samples[i]);
+			float falloff = attenuation(k, lightDist);
+			if (falloff <= 0) continue;
+
+			glm::vec3 lightPos = glm::normalize(samples[i] - p);
+			Ray shadowRay(shadowOrigin, lightPos);
+			if (occludedScene(shadowRay, 0, lightDist)) continue;
+
+			diffuseSum += glm::max(glm::dot(norm, lightPos), 0.0f) * falloff;
+			specularSum += glm::pow(glm::max(glm::dot(viewDir, glm::reflect(-lightPos, norm)), 0.0f), power) * falloff;
+		}
+
+		// Phong lighting is made here
+		//
+		if (n > 0) {
+			glm::vec3 lightColor = colorToVec(light->color);
+			lighting += (diffuseColor * lightColor * (light->intensity * diffuseSum / n * weight)) +
+				(specularColor * lightColor * ((light->intensity + intensity) * specularSum / n * weight));
+		}
+	});
+
+	return vecToColor(lighting);
+}
+
+
+// Closest hit against the whole scene.  hit.t is used as the initial
+// maximum distance, so a caller can pass in a record that already holds a hit.
+//
+// Spheres in a leaf are tested together by the SIMD kernel; anything else is
+// tested through its own intersect(), bounded by the closest hit so far.
+//
+bool RenderScene::intersectScene(const Ray& ray, HitRecord& hit) const {
+	float tMax = hit.t;
+	return sceneBVH.closestHitLeaves(ray.p, ray.d, tMax, [&](int first, int count, float& t) {
+		bool found = false;
+		int slot = intersectSpheres(sceneSpheres, first, count, ray.p, ray.d, t);
+		if (slot >= 0) {
+			static_cast<Sphere*>(scene[sceneBVH.primIndices[slot]])->setHit(ray, t, hit);
+			found = true;
+		}
+		for (slot = first; slot < first + count; slot++) {
+			if (sceneSpheres.isSphere(slot)) continue;
+			if (!scene[sceneBVH.primIndices[slot]]->intersect(ray, 0, t, hit)) continue;
+			t = hit.t;
+			found = true;
+		}
+		return found;
+	});
+}
+
+// True if anything in the scene blocks the ray between distance tMin and
+// tMax, e.g. between a shaded point and a light.  Stops at the first blocker
+// found and never computes hit points or normals.
+//
+bool RenderScene::occludedScene(const Ray& ray, float tMin, float tMax) const {
+	// start the ray at tMin, so the sphere kernel (which counts hits past a
+	// tiny epsilon) and the BVH both work on [0, tMax - tMin]
+	//
+	Ray segment(ray.p + ray.d * tMin, ray.d);
+	float length = tMax - tMin;
+	if (length <= 0) return false;
+	PROFILE_COUNT(ProfileShadowRays);
+	shadowRaysCast++;
+
+	return sceneBVH.anyHitLeaves(segment.p, segment.d, length, [&](int first, int count, float t) {
+		if (intersectSpheres(sceneSpheres, first, count, segment.p, segment.d, t) >= 0) return true;
+		for (int slot = first; slot < first + count; slot++) {
+			if (sceneSpheres.isSphere(slot)) continue;
+			if (scene[sceneBVH.primIndices[slot]]->occluded(segment, 0, t)) return true;
+		}
+		return false;
+	});
+}
+
+// Closest hit for every lane of a packet in laneMask; hits[lane] gets the
+// result for that lane.  The lanes walk the BVH together, spheres are tested
+// against all lanes at once, and anything else through its own intersect().
+// Lanes that split off from the rest finish on their own with the same leaf
+// test intersectScene() uses, so every lane ends up with the same hit as a
+// single ray would.
+//
+void RenderScene::intersectScenePacket(const RayPacket& packet, int laneMask, HitRecord* hits) const {
+	float tMax[RayPacket::width];
+	for (int lane = 0; lane < RayPacket::width; lane++) tMax[lane] = hits[lane].t;
+
+	auto setSphereHit = [&](int lane, int slot) {
+		Ray ray(packet.origin(lane), packet.direction(lane));
+		static_cast<Sphere*>(scene[sceneBVH.primIndices[slot]])->setHit(ray, tMax[lane], hits[lane]);
+	};
+	auto intersectOther = [&](int lane, int slot, float& t) {
+		Ray ray(packet.origin(lane), packet.direction(lane));
+		if (!scene[sceneBVH.primIndices[slot]]->intersect(ray, 0, t, hits[lane])) return false;
+		t = hits[lane].t;
+		return true;
+	};
+
+	sceneBVH.closestHitPacket(packet, laneMask, tMax,
+		[&](int first, int count, int mask, float* t) {
+			int slots[RayPacket::width];
+			int hitMask = intersectSpheresPacket(sceneSpheres, first, count, packet, mask, t, slots);
+			for (int lane = 0; lane < RayPacket::width; lane++) {
+				if (hitMask & (1 << lane)) setSphereHit(lane, slots[lane]);
+			}
+			for (int slot = first; slot < first + count; slot++) {
+				if (sceneSpheres.isSphere(slot)) continue;
+				for (int lane = 0; lane < RayPacket::width; lane++) {
+					if (mask & (1 << lane)) intersectOther(lane, slot, t[lane]);
+				}
+			}
+		},
+		[&](int lane, int first, int count, float& t) {
+			bool found = false;
+			int slot = intersectSpheres(sceneSpheres, first, count, packet.origin(lane), packet.direction(lane), t);
+			if (slot >= 0) {
+				setSphereHit(lane, slot);
+				found = true;
+			}
+			for (slot = first; slot < first + count; slot++) {
+				if (sceneSpheres.isSphere(slot)) continue;
+				if (intersectOther(lane, slot, t)) found = true;
+			}
+			return found;
+		});
+}
+
+// Trace and shade a single pixel.  All per-ray state lives on the stack (the
+// HitRecord) so several workers can run this at the same time.
+//
+ofColor RenderScene::tracePixel(int i, int j, HitRecord& hit) {
+	//  convert each i, j to (u, v)
+	//
+	float u = (i + 0.5) / imageWidth;
+	float v = (j + 0.5) / imageHeight;
+
+	// see Raycaster
+	//
+	Ray ray = renderCam.getRay(u, v);
+
+	if (!intersectScene(ray, hit)) return backgroundColor;
+	return shadeHit(hit);
+}
+
+// Trace the pixels [i0, i1) x [j0, j1) (at most packetWidth x packetHeight)
+// as one packet and write them to target.  Blocks cut off by the edge of a
+// tile just leave the missing lanes switched off, and so do pixels already
+// traced by a coarser pass (see render()).
+//
+int RenderScene::tracePacket(int i0, int j0, int i1, int j1, FrameBuffer& target, int skip) {
+	RayPacket packet;
+	int laneMask = 0;
+	for (int j = j0; j < j1; j++) {
+		for (int i = i0; i < i1; i++) {
+			if (skip && i % skip == 0 && j % skip == 0) continue;
+			int lane = (j - j0) * packetWidth + (i - i0);
+			Ray ray = renderCam.getRay((i + 0.5) / imageWidth, (j + 0.5) / imageHeight);
+			packet.set(lane, ray.p, ray.d);
+			laneMask |= 1 << lane;
+		}
+	}
+
+	HitRecord hits[RayPacket::width];
+	intersectScenePacket(packet, laneMask, hits);
+
+	int traced = 0;
+	for (int j = j0; j < j1; j++) {
+		for (int i = i0; i < i1; i++) {
+			int lane = (j - j0) * packetWidth + (i - i0);
+			if (!(laneMask & (1 << lane))) continue;
+			const HitRecord& hit = hits[lane];
+			writePixel(target, i, j, hit.obj ? shadeHit(hit) : backgroundColor);
+			writeSample(i, j, hit);
+			traced++;
+		}
+	}
+	return traced;
+}
+
+// Color of the object at a hit, using the lambert/phong/texture settings
+//
+ofColor RenderScene::shadeHit(const HitRecord& hit) const {
+	PROFILE_TIMER(ProfileShadeNanos);
+	SceneObject* closestObj = hit.obj;
+
+	// floor and wall texture colors at the hit, only looked up when used
+	//
+	ofColor floorColor, wallColor;
+	if (settings.textures && closestObj == scene[1]) floorColor = sampleTexture(floorTexture, hit);
+	if (settings.textures && closestObj == scene[0]) wallColor = sampleTexture(wallTexture, hit);
+
+	ofColor color;
+	if (settings.lambert) {
+		if (settings.textures) {
+			if (closestObj == scene[1]) {
+				color = lambert(hit.point, hit.normal, floorColor);
+			}
+			else if (closestObj == scene[0]) {
+				color = lambert(hit.point, hit.normal, wallColor);
+			}
+			else {
+				color = lambert(hit.point, hit.normal, closestObj->diffuseColor);
+			}
+		}
+		else {
+			color = lambert(hit.point, hit.normal, closestObj->diffuseColor);
+		}
+	}
+	if (settings.phong) {
+		if (settings.textures) {
+			if (closestObj == scene[1]) {
+				color = phong(hit.point, hit.normal, floorColor, closestObj->specularColor, settings.lightIntensity);
+			}
+			else if (closestObj == scene[0]) {
+				color = phong(hit.point, hit.normal, wallColor, closestObj->specularColor, settings.lightIntensity);
+			}
+			else {
+				color = phong(hit.point, hit.normal, closestObj->diffuseColor, closestObj->specularColor, settings.lightIntensity);
+			}
+		}
+		else {
+			color = phong(hit.point, hit.normal, closestObj->diffuseColor, closestObj->specularColor, settings.lightIntensity);
+		}
+	}
+	if (!settings.lambert && !settings.phong) {
+		if (settings.textures) {
+			if (closestObj == scene[1]) {
+				color = floorColor;
+			}
+			else if (closestObj == scene[0]) {
+				color = wallColor;
+			}
+			else {
+				color = closestObj->diffuseColor;
+			}
+		}
+		else {
+			color = closestObj->diffuseColor;
+		}
+	}
+	return color;
+}
+
+// Filtered texture color at a primary ray hit.  The ray's footprint grows
+// with distance (pixelSpread per unit) and stretches as the surface turns
+// away from the camera; it is measured in uv units against the smaller side
+// of the object so the mip level errs toward sharp.
+//
+ofColor RenderScene::sampleTexture(const Texture* texture, const HitRecord& hit) const {
+	if (texture == NULL) return hit.obj->diffuseColor;
+
+	glm::vec3 dir = glm::normalize(hit.point - renderCam.position);
+	float cosTheta = std::max(fabs(glm::dot(dir, hit.normal)), 0.05f);
+	float footprint = hit.t * settings.pixelSpread / cosTheta / std::min(hit.obj->width, hit.obj->height);
+
+	glm::vec4 c = texture->sample(hit.uv, footprint);
+	return ofColor(c.x * 255, c.y * 255, c.z * 255);
+}
+
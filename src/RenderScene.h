@@ -0,0 +1,230 @@
+//
+//  RenderScene.h - an immutable copy of everything a render reads
+//
+//  ofApp::rayTrace() fills one of these on the UI thread (cloned objects and
+//  lights, the scene BVH and sphere arrays, the render camera and the GUI
+//  values) and hands it to the render thread.  The UI is then free to move,
+//  add or delete its own objects while the render runs; nothing in here is
+//  shared with them except immutable mesh geometry.  Between renders the
+//  app keeps the copy and only syncs the objects it edited.
+//
+//  Cloned objects keep their cached world matrices but are detached from
+//  the hierarchy, so they must not be marked dirty.
+//
+#pragma once
+
+#include "ofMain.h"
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include "Primitives.h"
+#include "BVH.h"
+#include "SphereSoA.h"
+#include "RayPacket.h"
+#include "ThreadPool.h"
+#include "TextureCache.h"
+#include "FrameBuffer.h"
+#include "AliasTable.h"
+
+// GUI values the renderer needs, copied once per render so the worker
+// threads never read the sliders directly
+//
+struct RenderSettings {
+	float lightIntensity = 0;
+	float powerExponent = 10;
+	bool lambert = false;
+	bool phong = false;
+	bool textures = false;
+	bool packets = true;     // trace primary rays in 4x2 packets
+	bool progressive = true; // coarse passes first, see RenderScene::render()
+	bool antialias = false;  // adaptive supersampling, see RenderScene::samplePixel()
+	int aaMinSamples = 4;    // samples every pixel gets (multiple of 4)
+	int aaMaxSamples = 16;   // cap for pixels on edges (multiple of 4, at most 16)
+	float aaThreshold = 0.002f;   // color variance (per channel, [0, 1] colors) that asks for more samples
+	float pixelSpread = 0;   // angle between neighboring primary rays (radians)
+	bool lightFalloff = false;    // lights fade with distance, see RenderScene::attenuation()
+	float lightCutoff = 0.01f;    // with falloff, lights are skipped where they add less than this
+	bool sampleLights = false;    // pick lightSamples lights per shading point, see RenderScene::forEachLight()
+	int lightSamples = 1;
+
+	bool operator==(const RenderSettings& s) const {
+		return lightIntensity == s.lightIntensity && powerExponent == s.powerExponent && lambert == s.lambert &&
+			phong == s.phong && textures == s.textures && packets == s.packets && progressive == s.progressive &&
+			antialias == s.antialias && aaMinSamples == s.aaMinSamples && aaMaxSamples == s.aaMaxSamples &&
+			aaThreshold == s.aaThreshold && pixelSpread == s.pixelSpread && lightFalloff == s.lightFalloff &&
+			lightCutoff == s.lightCutoff && sampleLights == s.sampleLights && lightSamples == s.lightSamples;
+	}
+	bool operator!=(const RenderSettings& s) const { return !(*this == s); }
+};
+
+// What the primary ray of a pixel hit, kept so a pixel can be shaded again
+// without tracing it.  object is the app's object (not the snapshot's
+// clone) and is only ever compared, never dereferenced; NULL = background.
+//
+struct GBufferSample {
+	SceneObject* object = NULL;
+	glm::vec3 point;
+	glm::vec3 normal;
+	glm::vec2 uv;
+	float t = 0;
+	int primID = 0;
+};
+
+class RenderScene {
+public:
+	RenderScene() {}
+	RenderScene(const RenderScene&) = delete;
+	RenderScene& operator=(const RenderScene&) = delete;
+	~RenderScene();
+
+	// clone the objects and lights; scene[i] of the copy is the clone of
+	// objects[i], so the BVH built over objects can be copied as is
+	//
+	void copyObjects(const vector<SceneObject*>& objects, const vector<Light*>& lights);
+
+	// Bring the copy up to date after objects[k] for each k in changed
+	// were edited: their clones are replaced, and their leaves of sceneBVH
+	// and sceneSpheres are refit to the bounds in bvh (the app's tree, with
+	// slots[k] the sphere slot of objects[k]).  objects must be the list
+	// copied before and bvh the same shape as sceneBVH.  The lights are few
+	// and copied again.
+	//
+	void syncObjects(const vector<SceneObject*>& objects, const vector<Light*>& lights, const vector<int>& changed, const BVH& bvh, const vector<int>& slots);
+
+	// forget the work of the last render (tiles, recolored, counters)
+	//
+	void resetWork();
+
+	// build sceneBVH and sceneSpheres over the clones, for callers that don't
+	// keep their own (the app refits its BVH between renders and copies it).
+	// With a pool the build is shared by its workers.
+	//
+	void buildSceneBVH(ThreadPool* pool = NULL);
+
+	// fill sceneSpheres for a sceneBVH that was built elsewhere (while loading)
+	//
+	void buildSceneSpheres();
+
+	// Trace the tiles in "tiles" (every tile if bFullFrame) into target and
+	// gBuffer on the pool, in coarse to fine passes if settings.progressive
+	// is set, after re-shading the pixels of the recolored objects.
+	// Workers check cancel before each tile; returns false if the render
+	// was cancelled.
+	//
+	bool render(FrameBuffer& target, ThreadPool& pool, const std::atomic<bool>& cancel);
+
+	// one pass: trace a pixel per block x block square and fill the square
+	// with it, skipping pixels on the grid of an earlier pass (every skip
+	// pixels; 0 = none)
+	//
+	void renderPass(FrameBuffer& target, ThreadPool& pool, const std::atomic<bool>& cancel, int block, int skip);
+	void reshadePass(FrameBuffer& target, ThreadPool& pool, const std::atomic<bool>& cancel);
+
+	ofColor tracePixel(int i, int j, HitRecord& hit);
+	ofColor samplePixel(int i, int j, HitRecord& hit, int& numSamples);
+
+	// returns the number of pixels traced
+	//
+	int tracePacket(int i0, int j0, int i1, int j1, FrameBuffer& target, int skip = 0);
+	void writePixel(FrameBuffer& target, int i, int j, const ofColor& color) const {
+		// j counts up from the bottom of the view plane, frame buffer rows
+		// go top to bottom
+		//
+		target.set(i, imageHeight - 1 - j, glm::vec4(color.r, color.g, color.b, 255) * (1.0f / 255));
+	}
+	void writeSample(int i, int j, const HitRecord& hit) const {
+		GBufferSample& sample = gBuffer[(size_t)(imageHeight - 1 - j) * imageWidth + i];
+		sample.object = hit.obj ? hit.obj->source : NULL;
+		sample.point = hit.point;
+		sample.normal = hit.normal;
+		sample.uv = hit.uv;
+		sample.t = hit.t;
+		sample.primID = hit.primID;
+	}
+
+	bool intersectScene(const Ray& ray, HitRecord& hit) const;
+	bool occludedScene(const Ray& ray, float tMin, float tMax) const;
+	void intersectScenePacket(const RayPacket& packet, int laneMask, HitRecord* hits) const;
+
+	ofColor shadeHit(const HitRecord& hit) const;
+	ofColor sampleTexture(const Texture* texture, const HitRecord& hit) const;
+
+	// Lambert and Phong shading; both only read the snapshot, so they can be
+	// called from any render worker
+	//
+	ofColor lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor& diffuse) const;
+	ofColor phong(const glm::vec3& p, const glm::vec3& norm, const ofColor& diffuse, const ofColor& specular, float power) const;
+
+	// Light culling.  With settings.lightFalloff a light of strength s
+	// (intensity times color luminance, lightStrength()) lights a point at
+	// distance d by s (1 - (d/R)^4)^2 / (1 + d^2), which reaches 0 at its
+	// range R, chosen so that s / (1 + R^2) = settings.lightCutoff.
+	// buildLightBVH() puts the spheres of influence in lightBVH, so the cost
+	// of shading follows the number of lights nearby instead of the total.
+	// Without falloff every light reaches everywhere.
+	//
+	// With settings.sampleLights only lightSamples lights are shaded per
+	// point instead, drawn from lightTable in proportion to their strength
+	// and weighted by 1 / (lightSamples * probability), so the expected value
+	// is the sum over all lights and the cost doesn't depend on how many
+	// there are.  The choice is a hash of the point, so the samples of an
+	// antialiased pixel pick different lights and average the noise away.
+	//
+	// forEachLight(p, seed, f) calls f(k, weight) for the lights
+	// pointLightObjs[k] to shade p with and the weight of their light.
+	//
+	void buildLightBVH();
+	void buildLightTable();
+	float lightStrength(const Light* light) const {
+		float luminance = (0.2126f * light->color.r + 0.7152f * light->color.g + 0.0722f * light->color.b) / 255;
+		return (light->intensity + settings.lightIntensity) * luminance;
+	}
+	template<class F>
+	void forEachLight(const glm::vec3& p, uint32_t seed, F&& f) const;
+	float attenuation(int light, float dist) const {
+		if (!settings.lightFalloff) return 1;
+		float x = dist / lightRanges[light];
+		float window = glm::clamp(1 - x * x * x * x, 0.0f, 1.0f);
+		return window * window / (1 + dist * dist);
+	}
+
+	vector<SceneObject*> scene;              // owned clones, scene[0] and scene[1] are the wall and floor
+	vector<Light*> pointLightObjs;           // owned clones
+	vector<float> lightRanges;               // per light, see buildLightBVH()
+	vector<int> influenceLights;             // lightBVH primitive -> light, lights with a range > 0
+	BVH lightBVH;
+	AliasTable lightTable;                   // lights by strength, for settings.sampleLights
+	BVH sceneBVH;
+	SphereSoA sceneSpheres;
+	RenderCam renderCam;
+	RenderSettings settings;
+	ofColor backgroundColor = ofColor::black;
+	const Texture* floorTexture = NULL;      // owned by the app's TextureCache
+	const Texture* wallTexture = NULL;
+	int imageWidth = 0;
+	int imageHeight = 0;
+
+	// the work to do: tiles to trace (tile = row * tilesX + column, rows
+	// counted from the bottom like j), and objects whose pixels only need
+	// shading again.  Both refer to the app's objects, not the clones.
+	//
+	bool bFullFrame = true;
+	vector<int> tiles;
+	vector<SceneObject*> recolored;
+	unordered_map<SceneObject*, SceneObject*> clones;   // app object -> clone
+	GBufferSample* gBuffer = NULL;           // imageWidth x imageHeight, rows like target's
+
+	std::atomic<long long> samplesTraced{ 0 };   // primary rays, for the render report
+	std::atomic<long long> shadowRaysTraced{ 0 };   // occludedScene() calls that traced a ray
+
+	// If set, called by a worker for every rectangle of the target (x0 <= x
+	// < x1, y0 <= y < y1 in frame buffer rows) it has finished writing in
+	// a pass: a tile, or a row of a re-shade.  Nothing writes those pixels
+	// again until the next pass, so the callback may read them.
+	//
+	std::function<void(int x0, int y0, int x1, int y1)> regionDone;
+
+	static const int tileSize = 32;          // tiles are square, tileSize x tileSize pixels
+	static const int packetWidth = 4;        // packets cover packetWidth x packetHeight pixels
+	static const int packetHeight = 2;
+};
@@ -0,0 +1,429 @@
+//
+//  SceneBinary.cpp - binary scene format, see SceneBinary.h
+//
+
+#include "SceneBinary.h"
+#include "ThreadPool.h"
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+static const uint64_t sectionAlignment = 16;
+
+static size_t recordSizes[NumSceneSections] = {
+	sizeof(MaterialRecord),
+	1,                          // names, in bytes
+	sizeof(CameraRecord),
+	sizeof(PlaneRecord),
+	sizeof(SphereRecord),
+	sizeof(BoxRecord),
+	sizeof(BoxRecord),
+	sizeof(MeshRecord),
+	sizeof(LightRecord),
+};
+
+bool SceneMapping::open(const string& path) {
+	close();
+	if (!file.open(ofToDataPath(path))) {
+		cout << "can't read " << path << endl;
+		return false;
+	}
+
+	const SceneHeader* h = (const SceneHeader*)file.data();
+	if (file.size() < sizeof(SceneHeader) || memcmp(h->magic, sceneBinaryMagic, sizeof(sceneBinaryMagic)) != 0) {
+		cout << path << " is not a binary scene file" << endl;
+		file.close();
+		return false;
+	}
+	if (h->byteOrder != sceneByteOrder || h->version != sceneBinaryVersion || h->numSections != NumSceneSections) {
+		cout << path << " was written by another version or on another kind of machine" << endl;
+		file.close();
+		return false;
+	}
+	if (h->fileSize != file.size()) {
+		cout << path << " is truncated" << endl;
+		file.close();
+		return false;
+	}
+
+	// every section has to fit in the file, so records() can't run past it
+	//
+	for (int s = 0; s < NumSceneSections; s++) {
+		const SceneSection& section = h->sections[s];
+		bool fits = section.recordSize == recordSizes[s] && section.offset % sectionAlignment == 0 && section.offset <= file.size() &&
+			section.count <= (file.size() - section.offset) / recordSizes[s];
+		if (!fits) {
+			cout << path << " is damaged (section " << s << ")" << endl;
+			file.close();
+			return false;
+		}
+	}
+	const SceneSection& names = h->sections[SectionNames];
+	if (names.count > 0 && file.data()[names.offset + names.count - 1] != 0) {
+		cout << path << " is damaged (names)" << endl;
+		file.close();
+		return false;
+	}
+	header = h;
+	return true;
+}
+
+const char* SceneMapping::name(uint32_t offset) const {
+	if (offset >= count(SectionNames)) return NULL;
+	return records<char>(SectionNames) + offset;
+}
+
+// --- loading
+
+static void setTransform(SceneObject* object, const TransformRecord& t) {
+	object->position = t.position;
+	object->rotation = t.rotation;
+	object->scale = t.scale;
+	object->pivot = t.pivot;
+	object->markDirty();
+}
+
+static ofColor toColor(const uint8_t* c) {
+	return ofColor(c[0], c[1], c[2], c[3]);
+}
+
+// spheres are checked (and their bounds found) this many records per task
+//
+static const size_t sphereBlockSize = 1 << 16;
+
+// Objects are built into their own lists first and only handed over once
+// the whole file checked out, so a bad file adds nothing.  The spheres, the
+// only section that gets big, are checked in blocks on the pool and only
+// created after everything else, once "parsed" has had their bounds.
+//
+bool loadSceneBinary(const string& path, vector<SceneObject*>& objects, vector<Light*>& lights, RenderCam* camera, const SceneLoadOptions& options) {
+	SceneMapping scene;
+	if (!scene.open(path)) return false;
+
+	const MaterialRecord* materials = scene.records<MaterialRecord>(SectionMaterials);
+	size_t numMaterials = scene.count(SectionMaterials);
+	vector<SceneObject*> newObjects;
+	vector<SceneObject*> newPlanes;
+	vector<Light*> newLights;
+	bool ok = true;
+
+	// material and name of a record, false if either is out of range
+	//
+	auto setCommon = [&](SceneObject* object, uint32_t material, uint32_t name) {
+		const char* s = scene.name(name);
+		if (material >= numMaterials || !s) return false;
+		object->diffuseColor = toColor(materials[material].diffuse);
+		object->specularColor = toColor(materials[material].specular);
+		object->name = s;
+		return true;
+	};
+
+	const PlaneRecord* planes = scene.records<PlaneRecord>(SectionPlanes);
+	for (size_t i = 0; ok && i < scene.count(SectionPlanes); i++) {
+		const PlaneRecord& r = planes[i];
+		Plane* plane = new Plane(r.transform.position, r.normal, ofColor::green, r.width, r.height);
+		setTransform(plane, r.transform);
+		newPlanes.push_back(plane);
+		ok = setCommon(plane, r.material, r.name);
+	}
+
+	const SphereRecord* spheres = scene.records<SphereRecord>(SectionSpheres);
+	size_t numSpheres = scene.count(SectionSpheres);
+	size_t numBlocks = (numSpheres + sphereBlockSize - 1) / sphereBlockSize;
+	vector<AABB> sphereBounds(options.parsed ? numSpheres : 0);
+	vector<char> blockOk(numBlocks, 1);
+	auto checkSpheres = [&](int block, int /*worker*/) {
+		size_t end = std::min(numSpheres, (block + 1) * sphereBlockSize);
+		for (size_t i = block * sphereBlockSize; i < end; i++) {
+			const SphereRecord& r = spheres[i];
+			if (r.material >= numMaterials || !scene.name(r.name)) {
+				blockOk[block] = 0;
+				return;
+			}
+			if (options.parsed) {
+				sphereBounds[i] = AABB(r.transform.position - glm::vec3(r.radius), r.transform.position + glm::vec3(r.radius));
+			}
+		}
+	};
+	if (ok && options.pool) options.pool->parallelFor((int)numBlocks, checkSpheres);
+	else if (ok) {
+		for (size_t block = 0; block < numBlocks; block++) checkSpheres((int)block, 0);
+	}
+	for (char blockChecked : blockOk) ok = ok && blockChecked;
+
+	const BoxRecord* cubes = scene.records<BoxRecord>(SectionCubes);
+	const BoxRecord* cones = scene.records<BoxRecord>(SectionCones);
+	size_t numCubes = scene.count(SectionCubes);
+	size_t numBoxes = numCubes + scene.count(SectionCones);
+	for (size_t i = 0; ok && i < numBoxes; i++) {
+		const BoxRecord& r = i < numCubes ? cubes[i] : cones[i - numCubes];
+		SceneObject* box = i < numCubes ? (SceneObject*)new Cube() : (SceneObject*)new Cone();
+		setTransform(box, r.transform);
+		box->radius = r.radius;
+		box->width = r.width;
+		box->height = r.height;
+		box->depth = r.depth;
+		newObjects.push_back(box);
+		ok = setCommon(box, r.material, r.name);
+	}
+
+	// a mesh whose model is gone is left out, like a failed drop
+	//
+	const MeshRecord* meshes = scene.records<MeshRecord>(SectionMeshes);
+	for (size_t i = 0; ok && i < scene.count(SectionMeshes); i++) {
+		const MeshRecord& r = meshes[i];
+		const char* modelPath = scene.name(r.path);
+		Mesh* mesh = new Mesh();
+		if (!modelPath || !mesh->load(modelPath)) {
+			delete mesh;
+			ok = modelPath != NULL;
+			continue;
+		}
+		setTransform(mesh, r.transform);
+		newObjects.push_back(mesh);
+		ok = setCommon(mesh, r.material, r.name);
+	}
+
+	const LightRecord* lightRecords = scene.records<LightRecord>(SectionLights);
+	for (size_t i = 0; ok && i < scene.count(SectionLights); i++) {
+		const LightRecord& r = lightRecords[i];
+		int samples = std::min((int)r.samples, Light::maxSamples);
+		Light* light;
+		if (r.type == LightSphere) light = new SphereLight("", r.radius, r.intensity, ofColor::yellow, samples);
+		else if (r.type == LightRect) light = new RectLight("", r.width, r.height, r.intensity, ofColor::yellow, samples);
+		else light = new PointLight("", r.intensity, ofColor::yellow);
+		setTransform(light, r.transform);
+		light->radius = r.radius;
+		light->width = r.width;
+		light->height = r.height;
+		light->color = toColor(r.color);
+		newLights.push_back(light);
+		ok = r.type <= LightRect && setCommon(light, r.material, r.name);
+	}
+
+	if (!ok) {
+		cout << path << " is damaged (bad material or name)" << endl;
+		for (auto object : newPlanes) delete object;
+		for (auto object : newObjects) delete object;
+		for (auto light : newLights) delete light;
+		return false;
+	}
+
+	// bounds in the order the objects are added: planes, spheres, the rest
+	//
+	if (options.parsed) {
+		vector<AABB> bounds;
+		bounds.reserve(newPlanes.size() + numSpheres + newObjects.size());
+		for (auto object : newPlanes) bounds.push_back(object->getBounds());
+		bounds.insert(bounds.end(), sphereBounds.begin(), sphereBounds.end());
+		vector<AABB>().swap(sphereBounds);
+		for (auto object : newObjects) bounds.push_back(object->getBounds());
+		options.parsed(bounds);
+	}
+
+	vector<SceneObject*> others;
+	others.swap(newObjects);
+	newObjects.reserve(newPlanes.size() + numSpheres + others.size());
+	newObjects.insert(newObjects.end(), newPlanes.begin(), newPlanes.end());
+	for (size_t i = 0; i < numSpheres; i++) {
+		const SphereRecord& r = spheres[i];
+		Joint* joint = new Joint("", r.radius, ofColor::grey);
+		setTransform(joint, r.transform);
+		setCommon(joint, r.material, r.name);
+		newObjects.push_back(joint);
+	}
+	newObjects.insert(newObjects.end(), others.begin(), others.end());
+
+	if (camera && scene.count(SectionCamera) > 0) {
+		const CameraRecord& r = scene.records<CameraRecord>(SectionCamera)[0];
+		camera->position = r.position;
+		camera->aim = r.aim;
+		camera->view.position = r.viewPosition;
+		camera->view.min = r.viewMin;
+		camera->view.max = r.viewMax;
+		camera->markDirty();
+		camera->view.markDirty();
+	}
+	objects.insert(objects.end(), newObjects.begin(), newObjects.end());
+	lights.insert(lights.end(), newLights.begin(), newLights.end());
+	return true;
+}
+
+// --- saving
+
+// Builds the sections in memory; materials are shared by every object with
+// the same two colors
+//
+struct SceneWriter {
+	vector<MaterialRecord> materials;
+	std::unordered_map<uint64_t, uint32_t> materialIndex;
+	vector<char> names = vector<char>(1, 0);   // offset 0 is ""
+	vector<CameraRecord> cameras;
+	vector<PlaneRecord> planes;
+	vector<SphereRecord> spheres;
+	vector<BoxRecord> cubes;
+	vector<BoxRecord> cones;
+	vector<MeshRecord> meshes;
+	vector<LightRecord> lights;
+
+	uint32_t material(SceneObject* object) {
+		MaterialRecord m;
+		const ofColor& d = object->diffuseColor;
+		const ofColor& s = object->specularColor;
+		m.diffuse[0] = d.r; m.diffuse[1] = d.g; m.diffuse[2] = d.b; m.diffuse[3] = d.a;
+		m.specular[0] = s.r; m.specular[1] = s.g; m.specular[2] = s.b; m.specular[3] = s.a;
+		uint64_t key;
+		memcpy(&key, &m, sizeof(key));
+		auto found = materialIndex.find(key);
+		if (found != materialIndex.end()) return found->second;
+		materials.push_back(m);
+		return materialIndex[key] = (uint32_t)materials.size() - 1;
+	}
+
+	uint32_t name(const string& s) {
+		if (s.empty()) return 0;
+		uint32_t offset = (uint32_t)names.size();
+		names.insert(names.end(), s.begin(), s.end());
+		names.push_back(0);
+		return offset;
+	}
+
+	static TransformRecord transform(SceneObject* object) {
+		TransformRecord t;
+		t.position = object->position;
+		t.rotation = object->rotation;
+		t.scale = object->scale;
+		t.pivot = object->pivot;
+		return t;
+	}
+};
+
+// Records are zero filled first, so the padding is written as zeros.  They
+// have no implicit padding (see the static_asserts), but value-initializing
+// may leave glm members alone, so the bytes are cleared directly.
+//
+template<class T>
+static T zeroed() {
+	T r;
+	memset((void*)&r, 0, sizeof(r));
+	return r;
+}
+
+bool saveSceneBinary(const string& path, const vector<SceneObject*>& objects, const vector<Light*>& lights, RenderCam* camera, int skip) {
+	SceneWriter w;
+
+	if (camera) {
+		CameraRecord r = zeroed<CameraRecord>();
+		r.position = camera->position;
+		r.aim = camera->aim;
+		r.viewPosition = camera->view.position;
+		r.viewMin = camera->view.min;
+		r.viewMax = camera->view.max;
+		w.cameras.push_back(r);
+	}
+
+	w.spheres.reserve(objects.size());
+	for (int i = skip; i < (int)objects.size(); i++) {
+		SceneObject* object = objects[i];
+		if (dynamic_cast<Light*>(object) || dynamic_cast<ViewPlane*>(object) || dynamic_cast<RenderCam*>(object)) continue;
+
+		if (Plane* plane = dynamic_cast<Plane*>(object)) {
+			PlaneRecord r = zeroed<PlaneRecord>();
+			r.transform = w.transform(plane);
+			r.normal = plane->normal;
+			r.width = plane->width;
+			r.height = plane->height;
+			r.material = w.material(plane);
+			r.name = w.name(plane->name);
+			w.planes.push_back(r);
+		}
+		else if (Mesh* mesh = dynamic_cast<Mesh*>(object)) {
+			MeshRecord r = zeroed<MeshRecord>();
+			r.transform = w.transform(mesh);
+			r.material = w.material(mesh);
+			r.name = w.name(mesh->name);
+			r.path = w.name(mesh->path);
+			w.meshes.push_back(r);
+		}
+		else if (dynamic_cast<Cube*>(object) || dynamic_cast<Cone*>(object)) {
+			BoxRecord r = zeroed<BoxRecord>();
+			r.transform = w.transform(object);
+			r.radius = object->radius;
+			r.width = object->width;
+			r.height = object->height;
+			r.depth = object->depth;
+			r.material = w.material(object);
+			r.name = w.name(object->name);
+			if (dynamic_cast<Cube*>(object)) w.cubes.push_back(r);
+			else w.cones.push_back(r);
+		}
+		else if (object->isSphere()) {
+			SphereRecord r = zeroed<SphereRecord>();
+			r.transform = w.transform(object);
+			r.radius = object->radius;
+			r.material = w.material(object);
+			r.name = w.name(object->name);
+			w.spheres.push_back(r);
+		}
+	}
+
+	for (auto light : lights) {
+		LightRecord r = zeroed<LightRecord>();
+		r.transform = w.transform(light);
+		r.type = dynamic_cast<RectLight*>(light) ? LightRect : dynamic_cast<SphereLight*>(light) ? LightSphere : LightPoint;
+		r.intensity = light->intensity;
+		r.radius = light->radius;
+		r.width = light->width;
+		r.height = light->height;
+		r.samples = light->numSamples();
+		r.color[0] = light->color.r; r.color[1] = light->color.g; r.color[2] = light->color.b; r.color[3] = light->color.a;
+		r.material = w.material(light);
+		r.name = w.name(light->name);
+		w.lights.push_back(r);
+	}
+
+	// lay the sections out one after the other, each aligned
+	//
+	const void* data[NumSceneSections] = {
+		w.materials.data(), w.names.data(), w.cameras.data(), w.planes.data(), w.spheres.data(),
+		w.cubes.data(), w.cones.data(), w.meshes.data(), w.lights.data()
+	};
+	size_t counts[NumSceneSections] = {
+		w.materials.size(), w.names.size(), w.cameras.size(), w.planes.size(), w.spheres.size(),
+		w.cubes.size(), w.cones.size(), w.meshes.size(), w.lights.size()
+	};
+	if (w.names.size() > UINT32_MAX) {
+		cout << "too many names to save " << path << endl;
+		return false;
+	}
+
+	SceneHeader header = zeroed<SceneHeader>();
+	memcpy(header.magic, sceneBinaryMagic, sizeof(sceneBinaryMagic));
+	header.version = sceneBinaryVersion;
+	header.byteOrder = sceneByteOrder;
+	header.numSections = NumSceneSections;
+	uint64_t offset = sizeof(SceneHeader);
+	for (int s = 0; s < NumSceneSections; s++) {
+		offset = (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+		header.sections[s].offset = offset;
+		header.sections[s].count = counts[s];
+		header.sections[s].recordSize = (uint32_t)recordSizes[s];
+		offset += counts[s] * recordSizes[s];
+	}
+	header.fileSize = offset;
+
+	std::ofstream out(ofToDataPath(path), std::ios::binary);
+	if (!out) {
+		cout << "can't write " << path << endl;
+		return false;
+	}
+	out.write((const char*)&header, sizeof(header));
+	uint64_t written = sizeof(header);
+	const char zeros[sectionAlignment] = {};
+	for (int s = 0; s < NumSceneSections; s++) {
+		out.write(zeros, header.sections[s].offset - written);
+		out.write((const char*)data[s], counts[s] * recordSizes[s]);
+		written = header.sections[s].offset + counts[s] * recordSizes[s];
+	}
+	return (bool)out;
+}
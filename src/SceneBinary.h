@@ -0,0 +1,187 @@
+//
+//  SceneBinary.h - the binary scene format (.rtscene)
+//
+//  A header followed by one array of fixed size records per section:
+//
+//      header     magic, version, byte order check, file size, section table
+//      materials  diffuse and specular colors, shared by all objects
+//      names      0-terminated strings, referred to by byte offset
+//      camera     the render camera (0 or 1 record)
+//      planes, spheres, cubes, cones, meshes, lights
+//
+//  The records are laid out exactly as the structs below, so a loaded file
+//  is used in place from a memory mapping (SceneMapping) with nothing to
+//  parse, and every value is stored as the same bits it had in memory: a
+//  save and load round-trips exactly.  Each section starts on a 16 byte
+//  boundary.
+//
+//  Objects keep their local position, rotation, scale and pivot; parenting
+//  is not stored, every object is loaded as a root.  Meshes store the path
+//  of their model and are loaded from it again.
+//
+//  The layout is the in-memory layout of a little-endian machine.  Files
+//  with another magic, version or byte order are refused; bump
+//  sceneBinaryVersion on any change to a record.
+//
+#pragma once
+
+#include "ofMain.h"
+#include "Primitives.h"
+#include "MappedFile.h"
+#include "SceneFile.h"
+#include <cstdint>
+
+static const char sceneBinaryMagic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+static const uint32_t sceneBinaryVersion = 1;
+static const uint32_t sceneByteOrder = 0x01020304;
+
+enum SceneSectionType {
+	SectionMaterials,
+	SectionNames,
+	SectionCamera,
+	SectionPlanes,
+	SectionSpheres,
+	SectionCubes,
+	SectionCones,
+	SectionMeshes,
+	SectionLights,
+	NumSceneSections
+};
+
+struct SceneSection {
+	uint64_t offset;        // from the start of the file
+	uint64_t count;         // records (bytes for the names)
+	uint32_t recordSize;    // sizeof the record, checked on load
+	uint32_t pad;
+};
+
+struct SceneHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;     // sceneByteOrder as written by the saving machine
+	uint64_t fileSize;
+	uint32_t numSections;
+	uint32_t pad;
+	SceneSection sections[NumSceneSections];
+};
+
+struct MaterialRecord {
+	uint8_t diffuse[4];     // r, g, b, a
+	uint8_t specular[4];
+};
+
+struct TransformRecord {
+	glm::vec3 position;
+	glm::vec3 rotation;
+	glm::vec3 scale;
+	glm::vec3 pivot;
+};
+
+struct CameraRecord {
+	glm::vec3 position;
+	glm::vec3 aim;
+	glm::vec3 viewPosition;
+	glm::vec2 viewMin;
+	glm::vec2 viewMax;
+	float pad[3];
+};
+
+struct SphereRecord {
+	TransformRecord transform;
+	float radius;
+	uint32_t material;      // index into the material table
+	uint32_t name;          // offset into the names
+	uint32_t pad;
+};
+
+struct PlaneRecord {
+	TransformRecord transform;
+	glm::vec3 normal;
+	float width;
+	float height;
+	uint32_t material;
+	uint32_t name;
+	uint32_t pad;
+};
+
+// cubes and cones
+//
+struct BoxRecord {
+	TransformRecord transform;
+	float radius;
+	float width;
+	float height;
+	float depth;
+	uint32_t material;
+	uint32_t name;
+	uint32_t pad[2];
+};
+
+struct MeshRecord {
+	TransformRecord transform;
+	uint32_t material;
+	uint32_t name;
+	uint32_t path;          // offset into the names
+	uint32_t pad;
+};
+
+enum LightType { LightPoint, LightSphere, LightRect };
+
+struct LightRecord {
+	TransformRecord transform;
+	uint32_t type;          // LightType
+	float intensity;
+	float radius;
+	float width;
+	float height;
+	uint32_t samples;       // size of the sample table (area lights)
+	uint8_t color[4];
+	uint32_t material;
+	uint32_t name;
+	uint32_t pad[3];
+};
+
+static_assert(sizeof(SceneHeader) == 32 + 24 * NumSceneSections, "scene header layout changed");
+static_assert(sizeof(MaterialRecord) == 8, "material record layout changed");
+static_assert(sizeof(CameraRecord) == 64, "camera record layout changed");
+static_assert(sizeof(SphereRecord) == 64, "sphere record layout changed");
+static_assert(sizeof(PlaneRecord) == 80, "plane record layout changed");
+static_assert(sizeof(BoxRecord) == 80, "box record layout changed");
+static_assert(sizeof(MeshRecord) == 64, "mesh record layout changed");
+static_assert(sizeof(LightRecord) == 96, "light record layout changed");
+
+// A binary scene file mapped into memory.  open() checks the header and
+// that every section lies inside the file; after that the records are read
+// straight from the mapping.
+//
+class SceneMapping {
+public:
+	bool open(const string& path);
+	void close() { file.close(); header = NULL; }
+
+	template<class T>
+	const T* records(SceneSectionType section) const {
+		return (const T*)(file.data() + header->sections[section].offset);
+	}
+	size_t count(SceneSectionType section) const { return (size_t)header->sections[section].count; }
+
+	// the string at offset in the names section, NULL if offset is outside it
+	//
+	const char* name(uint32_t offset) const;
+
+	const SceneHeader* header = NULL;
+	MappedFile file;
+};
+
+// Append the objects and lights of the file to objects and lights, and set
+// the camera from it if camera isn't NULL.  path is relative to the data
+// folder unless it is absolute.  Returns false (adding nothing) if the file
+// can't be read or is not a valid scene.  See SceneLoadOptions (SceneFile.h)
+// for loading on a thread pool.
+//
+bool loadSceneBinary(const string& path, vector<SceneObject*>& objects, vector<Light*>& lights, RenderCam* camera = NULL, const SceneLoadOptions& options = SceneLoadOptions());
+
+// Write objects (skipping the first "skip"), lights and the camera, if it
+// isn't NULL.  Objects of other types (ViewPlane, RenderCam) are left out.
+//
+bool saveSceneBinary(const string& path, const vector<SceneObject*>& objects, const vector<Light*>& lights, RenderCam* camera = NULL, int skip = 0);
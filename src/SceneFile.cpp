@@ -0,0 +1,339 @@
+//
+//  SceneFile.cpp - text scene format, see SceneFile.h
+//
+
+#include "SceneFile.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+
+// the file is read this much at a time; a longer line grows the buffer.
+// Also the smallest piece of a file given to one task of a parallel load.
+//
+static const size_t chunkSize = 1 << 20;
+
+// one "create -sphere" line; options missing from the line keep these
+//
+struct SphereLine {
+	string name = "nothing";
+	glm::vec3 rotation = glm::vec3(0);
+	float radius = 1;
+	glm::vec3 position = glm::vec3(0);
+	float color[4] = { 0, 0, 0, 255 };
+};
+
+// Single pass over the lines of a piece of the file.  Every value is read
+// with from_chars straight from the buffer, so floats keep all their digits
+// and nothing is copied into temporary strings.  Parsing stops at the first
+// bad line, leaving "line" at it and what was wrong in "error".
+//
+class SceneTextParser {
+public:
+	SceneTextParser(int firstLine) : line(firstLine) {}
+
+	// parse the complete lines in [begin, end), appending to spheres
+	//
+	bool parse(const char* begin, const char* end, vector<SphereLine>& spheres) {
+		p = begin;
+		while (p < end) {
+			const char* eol = (const char*)memchr(p, '\n', end - p);
+			lineEnd = eol ? eol : end;
+			if (!parseLine(spheres)) return false;
+			p = lineEnd + 1;
+			line++;
+		}
+		return true;
+	}
+
+	int line;          // number of the line being parsed (1 based)
+	string error;
+
+private:
+	const char* p;
+	const char* lineEnd;
+
+	bool fail(const string& message) {
+		error = message;
+		return false;
+	}
+
+	void skipSpaces() {
+		while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+	}
+
+	// next whitespace separated word, empty at the end of the line
+	//
+	std::string_view word() {
+		skipSpaces();
+		const char* start = p;
+		while (p < lineEnd && *p != ' ' && *p != '\t' && *p != '\r') p++;
+		return std::string_view(start, p - start);
+	}
+
+	bool number(float& value) {
+		skipSpaces();
+		if (p < lineEnd && *p == '+') p++;    // from_chars doesn't take a leading +
+		auto result = std::from_chars(p, lineEnd, value);
+		if (result.ec != std::errc()) return false;
+		p = result.ptr;
+		return true;
+	}
+
+	// "<a, b, c>" with between minCount and maxCount numbers
+	//
+	bool numberList(const char* option, float* values, int minCount, int maxCount) {
+		skipSpaces();
+		if (p == lineEnd || *p != '<') return fail(string("expected '<' after ") + option);
+		p++;
+		int count = 0;
+		while (true) {
+			if (count == maxCount || !number(values[count])) return fail(string("bad value in ") + option);
+			count++;
+			skipSpaces();
+			if (p < lineEnd && *p == ',') p++;
+			else break;
+		}
+		if (p == lineEnd || *p != '>') return fail(string("expected '>' to close ") + option);
+		p++;
+		if (count < minCount) return fail(string("too few values in ") + option);
+		return true;
+	}
+
+	bool parseLine(vector<SphereLine>& spheres) {
+		std::string_view command = word();
+		if (command.empty() || command[0] == '#') return true;    // blank line or comment
+		if (command != "create") return fail("unknown command " + string(command));
+
+		SphereLine sphere;
+		bool isSphere = false;
+		while (true) {
+			std::string_view option = word();
+			if (option.empty()) break;
+
+			if (option == "-sphere") {
+				std::string_view name = word();
+				if (name.empty()) return fail("missing name after -sphere");
+				sphere.name.assign(name.data(), name.size());
+				isSphere = true;
+			}
+			else if (option == "-rotate") {
+				if (!numberList("-rotate", &sphere.rotation.x, 3, 3)) return false;
+			}
+			else if (option == "-translate") {
+				if (!numberList("-translate", &sphere.position.x, 3, 3)) return false;
+			}
+			else if (option == "-color") {
+				if (!numberList("-color", sphere.color, 3, 4)) return false;
+			}
+			else if (option == "-scale") {
+				if (!number(sphere.radius)) return fail("bad value after -scale");
+			}
+			else return fail("unknown option " + string(option));
+		}
+		if (!isSphere) return fail("create without -sphere");
+		spheres.push_back(std::move(sphere));
+		return true;
+	}
+};
+
+// a Joint for each parsed line, all at once at the end
+//
+static void buildSpheres(const vector<SphereLine>& spheres, vector<SceneObject*>& objects) {
+	objects.reserve(objects.size() + spheres.size());
+	for (auto& sphere : spheres) {
+		const float* c = sphere.color;
+		Joint* joint = new Joint(sphere.name, sphere.radius, ofColor(ofClamp(c[0], 0, 255), ofClamp(c[1], 0, 255), ofClamp(c[2], 0, 255), ofClamp(c[3], 0, 255)));
+		joint->rotation = sphere.rotation;
+		joint->position = sphere.position;
+		joint->markDirty();
+		objects.push_back(joint);
+	}
+}
+
+// the bounds of the spheres, as Sphere::getBounds() will give them
+//
+static void sphereBounds(const vector<SphereLine>& spheres, vector<AABB>& bounds) {
+	for (auto& sphere : spheres) {
+		bounds.push_back(AABB(sphere.position - glm::vec3(sphere.radius), sphere.position + glm::vec3(sphere.radius)));
+	}
+}
+
+// One piece of a parallel load: the lines between two newlines of the file.
+// Line numbers in an error are counted from the start of the piece.
+//
+struct TextChunk {
+	const char* begin;
+	const char* end;
+	vector<SphereLine> spheres;
+	vector<AABB> bounds;
+	int lines = 0;
+	int errorLine = 0;
+	string error;
+};
+
+// The mapped file is cut into a few pieces per thread (of at least
+// chunkSize), each ending just after a newline, and the pieces are parsed
+// by the pool.  The spheres are then appended piece by piece, which keeps
+// the order of the file.
+//
+static bool loadSceneTextParallel(const string& path, vector<SceneObject*>& objects, const SceneLoadOptions& options) {
+	MappedFile file;
+	if (!file.open(ofToDataPath(path))) {
+		cout << "can't read " << path << endl;
+		return false;
+	}
+	const char* data = file.data();
+	size_t size = file.size();
+
+	size_t numChunks = std::max<size_t>(1, std::min<size_t>(options.pool->size() * 4, size / chunkSize));
+	vector<TextChunk> chunks(numChunks);
+	const char* begin = data;
+	for (size_t i = 0; i < numChunks; i++) {
+		const char* end = data + size;
+		if (i + 1 < numChunks) {
+			end = std::max(begin, data + size * (i + 1) / numChunks);
+			const char* eol = (const char*)memchr(end, '\n', data + size - end);
+			end = eol ? eol + 1 : data + size;
+		}
+		chunks[i].begin = begin;
+		chunks[i].end = end;
+		begin = end;
+	}
+
+	options.pool->parallelFor((int)numChunks, [&](int task, int /*worker*/) {
+		TextChunk& chunk = chunks[task];
+		SceneTextParser parser(1);
+		if (!parser.parse(chunk.begin, chunk.end, chunk.spheres)) {
+			chunk.errorLine = parser.line;
+			chunk.error = parser.error;
+			return;
+		}
+		chunk.lines = parser.line - 1;
+		if (options.parsed) {
+			chunk.bounds.reserve(chunk.spheres.size());
+			sphereBounds(chunk.spheres, chunk.bounds);
+		}
+	});
+
+	// the first bad piece has the first error of the file
+	//
+	int line = 0;
+	size_t total = 0;
+	for (auto& chunk : chunks) {
+		if (!chunk.error.empty()) {
+			cout << path << ", line " << line + chunk.errorLine << ": " << chunk.error << endl;
+			return false;
+		}
+		line += chunk.lines;
+		total += chunk.spheres.size();
+	}
+
+	if (options.parsed) {
+		vector<AABB> bounds;
+		bounds.reserve(total);
+		for (auto& chunk : chunks) {
+			bounds.insert(bounds.end(), chunk.bounds.begin(), chunk.bounds.end());
+			vector<AABB>().swap(chunk.bounds);
+		}
+		options.parsed(bounds);
+	}
+
+	objects.reserve(objects.size() + total);
+	for (auto& chunk : chunks) {
+		buildSpheres(chunk.spheres, objects);
+		vector<SphereLine>().swap(chunk.spheres);
+	}
+	return true;
+}
+
+// Reads the file chunk by chunk.  Each chunk is parsed up to its last
+// newline; the unfinished line is moved to the front of the buffer and
+// completed by the next read.
+//
+bool loadSceneText(const string& path, vector<SceneObject*>& objects, const SceneLoadOptions& options) {
+	if (options.pool) return loadSceneTextParallel(path, objects, options);
+
+	std::ifstream in(ofToDataPath(path), std::ios::binary);
+	if (!in) {
+		cout << "can't read " << path << endl;
+		return false;
+	}
+
+	vector<char> buffer(chunkSize);
+	vector<SphereLine> spheres;
+	SceneTextParser parser(1);
+	size_t kept = 0;
+	while (true) {
+		if (kept == buffer.size()) buffer.resize(buffer.size() * 2);
+		in.read(buffer.data() + kept, buffer.size() - kept);
+		size_t filled = kept + (size_t)in.gcount();
+		bool last = !in;
+
+		const char* begin = buffer.data();
+		const char* end = begin + filled;
+		const char* cut = end;
+		if (!last) {
+			while (cut > begin && cut[-1] != '\n') cut--;
+		}
+		if (!parser.parse(begin, cut, spheres)) {
+			cout << path << ", line " << parser.line << ": " << parser.error << endl;
+			return false;
+		}
+		if (last) break;
+
+		kept = end - cut;
+		memmove(buffer.data(), cut, kept);
+	}
+
+	if (options.parsed) {
+		vector<AABB> bounds;
+		bounds.reserve(spheres.size());
+		sphereBounds(spheres, bounds);
+		options.parsed(bounds);
+	}
+	buildSpheres(spheres, objects);
+	return true;
+}
+
+// "a, b, c" with the shortest digits that read back as the same float
+//
+static void appendFloats(string& out, const float* values, int n) {
+	char digits[32];
+	for (int i = 0; i < n; i++) {
+		if (i > 0) out += ", ";
+		auto result = std::to_chars(digits, digits + sizeof(digits), values[i]);
+		out.append(digits, result.ptr);
+	}
+}
+
+bool saveSceneText(const string& path, const vector<SceneObject*>& objects, int skip) {
+	std::ofstream out(ofToDataPath(path), std::ios::binary);
+	if (!out) return false;
+
+	string text;
+	for (int i = skip; i < (int)objects.size(); i++) {
+		SceneObject* object = objects.at(i);
+		if (!object->isSphere()) continue;   // meshes are not saved
+
+		glm::vec3 position = object->getPosition();
+		const ofColor& c = object->diffuseColor;
+		text += "create -sphere ";
+		text += object->name;
+		text += " -rotate <";
+		appendFloats(text, &object->rotation.x, 3);
+		text += "> -scale ";
+		appendFloats(text, &object->radius, 1);
+		text += " -translate <";
+		appendFloats(text, &position.x, 3);
+		text += "> -color <" + to_string(c.r) + ", " + to_string(c.g) + ", " + to_string(c.b) + ", " + to_string(c.a) + ">\n";
+		if (text.size() >= chunkSize) {
+			out.write(text.data(), text.size());
+			text.clear();
+		}
+	}
+	out.write(text.data(), text.size());
+	return (bool)out;
+}
@@ -0,0 +1,46 @@
+//
+//  SceneFile.h - reading and writing the text scene format (savedFile.txt)
+//
+//  One sphere per line:
+//
+//      create -sphere name -rotate <x, y, z> -scale radius -translate <x, y, z> -color <r, g, b[, a]>
+//
+//  The options can come in any order and may be left out.  Blank lines and
+//  lines starting with # are skipped.  Floats are written with the shortest
+//  digits that read back exactly, so a file saved here loads back the same.
+//
+//  Used by the app (text export and import, 'S' and 'L') and by the headless
+//  renderer.  Only spheres are stored; the wall and floor planes are not part
+//  of the file.  Full scenes are saved in the binary format (SceneBinary.h).
+//
+#pragma once
+
+#include "ofMain.h"
+#include "Primitives.h"
+#include <functional>
+
+class ThreadPool;
+
+// How a big file is loaded.  With a pool, the file is cut into chunks at
+// line (or record) boundaries that are parsed in parallel, and the results
+// are appended in file order.  parsed, if set, is called with the bounds of
+// the new objects in order as soon as they are known, before the objects
+// are created, so the caller can start building its BVH while the loader
+// finishes.  Nothing is added if the load fails after that.
+//
+struct SceneLoadOptions {
+	ThreadPool* pool = NULL;
+	std::function<void(vector<AABB>& bounds)> parsed;
+};
+
+// Append a Joint to objects for every sphere in the file.  path is relative
+// to the data folder unless it is absolute.  Without a pool the file is
+// streamed in chunks and parsed in one pass.  Returns false (adding nothing)
+// if it can't be read or has an error, which is reported with its line
+// number.
+//
+bool loadSceneText(const string& path, vector<SceneObject*>& objects, const SceneLoadOptions& options = SceneLoadOptions());
+
+// write every sphere in objects, skipping the first "skip" objects
+//
+bool saveSceneText(const string& path, const vector<SceneObject*>& objects, int skip = 0);
@@ -0,0 +1,49 @@
+//
+//  Simd.h - SIMD build switches and CPU feature detection shared by the
+//  ray intersection kernels (SphereSoA, TriangleSoA)
+//
+//  Kernels are compiled for SSE (always available on x86-64) and AVX2; the
+//  AVX2 ones are only called if cpuHasAVX2() says the machine can run them.
+//
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RT_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and clang only emit AVX2 instructions in functions that ask for them;
+// MSVC allows the intrinsics anywhere
+//
+#if defined(RT_X86) && (defined(__GNUC__) || defined(__clang__))
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RT_TARGET_AVX2
+#endif
+
+#ifdef RT_X86
+
+// AVX2 needs both the instructions and an OS that saves the ymm registers
+//
+inline bool cpuHasAVX2() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx) return false;
+	if ((_xgetbv(0) & 6) != 6) return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // RT_X86
@@ -0,0 +1,413 @@
+//
+//  SphereSoA.cpp - scalar, SSE and AVX2 ray vs. sphere kernels (single rays and packets)
+//
+//  All three versions follow glm::intersectRaySphere step for step:
+//
+//      diff = center - orig
+//      t0 = dot(diff, dir)
+//      d2 = dot(diff, diff) - t0 * t0         miss if d2 > r2
+//      t1 = sqrt(r2 - d2)
+//      t = t0 > t1 + eps ? t0 - t1 : t0 + t1  hit if t > eps
+//
+//  Dots are summed as (x + y) + z in every version and no FMA is used, so the
+//  SIMD kernels round exactly like the scalar one.
+//
+
+#include "SphereSoA.h"
+#include "Simd.h"
+#include "Profiler.h"
+#include <bitset>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <iostream>
+
+void SphereSoA::resize(int n) {
+	this->n = n;
+	cx.assign(n + padding, 0);
+	cy.assign(n + padding, 0);
+	cz.assign(n + padding, 0);
+	r2.assign(n + padding, -1);
+}
+
+int intersectSpheresScalar(const SphereSoA& s, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float& tNearest) {
+	const float eps = std::numeric_limits<float>::epsilon();
+	int best = -1;
+
+	for (int i = first; i < first + count; i++) {
+		if (s.r2[i] < 0) continue;
+
+		float diffx = s.cx[i] - orig.x;
+		float diffy = s.cy[i] - orig.y;
+		float diffz = s.cz[i] - orig.z;
+		float t0 = (diffx * dir.x + diffy * dir.y) + diffz * dir.z;
+		float dd = (diffx * diffx + diffy * diffy) + diffz * diffz;
+		float d2 = dd - t0 * t0;
+		if (d2 > s.r2[i]) continue;
+
+		float t1 = std::sqrt(s.r2[i] - d2);
+		float t = t0 > t1 + eps ? t0 - t1 : t0 + t1;
+		if (t > eps && t < tNearest) {
+			tNearest = t;
+			best = i;
+		}
+	}
+	return best;
+}
+
+int intersectSpheresPacketScalar(const SphereSoA& s, int first, int count, const RayPacket& packet, int laneMask, float* tNearest, int* slot) {
+	int hitMask = 0;
+	for (int lane = 0; lane < RayPacket::width; lane++) {
+		if (!(laneMask & (1 << lane))) continue;
+		int i = intersectSpheresScalar(s, first, count, packet.origin(lane), packet.direction(lane), tNearest[lane]);
+		if (i >= 0) {
+			slot[lane] = i;
+			hitMask |= 1 << lane;
+		}
+	}
+	return hitMask;
+}
+
+#ifdef RT_X86
+
+// Each lane keeps its own nearest hit; pick the nearest lane at the end,
+// breaking ties toward the lower slot like the scalar loop does.
+//
+static int reduceLanes(const float* t, const int* idx, int lanes, float& tNearest) {
+	int best = -1;
+	for (int k = 0; k < lanes; k++) {
+		if (idx[k] < 0) continue;
+		if (t[k] < tNearest || (t[k] == tNearest && idx[k] < best)) {
+			tNearest = t[k];
+			best = idx[k];
+		}
+	}
+	return best;
+}
+
+static int intersectSpheresSSE(const SphereSoA& s, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float& tNearest) {
+	const __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+	const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+	const __m128 eps = _mm_set1_ps(std::numeric_limits<float>::epsilon());
+	const __m128 zero = _mm_setzero_ps();
+	const __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+	const __m128i end = _mm_set1_epi32(first + count);
+
+	__m128 bestT = _mm_set1_ps(tNearest);
+	__m128i bestIdx = _mm_set1_epi32(-1);
+
+	for (int i = first; i < first + count; i += 4) {
+		__m128 cx = _mm_loadu_ps(&s.cx[i]);
+		__m128 cy = _mm_loadu_ps(&s.cy[i]);
+		__m128 cz = _mm_loadu_ps(&s.cz[i]);
+		__m128 r2 = _mm_loadu_ps(&s.r2[i]);
+
+		__m128 diffx = _mm_sub_ps(cx, ox);
+		__m128 diffy = _mm_sub_ps(cy, oy);
+		__m128 diffz = _mm_sub_ps(cz, oz);
+		__m128 t0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(diffx, dx), _mm_mul_ps(diffy, dy)), _mm_mul_ps(diffz, dz));
+		__m128 dd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(diffx, diffx), _mm_mul_ps(diffy, diffy)), _mm_mul_ps(diffz, diffz));
+		__m128 d2 = _mm_sub_ps(dd, _mm_mul_ps(t0, t0));
+
+		__m128 t1 = _mm_sqrt_ps(_mm_sub_ps(r2, d2));
+		__m128 useNear = _mm_cmpgt_ps(t0, _mm_add_ps(t1, eps));
+		__m128 t = _mm_or_ps(_mm_and_ps(useNear, _mm_sub_ps(t0, t1)), _mm_andnot_ps(useNear, _mm_add_ps(t0, t1)));
+
+		__m128i idx = _mm_add_epi32(_mm_set1_epi32(i), lane);
+		__m128 valid = _mm_and_ps(_mm_cmple_ps(d2, r2), _mm_cmpge_ps(r2, zero));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, eps), _mm_cmplt_ps(t, bestT)));
+		valid = _mm_and_ps(valid, _mm_castsi128_ps(_mm_cmplt_epi32(idx, end)));
+
+		bestT = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, bestT));
+		__m128i validi = _mm_castps_si128(valid);
+		bestIdx = _mm_or_si128(_mm_and_si128(validi, idx), _mm_andnot_si128(validi, bestIdx));
+	}
+
+	float t[4];
+	int idx[4];
+	_mm_storeu_ps(t, bestT);
+	_mm_storeu_si128((__m128i*)idx, bestIdx);
+	return reduceLanes(t, idx, 4, tNearest);
+}
+
+RT_TARGET_AVX2
+static int intersectSpheresAVX2(const SphereSoA& s, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float& tNearest) {
+	const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+	const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+	const __m256 eps = _mm256_set1_ps(std::numeric_limits<float>::epsilon());
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256i end = _mm256_set1_epi32(first + count);
+
+	__m256 bestT = _mm256_set1_ps(tNearest);
+	__m256i bestIdx = _mm256_set1_epi32(-1);
+
+	for (int i = first; i < first + count; i += 8) {
+		__m256 cx = _mm256_loadu_ps(&s.cx[i]);
+		__m256 cy = _mm256_loadu_ps(&s.cy[i]);
+		__m256 cz = _mm256_loadu_ps(&s.cz[i]);
+		__m256 r2 = _mm256_loadu_ps(&s.r2[i]);
+
+		__m256 diffx = _mm256_sub_ps(cx, ox);
+		__m256 diffy = _mm256_sub_ps(cy, oy);
+		__m256 diffz = _mm256_sub_ps(cz, oz);
+		__m256 t0 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(diffx, dx), _mm256_mul_ps(diffy, dy)), _mm256_mul_ps(diffz, dz));
+		__m256 dd = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(diffx, diffx), _mm256_mul_ps(diffy, diffy)), _mm256_mul_ps(diffz, diffz));
+		__m256 d2 = _mm256_sub_ps(dd, _mm256_mul_ps(t0, t0));
+
+		__m256 t1 = _mm256_sqrt_ps(_mm256_sub_ps(r2, d2));
+		__m256 useNear = _mm256_cmp_ps(t0, _mm256_add_ps(t1, eps), _CMP_GT_OQ);
+		__m256 t = _mm256_blendv_ps(_mm256_add_ps(t0, t1), _mm256_sub_ps(t0, t1), useNear);
+
+		__m256i idx = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+		__m256 valid = _mm256_and_ps(_mm256_cmp_ps(d2, r2, _CMP_LE_OQ), _mm256_cmp_ps(r2, zero, _CMP_GE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, eps, _CMP_GT_OQ), _mm256_cmp_ps(t, bestT, _CMP_LT_OQ)));
+		valid = _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, idx)));
+
+		bestT = _mm256_blendv_ps(bestT, t, valid);
+		bestIdx = _mm256_blendv_epi8(bestIdx, idx, _mm256_castps_si256(valid));
+	}
+
+	float t[8];
+	int idx[8];
+	_mm256_storeu_ps(t, bestT);
+	_mm256_storeu_si256((__m256i*)idx, bestIdx);
+	return reduceLanes(t, idx, 8, tNearest);
+}
+
+// One group of 4 packet lanes starting at "lane"; every sphere is broadcast
+// and tested against the 4 rays at once.
+//
+static int intersectPacketSSE(const SphereSoA& s, int first, int count, const RayPacket& packet, int lane, int laneMask, float* tNearest, int* slot) {
+	const __m128 ox = _mm_loadu_ps(&packet.ox[lane]), oy = _mm_loadu_ps(&packet.oy[lane]), oz = _mm_loadu_ps(&packet.oz[lane]);
+	const __m128 dx = _mm_loadu_ps(&packet.dx[lane]), dy = _mm_loadu_ps(&packet.dy[lane]), dz = _mm_loadu_ps(&packet.dz[lane]);
+	const __m128 eps = _mm_set1_ps(std::numeric_limits<float>::epsilon());
+	const __m128i bits = _mm_set_epi32(8, 4, 2, 1);
+	const __m128 active = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_and_si128(_mm_set1_epi32(laneMask >> lane), bits), _mm_setzero_si128()));
+
+	__m128 bestT = _mm_loadu_ps(&tNearest[lane]);
+	__m128i bestIdx = _mm_set1_epi32(-1);
+
+	for (int i = first; i < first + count; i++) {
+		if (s.r2[i] < 0) continue;
+		__m128 r2 = _mm_set1_ps(s.r2[i]);
+
+		__m128 diffx = _mm_sub_ps(_mm_set1_ps(s.cx[i]), ox);
+		__m128 diffy = _mm_sub_ps(_mm_set1_ps(s.cy[i]), oy);
+		__m128 diffz = _mm_sub_ps(_mm_set1_ps(s.cz[i]), oz);
+		__m128 t0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(diffx, dx), _mm_mul_ps(diffy, dy)), _mm_mul_ps(diffz, dz));
+		__m128 dd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(diffx, diffx), _mm_mul_ps(diffy, diffy)), _mm_mul_ps(diffz, diffz));
+		__m128 d2 = _mm_sub_ps(dd, _mm_mul_ps(t0, t0));
+
+		__m128 t1 = _mm_sqrt_ps(_mm_sub_ps(r2, d2));
+		__m128 useNear = _mm_cmpgt_ps(t0, _mm_add_ps(t1, eps));
+		__m128 t = _mm_or_ps(_mm_and_ps(useNear, _mm_sub_ps(t0, t1)), _mm_andnot_ps(useNear, _mm_add_ps(t0, t1)));
+
+		__m128 valid = _mm_and_ps(active, _mm_cmple_ps(d2, r2));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, eps), _mm_cmplt_ps(t, bestT)));
+
+		bestT = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, bestT));
+		__m128i validi = _mm_castps_si128(valid);
+		bestIdx = _mm_or_si128(_mm_and_si128(validi, _mm_set1_epi32(i)), _mm_andnot_si128(validi, bestIdx));
+	}
+
+	float t[4];
+	int idx[4];
+	_mm_storeu_ps(t, bestT);
+	_mm_storeu_si128((__m128i*)idx, bestIdx);
+
+	int hitMask = 0;
+	for (int k = 0; k < 4; k++) {
+		if (idx[k] < 0) continue;
+		tNearest[lane + k] = t[k];
+		slot[lane + k] = idx[k];
+		hitMask |= 1 << (lane + k);
+	}
+	return hitMask;
+}
+
+static int intersectSpheresPacketSSE(const SphereSoA& s, int first, int count, const RayPacket& packet, int laneMask, float* tNearest, int* slot) {
+	int hitMask = 0;
+	for (int lane = 0; lane < RayPacket::width; lane += 4) {
+		if ((laneMask >> lane) & 0xf) hitMask |= intersectPacketSSE(s, first, count, packet, lane, laneMask, tNearest, slot);
+	}
+	return hitMask;
+}
+
+RT_TARGET_AVX2
+static int intersectSpheresPacketAVX2(const SphereSoA& s, int first, int count, const RayPacket& packet, int laneMask, float* tNearest, int* slot) {
+	const __m256 ox = _mm256_loadu_ps(packet.ox), oy = _mm256_loadu_ps(packet.oy), oz = _mm256_loadu_ps(packet.oz);
+	const __m256 dx = _mm256_loadu_ps(packet.dx), dy = _mm256_loadu_ps(packet.dy), dz = _mm256_loadu_ps(packet.dz);
+	const __m256 eps = _mm256_set1_ps(std::numeric_limits<float>::epsilon());
+	const __m256i bits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+	const __m256 active = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(laneMask), bits), _mm256_setzero_si256()));
+
+	__m256 bestT = _mm256_loadu_ps(tNearest);
+	__m256i bestIdx = _mm256_set1_epi32(-1);
+
+	for (int i = first; i < first + count; i++) {
+		if (s.r2[i] < 0) continue;
+		__m256 r2 = _mm256_set1_ps(s.r2[i]);
+
+		__m256 diffx = _mm256_sub_ps(_mm256_set1_ps(s.cx[i]), ox);
+		__m256 diffy = _mm256_sub_ps(_mm256_set1_ps(s.cy[i]), oy);
+		__m256 diffz = _mm256_sub_ps(_mm256_set1_ps(s.cz[i]), oz);
+		__m256 t0 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(diffx, dx), _mm256_mul_ps(diffy, dy)), _mm256_mul_ps(diffz, dz));
+		__m256 dd = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(diffx, diffx), _mm256_mul_ps(diffy, diffy)), _mm256_mul_ps(diffz, diffz));
+		__m256 d2 = _mm256_sub_ps(dd, _mm256_mul_ps(t0, t0));
+
+		__m256 t1 = _mm256_sqrt_ps(_mm256_sub_ps(r2, d2));
+		__m256 useNear = _mm256_cmp_ps(t0, _mm256_add_ps(t1, eps), _CMP_GT_OQ);
+		__m256 t = _mm256_blendv_ps(_mm256_add_ps(t0, t1), _mm256_sub_ps(t0, t1), useNear);
+
+		__m256 valid = _mm256_and_ps(active, _mm256_cmp_ps(d2, r2, _CMP_LE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, eps, _CMP_GT_OQ), _mm256_cmp_ps(t, bestT, _CMP_LT_OQ)));
+
+		bestT = _mm256_blendv_ps(bestT, t, valid);
+		bestIdx = _mm256_blendv_epi8(bestIdx, _mm256_set1_epi32(i), _mm256_castps_si256(valid));
+	}
+
+	float t[8];
+	int idx[8];
+	_mm256_storeu_ps(t, bestT);
+	_mm256_storeu_si256((__m256i*)idx, bestIdx);
+
+	int hitMask = 0;
+	for (int k = 0; k < 8; k++) {
+		if (idx[k] < 0) continue;
+		tNearest[k] = t[k];
+		slot[k] = idx[k];
+		hitMask |= 1 << k;
+	}
+	return hitMask;
+}
+
+#endif // RT_X86
+
+typedef int (*SphereKernel)(const SphereSoA&, int, int, const glm::vec3&, const glm::vec3&, float&);
+
+static SphereKernel chooseSphereKernel(const char*& name) {
+#ifdef RT_X86
+	if (cpuHasAVX2()) {
+		name = "AVX2";
+		return intersectSpheresAVX2;
+	}
+	name = "SSE";
+	return intersectSpheresSSE;
+#else
+	name = "scalar";
+	return intersectSpheresScalar;
+#endif
+}
+
+typedef int (*PacketKernel)(const SphereSoA&, int, int, const RayPacket&, int, float*, int*);
+
+static PacketKernel choosePacketKernel() {
+#ifdef RT_X86
+	if (cpuHasAVX2()) return intersectSpheresPacketAVX2;
+	return intersectSpheresPacketSSE;
+#else
+	return intersectSpheresPacketScalar;
+#endif
+}
+
+static const char* sphereKernelLabel = "scalar";
+static SphereKernel sphereKernel = chooseSphereKernel(sphereKernelLabel);
+static PacketKernel packetKernel = choosePacketKernel();
+
+int intersectSpheres(const SphereSoA& spheres, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float& tNearest) {
+	PROFILE_COUNT_N(ProfileSphereTests, count);
+	return sphereKernel(spheres, first, count, orig, dir, tNearest);
+}
+
+int intersectSpheresPacket(const SphereSoA& spheres, int first, int count, const RayPacket& packet, int laneMask, float* tNearest, int* slot) {
+	PROFILE_COUNT_N(ProfileSphereTests, count * std::bitset<32>(laneMask).count());
+	return packetKernel(spheres, first, count, packet, laneMask, tNearest, slot);
+}
+
+const char* sphereKernelName() {
+	return sphereKernelLabel;
+}
+
+// compare one kernel against the scalar path on the same random data
+//
+static bool verifyKernel(const char* name, SphereKernel kernel, const SphereSoA& spheres, int numRays) {
+	std::mt19937 rng(116);
+	std::uniform_real_distribution<float> coord(-10, 10);
+	std::uniform_int_distribution<int> start(0, spheres.size() - 1);
+
+	int mismatches = 0;
+	for (int r = 0; r < numRays; r++) {
+		glm::vec3 orig(coord(rng), coord(rng), coord(rng));
+		glm::vec3 dir = glm::normalize(glm::vec3(coord(rng), coord(rng), coord(rng)));
+		int first = start(rng);
+		int count = std::min(spheres.size() - first, 1 + (int)(rng() % 20));
+		float tMax = (r % 3 == 0) ? coord(rng) + 10 : std::numeric_limits<float>::infinity();
+
+		float tScalar = tMax, tKernel = tMax;
+		int iScalar = intersectSpheresScalar(spheres, first, count, orig, dir, tScalar);
+		int iKernel = kernel(spheres, first, count, orig, dir, tKernel);
+		if (iScalar != iKernel || std::memcmp(&tScalar, &tKernel, sizeof(float)) != 0) mismatches++;
+	}
+	std::cout << "sphere kernel " << name << ": " << (mismatches ? "MISMATCH" : "ok") << " ("
+		<< mismatches << " of " << numRays << " rays differ from scalar)" << std::endl;
+	return mismatches == 0;
+}
+
+// same for a packet kernel: random packets with random lanes switched off
+//
+static bool verifyPacketKernel(const char* name, PacketKernel kernel, const SphereSoA& spheres, int numRays) {
+	std::mt19937 rng(117);
+	std::uniform_real_distribution<float> coord(-10, 10);
+	std::uniform_int_distribution<int> start(0, spheres.size() - 1);
+
+	int mismatches = 0;
+	for (int r = 0; r < numRays; r += RayPacket::width) {
+		RayPacket packet;
+		glm::vec3 orig(coord(rng), coord(rng), coord(rng));
+		float tScalar[RayPacket::width], tKernel[RayPacket::width];
+		int iScalar[RayPacket::width], iKernel[RayPacket::width];
+		for (int lane = 0; lane < RayPacket::width; lane++) {
+			packet.set(lane, orig, glm::normalize(glm::vec3(coord(rng), coord(rng), coord(rng))));
+			tScalar[lane] = tKernel[lane] = (lane % 3 == 0) ? coord(rng) + 10 : std::numeric_limits<float>::infinity();
+			iScalar[lane] = iKernel[lane] = -1;
+		}
+		int laneMask = (int)(rng() & RayPacket::allLanes);
+		int first = start(rng);
+		int count = std::min(spheres.size() - first, 1 + (int)(rng() % 20));
+
+		int mScalar = intersectSpheresPacketScalar(spheres, first, count, packet, laneMask, tScalar, iScalar);
+		int mKernel = kernel(spheres, first, count, packet, laneMask, tKernel, iKernel);
+		bool same = mScalar == mKernel;
+		for (int lane = 0; lane < RayPacket::width; lane++) {
+			if (iScalar[lane] != iKernel[lane] || std::memcmp(&tScalar[lane], &tKernel[lane], sizeof(float)) != 0) same = false;
+		}
+		if (!same) mismatches++;
+	}
+	std::cout << "sphere packet kernel " << name << ": " << (mismatches ? "MISMATCH" : "ok") << " ("
+		<< mismatches << " of " << numRays / RayPacket::width << " packets differ from scalar)" << std::endl;
+	return mismatches == 0;
+}
+
+bool verifySphereKernels(int numRays) {
+	std::mt19937 rng(2023);
+	std::uniform_real_distribution<float> coord(-10, 10);
+	std::uniform_real_distribution<float> radius(0.1f, 3.0f);
+
+	SphereSoA spheres;
+	spheres.resize(200);
+	for (int i = 0; i < spheres.size(); i++) {
+		if (i % 7 == 3) spheres.setEmpty(i);
+		else spheres.set(i, glm::vec3(coord(rng), coord(rng), coord(rng)), radius(rng));
+	}
+
+	bool ok = true;
+#ifdef RT_X86
+	ok = verifyKernel("SSE", intersectSpheresSSE, spheres, numRays) && ok;
+	if (cpuHasAVX2()) ok = verifyKernel("AVX2", intersectSpheresAVX2, spheres, numRays) && ok;
+	ok = verifyPacketKernel("SSE", intersectSpheresPacketSSE, spheres, numRays) && ok;
+	if (cpuHasAVX2()) ok = verifyPacketKernel("AVX2", intersectSpheresPacketAVX2, spheres, numRays) && ok;
+#endif
+	return ok;
+}
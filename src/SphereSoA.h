@@ -0,0 +1,67 @@
+//
+//  SphereSoA.h - spheres stored as structure-of-arrays for SIMD ray tests
+//
+//  Slot i holds one sphere as (cx[i], cy[i], cz[i], r2[i]).  Slots that don't
+//  hold a sphere have r2 < 0 and are never hit.  The arrays are padded so a
+//  kernel can always load a full 8-wide vector past the last slot.
+//
+//  intersectSpheres() tests a range of slots against one ray and returns the
+//  nearest hit.  It runs 8 spheres at a time with AVX2 or 4 at a time with SSE,
+//  picked at startup from the CPU features, and gives bit-identical results
+//  to intersectSpheresScalar() (same operations in the same order, no FMA).
+//  That needs the compiler not to fuse the scalar code into FMAs either, so
+//  the projects build with -ffp-contract=off (/fp:precise on MSVC).
+//
+#pragma once
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "RayPacket.h"
+
+struct SphereSoA {
+	void resize(int n);
+	void set(int slot, const glm::vec3& center, float radius) {
+		cx[slot] = center.x;
+		cy[slot] = center.y;
+		cz[slot] = center.z;
+		r2[slot] = radius * radius;
+	}
+	void setEmpty(int slot) { r2[slot] = -1; }
+	bool isSphere(int slot) const { return r2[slot] >= 0; }
+	int size() const { return n; }
+
+	std::vector<float> cx, cy, cz, r2;
+	int n = 0;
+
+	static const int padding = 8;
+};
+
+// Nearest intersection of the ray with slots [first, first + count).
+// Only hits closer than tNearest count; on a hit tNearest is set to the hit
+// distance and the slot is returned, otherwise returns -1.  Same math as
+// glm::intersectRaySphere, dir must be normalized.
+//
+int intersectSpheres(const SphereSoA& spheres, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float& tNearest);
+
+// reference version, one sphere at a time
+//
+int intersectSpheresScalar(const SphereSoA& spheres, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float& tNearest);
+
+// Packet version: slots [first, first + count) against every lane of the
+// packet in laneMask.  Here the SIMD lanes run over rays instead of spheres.
+// tNearest[lane] and slot[lane] are updated for lanes that find a closer
+// hit, and the mask of those lanes is returned.  Each lane gives exactly what
+// intersectSpheres() would for that ray alone.
+//
+int intersectSpheresPacket(const SphereSoA& spheres, int first, int count, const RayPacket& packet, int laneMask, float* tNearest, int* slot);
+
+int intersectSpheresPacketScalar(const SphereSoA& spheres, int first, int count, const RayPacket& packet, int laneMask, float* tNearest, int* slot);
+
+// "AVX2", "SSE" or "scalar"
+//
+const char* sphereKernelName();
+
+// Run every kernel the CPU supports on random rays and spheres and check the
+// results match the scalar path bit for bit.  Prints a line per kernel.
+//
+bool verifySphereKernels(int numRays = 10000);
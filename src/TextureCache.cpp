@@ -0,0 +1,142 @@
+//
+//  TextureCache.cpp - mip chain construction and filtered texture lookups
+//
+
+#include "TextureCache.h"
+#include "ofMain.h"
+#include "Profiler.h"
+#include <algorithm>
+#include <cmath>
+
+bool Texture::load(const std::string& path) {
+	ofPixels pixels;
+	if (!ofLoadImage(pixels, path) || pixels.getWidth() == 0) return false;
+	setPixels(pixels.getData(), (int)pixels.getWidth(), (int)pixels.getHeight(), (int)pixels.getNumChannels());
+	return true;
+}
+
+// round the level up to whole tiles, so every tile is complete
+//
+void Texture::allocate(MipLevel& level, int width, int height) {
+	level.width = width;
+	level.height = height;
+	level.tilesX = (width + tileSize - 1) / tileSize;
+	int tilesY = (height + tileSize - 1) / tileSize;
+	level.texels.assign((size_t)level.tilesX * tilesY * tileSize * tileSize, Texel{ 0, 0, 0, 255 });
+}
+
+void Texture::setPixels(const uint8_t* pixels, int width, int height, int channels) {
+	levels.clear();
+	levels.emplace_back();
+	allocate(levels[0], width, height);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			const uint8_t* p = pixels + ((size_t)y * width + x) * channels;
+			Texel& t = texel(levels[0], x, y);
+			if (channels >= 3) {
+				t.r = p[0];
+				t.g = p[1];
+				t.b = p[2];
+				t.a = channels == 4 ? p[3] : 255;
+			}
+			else {
+				t.r = t.g = t.b = p[0];
+				t.a = channels == 2 ? p[1] : 255;
+			}
+		}
+	}
+
+	// each level averages 2x2 blocks of the one above; odd edges reuse
+	// the last row/column
+	//
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		int w = std::max(1, levels.back().width / 2);
+		int h = std::max(1, levels.back().height / 2);
+		levels.emplace_back();
+		const MipLevel& src = levels[levels.size() - 2];
+		MipLevel& dst = levels.back();
+		allocate(dst, w, h);
+		for (int y = 0; y < h; y++) {
+			int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+			for (int x = 0; x < w; x++) {
+				int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+				const Texel& a = texel(src, x0, y0);
+				const Texel& b = texel(src, x1, y0);
+				const Texel& c = texel(src, x0, y1);
+				const Texel& d = texel(src, x1, y1);
+				Texel& t = texel(dst, x, y);
+				t.r = (uint8_t)((a.r + b.r + c.r + d.r + 2) / 4);
+				t.g = (uint8_t)((a.g + b.g + c.g + d.g + 2) / 4);
+				t.b = (uint8_t)((a.b + b.b + c.b + d.b + 2) / 4);
+				t.a = (uint8_t)((a.a + b.a + c.a + d.a + 2) / 4);
+			}
+		}
+	}
+}
+
+glm::vec4 Texture::sampleLevel(const glm::vec2& uv, int level) const {
+	const MipLevel& l = levels[level];
+
+	// texel centers are at half integers
+	//
+	float x = uv.x * l.width - 0.5f;
+	float y = uv.y * l.height - 0.5f;
+	float fx = std::floor(x);
+	float fy = std::floor(y);
+	float wx = x - fx;
+	float wy = y - fy;
+	int x0 = std::min(std::max((int)fx, 0), l.width - 1);
+	int y0 = std::min(std::max((int)fy, 0), l.height - 1);
+	int x1 = std::min(std::max((int)fx + 1, 0), l.width - 1);
+	int y1 = std::min(std::max((int)fy + 1, 0), l.height - 1);
+
+	const Texel& a = texel(l, x0, y0);
+	const Texel& b = texel(l, x1, y0);
+	const Texel& c = texel(l, x0, y1);
+	const Texel& d = texel(l, x1, y1);
+	float wa = (1 - wx) * (1 - wy), wb = wx * (1 - wy), wc = (1 - wx) * wy, wd = wx * wy;
+	const float scale = 1.0f / 255;
+	return glm::vec4(
+		(a.r * wa + b.r * wb + c.r * wc + d.r * wd) * scale,
+		(a.g * wa + b.g * wb + c.g * wc + d.g * wd) * scale,
+		(a.b * wa + b.b * wb + c.b * wc + d.b * wd) * scale,
+		(a.a * wa + b.a * wb + c.a * wc + d.a * wd) * scale);
+}
+
+glm::vec4 Texture::sample(const glm::vec2& uv, float footprint) const {
+	PROFILE_COUNT(ProfileTextureFetches);
+	if (levels.empty()) return glm::vec4(0, 0, 0, 1);
+
+	// mip level where the footprint covers about one texel
+	//
+	float lod = std::log2(std::max(footprint * std::max(getWidth(), getHeight()), 1.0f));
+	int last = numLevels() - 1;
+	if (lod >= last) return sampleLevel(uv, last);
+
+	int level = (int)lod;
+	float blend = lod - level;
+	glm::vec4 c = sampleLevel(uv, level);
+	if (blend > 0) c = c * (1 - blend) + sampleLevel(uv, level + 1) * blend;
+	return c;
+}
+
+const Texture* TextureCache::get(const std::string& path) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = textures.find(path);
+	if (found != textures.end()) return found->second.get();
+
+	PROFILE_SCOPE("texture load");
+	std::unique_ptr<Texture> texture(new Texture());
+	if (!texture->load(path)) {
+		ofLogWarning("TextureCache") << "could not load " << path;
+		texture.reset();
+	}
+	const Texture* result = texture.get();
+	textures[path] = std::move(texture);
+	return result;
+}
+
+void TextureCache::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	textures.clear();
+}
@@ -0,0 +1,84 @@
+//
+//  TextureCache.h - decoded, mip-mapped textures kept across renders
+//
+//  A Texture is decoded once and stored as a chain of mip levels, each halving
+//  the previous one with a box filter.  Texels of a level are stored in 8x8
+//  tiles (256 bytes, four cache lines) so the 2x2 neighborhoods read by
+//  bilinear filtering, and the neighborhoods of nearby rays, mostly fall in
+//  the same few lines.  Lookups are clamped to the edge of the texture.
+//
+//  TextureCache hands out textures by file name and only reads a file the
+//  first time it is asked for it.
+//
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include "glm/glm.hpp"
+
+struct Texel {
+	uint8_t r, g, b, a;
+};
+
+class Texture {
+public:
+	bool load(const std::string& path);
+
+	// build the mip chain from 8 bit pixels, rows top to bottom
+	//
+	void setPixels(const uint8_t* pixels, int width, int height, int channels);
+
+	// Trilinear lookup.  uv is in [0, 1] with v = 0 at the top row of the
+	// image, footprint is the size of the area being shaded in uv units and
+	// picks the mip level.  Returns RGBA in [0, 1].
+	//
+	glm::vec4 sample(const glm::vec2& uv, float footprint) const;
+
+	// bilinear lookup in a single mip level
+	//
+	glm::vec4 sampleLevel(const glm::vec2& uv, int level) const;
+
+	int getWidth() const { return levels.empty() ? 0 : levels[0].width; }
+	int getHeight() const { return levels.empty() ? 0 : levels[0].height; }
+	int numLevels() const { return (int)levels.size(); }
+
+private:
+	struct MipLevel {
+		int width = 0;
+		int height = 0;
+		int tilesX = 0;
+		std::vector<Texel> texels;   // tile after tile, rows of tiles top to bottom
+	};
+
+	static const int tileBits = 3;
+	static const int tileSize = 1 << tileBits;
+
+	static void allocate(MipLevel& level, int width, int height);
+	static Texel& texel(MipLevel& level, int x, int y) {
+		return level.texels[(((y >> tileBits) * level.tilesX + (x >> tileBits)) << (2 * tileBits)) +
+			((y & (tileSize - 1)) << tileBits) + (x & (tileSize - 1))];
+	}
+	static const Texel& texel(const MipLevel& level, int x, int y) {
+		return level.texels[(((y >> tileBits) * level.tilesX + (x >> tileBits)) << (2 * tileBits)) +
+			((y & (tileSize - 1)) << tileBits) + (x & (tileSize - 1))];
+	}
+
+	std::vector<MipLevel> levels;
+};
+
+class TextureCache {
+public:
+	// the texture for a file, loading it on first use.  NULL if the file
+	// can't be read (the failure is remembered too).
+	//
+	const Texture* get(const std::string& path);
+	void clear();
+
+private:
+	std::mutex mutex;
+	std::unordered_map<std::string, std::unique_ptr<Texture>> textures;
+};
@@ -0,0 +1,103 @@
+//
+//  ThreadPool.cpp - persistent worker threads with per-worker work stealing queues
+//
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int numThreads) {
+	if (numThreads <= 0) numThreads = std::thread::hardware_concurrency();
+	if (numThreads <= 0) numThreads = 1;
+
+	for (int i = 0; i < numThreads; i++) {
+		queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+	}
+	for (int i = 0; i < numThreads; i++) {
+		workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lk(jobLock);
+		bQuit = true;
+	}
+	jobReady.notify_all();
+	for (auto& t : workers) t.join();
+}
+
+// Hand each worker a contiguous block of tasks, wake everybody up and wait
+// until every worker has drained the queues.  Every worker checks in for every
+// job, so no worker can still be looking at the queues when the next job is
+// posted.
+//
+void ThreadPool::parallelFor(int numTasks, const std::function<void(int, int)>& func) {
+	if (numTasks <= 0) return;
+
+	int n = size();
+	for (int i = 0; i < n; i++) {
+		int begin = (int)((long long)numTasks * i / n);
+		int end = (int)((long long)numTasks * (i + 1) / n);
+		std::lock_guard<std::mutex> lk(queues[i]->lock);
+		for (int t = begin; t < end; t++) queues[i]->tasks.push_back(t);
+	}
+
+	std::unique_lock<std::mutex> lk(jobLock);
+	job = &func;
+	finishedWorkers = 0;
+	jobId++;
+	jobReady.notify_all();
+	jobDone.wait(lk, [&] { return finishedWorkers == n; });
+	job = nullptr;
+}
+
+// Take from the front of our own queue first, then steal from the back of
+// the other workers' queues (the tiles furthest away from what they are
+// working on).
+//
+bool ThreadPool::popTask(int id, int& task) {
+	{
+		WorkQueue& q = *queues[id];
+		std::lock_guard<std::mutex> lk(q.lock);
+		if (!q.tasks.empty()) {
+			task = q.tasks.front();
+			q.tasks.pop_front();
+			return true;
+		}
+	}
+	int n = size();
+	for (int i = 1; i < n; i++) {
+		WorkQueue& q = *queues[(id + i) % n];
+		std::lock_guard<std::mutex> lk(q.lock);
+		if (!q.tasks.empty()) {
+			task = q.tasks.back();
+			q.tasks.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::workerLoop(int id) {
+	int seenJob = 0;
+	while (true) {
+		const std::function<void(int, int)>* func;
+		{
+			std::unique_lock<std::mutex> lk(jobLock);
+			jobReady.wait(lk, [&] { return bQuit || jobId != seenJob; });
+			if (bQuit) return;
+			seenJob = jobId;
+			func = job;
+		}
+
+		int task;
+		while (popTask(id, task)) {
+			(*func)(task, id);
+		}
+
+		{
+			std::lock_guard<std::mutex> lk(jobLock);
+			finishedWorkers++;
+		}
+		jobDone.notify_all();
+	}
+}
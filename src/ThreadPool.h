@@ -0,0 +1,55 @@
+//
+//  ThreadPool.h - persistent worker threads with per-worker work stealing queues
+//
+//  Used by the ray tracer to render the image as a set of tiles.  Workers are
+//  created once and sleep between jobs.  Each worker owns a queue that is seeded
+//  with a contiguous run of tasks (so neighboring tiles stay on the same core);
+//  a worker that runs out of work steals from the back of the other queues.
+//
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+class ThreadPool {
+public:
+	// numThreads = 0 uses one worker per hardware thread
+	//
+	ThreadPool(int numThreads = 0);
+	~ThreadPool();
+
+	// Run func(task, worker) for every task in [0, numTasks) and block until all
+	// tasks are finished.  "worker" is in [0, size()) and can be used to index
+	// per-worker scratch storage.
+	//
+	void parallelFor(int numTasks, const std::function<void(int, int)>& func);
+
+	int size() const { return (int)workers.size(); }
+
+private:
+	struct WorkQueue {
+		std::mutex lock;
+		std::deque<int> tasks;
+	};
+
+	void workerLoop(int id);
+	bool popTask(int id, int& task);
+
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+
+	// job state, guarded by jobLock
+	//
+	std::mutex jobLock;
+	std::condition_variable jobReady;
+	std::condition_variable jobDone;
+	const std::function<void(int, int)>* job = nullptr;
+	int jobId = 0;
+	int finishedWorkers = 0;
+	bool bQuit = false;
+};
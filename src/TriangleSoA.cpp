@@ -0,0 +1,274 @@
+//
+//  TriangleSoA.cpp - scalar, SSE and AVX2 Moller-Trumbore ray vs. triangle kernels
+//
+//  All three versions do the same steps:
+//
+//      p = cross(dir, e2)
+//      det = dot(e1, p)                         miss if |det| < detEpsilon
+//      s = orig - v0
+//      u = dot(s, p) / det                      miss if u < 0 or u > 1
+//      q = cross(s, e1)
+//      v = dot(dir, q) / det                    miss if v < 0 or u + v > 1
+//      t = dot(e2, q) / det                     hit if tMin < t < tNearest
+//
+//  Dots are summed as (x + y) + z, the division is a real divide (no
+//  reciprocal estimate) and no FMA is used, so the SIMD kernels round exactly
+//  like the scalar one.
+//
+
+#include "TriangleSoA.h"
+#include "Simd.h"
+#include "Profiler.h"
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <iostream>
+
+static const float detEpsilon = 1e-12f;
+
+void TriangleSoA::resize(int n) {
+	this->n = n;
+	std::vector<float>* arrays[] = { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z };
+	for (auto a : arrays) a->assign(n + padding, 0);
+}
+
+int intersectTrianglesScalar(const TriangleSoA& s, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float tMin, float& tNearest, glm::vec2& uv) {
+	int best = -1;
+
+	for (int i = first; i < first + count; i++) {
+		float px = dir.y * s.e2z[i] - dir.z * s.e2y[i];
+		float py = dir.z * s.e2x[i] - dir.x * s.e2z[i];
+		float pz = dir.x * s.e2y[i] - dir.y * s.e2x[i];
+		float det = (s.e1x[i] * px + s.e1y[i] * py) + s.e1z[i] * pz;
+		if (std::fabs(det) < detEpsilon) continue;
+		float inv = 1.0f / det;
+
+		float sx = orig.x - s.v0x[i];
+		float sy = orig.y - s.v0y[i];
+		float sz = orig.z - s.v0z[i];
+		float u = ((sx * px + sy * py) + sz * pz) * inv;
+		if (u < 0 || u > 1) continue;
+
+		float qx = sy * s.e1z[i] - sz * s.e1y[i];
+		float qy = sz * s.e1x[i] - sx * s.e1z[i];
+		float qz = sx * s.e1y[i] - sy * s.e1x[i];
+		float v = ((dir.x * qx + dir.y * qy) + dir.z * qz) * inv;
+		if (v < 0 || u + v > 1) continue;
+
+		float t = ((s.e2x[i] * qx + s.e2y[i] * qy) + s.e2z[i] * qz) * inv;
+		if (t > tMin && t < tNearest) {
+			tNearest = t;
+			uv = glm::vec2(u, v);
+			best = i;
+		}
+	}
+	return best;
+}
+
+#ifdef RT_X86
+
+// Each lane keeps its own nearest hit; pick the nearest lane at the end,
+// breaking ties toward the lower slot like the scalar loop does.
+//
+static int reduceLanes(const float* t, const float* u, const float* v, const int* idx, int lanes, float& tNearest, glm::vec2& uv) {
+	int best = -1;
+	for (int k = 0; k < lanes; k++) {
+		if (idx[k] < 0) continue;
+		if (t[k] < tNearest || (t[k] == tNearest && idx[k] < best)) {
+			tNearest = t[k];
+			uv = glm::vec2(u[k], v[k]);
+			best = idx[k];
+		}
+	}
+	return best;
+}
+
+static int intersectTrianglesSSE(const TriangleSoA& s, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float tMin, float& tNearest, glm::vec2& uv) {
+	const __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+	const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+	const __m128 eps = _mm_set1_ps(detEpsilon);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 tLow = _mm_set1_ps(tMin);
+	const __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+	const __m128i end = _mm_set1_epi32(first + count);
+
+	__m128 bestT = _mm_set1_ps(tNearest);
+	__m128 bestU = zero, bestV = zero;
+	__m128i bestIdx = _mm_set1_epi32(-1);
+
+	for (int i = first; i < first + count; i += 4) {
+		__m128 e1x = _mm_loadu_ps(&s.e1x[i]), e1y = _mm_loadu_ps(&s.e1y[i]), e1z = _mm_loadu_ps(&s.e1z[i]);
+		__m128 e2x = _mm_loadu_ps(&s.e2x[i]), e2y = _mm_loadu_ps(&s.e2y[i]), e2z = _mm_loadu_ps(&s.e2z[i]);
+
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 inv = _mm_div_ps(one, det);
+
+		__m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(&s.v0x[i]));
+		__m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(&s.v0y[i]));
+		__m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(&s.v0z[i]));
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+
+		__m128i idx = _mm_add_epi32(_mm_set1_epi32(i), lane);
+		__m128 valid = _mm_cmpge_ps(_mm_and_ps(det, absMask), eps);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, tLow), _mm_cmplt_ps(t, bestT)));
+		valid = _mm_and_ps(valid, _mm_castsi128_ps(_mm_cmplt_epi32(idx, end)));
+
+		bestT = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, bestT));
+		bestU = _mm_or_ps(_mm_and_ps(valid, u), _mm_andnot_ps(valid, bestU));
+		bestV = _mm_or_ps(_mm_and_ps(valid, v), _mm_andnot_ps(valid, bestV));
+		__m128i validi = _mm_castps_si128(valid);
+		bestIdx = _mm_or_si128(_mm_and_si128(validi, idx), _mm_andnot_si128(validi, bestIdx));
+	}
+
+	float t[4], u[4], v[4];
+	int idx[4];
+	_mm_storeu_ps(t, bestT);
+	_mm_storeu_ps(u, bestU);
+	_mm_storeu_ps(v, bestV);
+	_mm_storeu_si128((__m128i*)idx, bestIdx);
+	return reduceLanes(t, u, v, idx, 4, tNearest, uv);
+}
+
+RT_TARGET_AVX2
+static int intersectTrianglesAVX2(const TriangleSoA& s, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float tMin, float& tNearest, glm::vec2& uv) {
+	const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+	const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+	const __m256 eps = _mm256_set1_ps(detEpsilon);
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 tLow = _mm256_set1_ps(tMin);
+	const __m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	const __m256i end = _mm256_set1_epi32(first + count);
+
+	__m256 bestT = _mm256_set1_ps(tNearest);
+	__m256 bestU = zero, bestV = zero;
+	__m256i bestIdx = _mm256_set1_epi32(-1);
+
+	for (int i = first; i < first + count; i += 8) {
+		__m256 e1x = _mm256_loadu_ps(&s.e1x[i]), e1y = _mm256_loadu_ps(&s.e1y[i]), e1z = _mm256_loadu_ps(&s.e1z[i]);
+		__m256 e2x = _mm256_loadu_ps(&s.e2x[i]), e2y = _mm256_loadu_ps(&s.e2y[i]), e2z = _mm256_loadu_ps(&s.e2z[i]);
+
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		__m256 inv = _mm256_div_ps(one, det);
+
+		__m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(&s.v0x[i]));
+		__m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(&s.v0y[i]));
+		__m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(&s.v0z[i]));
+		__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inv);
+
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+		__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv);
+		__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv);
+
+		__m256i idx = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+		__m256 valid = _mm256_cmp_ps(_mm256_and_ps(det, absMask), eps, _CMP_GE_OQ);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, tLow, _CMP_GT_OQ), _mm256_cmp_ps(t, bestT, _CMP_LT_OQ)));
+		valid = _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_cmpgt_epi32(end, idx)));
+
+		bestT = _mm256_blendv_ps(bestT, t, valid);
+		bestU = _mm256_blendv_ps(bestU, u, valid);
+		bestV = _mm256_blendv_ps(bestV, v, valid);
+		bestIdx = _mm256_blendv_epi8(bestIdx, idx, _mm256_castps_si256(valid));
+	}
+
+	float t[8], u[8], v[8];
+	int idx[8];
+	_mm256_storeu_ps(t, bestT);
+	_mm256_storeu_ps(u, bestU);
+	_mm256_storeu_ps(v, bestV);
+	_mm256_storeu_si256((__m256i*)idx, bestIdx);
+	return reduceLanes(t, u, v, idx, 8, tNearest, uv);
+}
+
+#endif // RT_X86
+
+typedef int (*TriangleKernel)(const TriangleSoA&, int, int, const glm::vec3&, const glm::vec3&, float, float&, glm::vec2&);
+
+static TriangleKernel chooseTriangleKernel() {
+#ifdef RT_X86
+	if (cpuHasAVX2()) return intersectTrianglesAVX2;
+	return intersectTrianglesSSE;
+#else
+	return intersectTrianglesScalar;
+#endif
+}
+
+static TriangleKernel triangleKernel = chooseTriangleKernel();
+
+int intersectTriangles(const TriangleSoA& triangles, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float tMin, float& tNearest, glm::vec2& uv) {
+	PROFILE_COUNT_N(ProfileTriangleTests, count);
+	return triangleKernel(triangles, first, count, orig, dir, tMin, tNearest, uv);
+}
+
+// compare one kernel against the scalar path on the same random data
+//
+static bool verifyKernel(const char* name, TriangleKernel kernel, const TriangleSoA& triangles, int numRays) {
+	std::mt19937 rng(116);
+	std::uniform_real_distribution<float> coord(-10, 10);
+	std::uniform_int_distribution<int> start(0, triangles.size() - 1);
+
+	int mismatches = 0;
+	for (int r = 0; r < numRays; r++) {
+		glm::vec3 orig(coord(rng), coord(rng), coord(rng));
+		glm::vec3 dir = glm::normalize(glm::vec3(coord(rng), coord(rng), coord(rng)));
+		int first = start(rng);
+		int count = std::min(triangles.size() - first, 1 + (int)(rng() % 20));
+		float tMax = (r % 3 == 0) ? coord(rng) + 10 : std::numeric_limits<float>::infinity();
+
+		float tScalar = tMax, tKernel = tMax;
+		glm::vec2 uvScalar, uvKernel;
+		int iScalar = intersectTrianglesScalar(triangles, first, count, orig, dir, 0, tScalar, uvScalar);
+		int iKernel = kernel(triangles, first, count, orig, dir, 0, tKernel, uvKernel);
+		if (iScalar != iKernel || std::memcmp(&tScalar, &tKernel, sizeof(float)) != 0 ||
+			(iScalar >= 0 && (uvScalar.x != uvKernel.x || uvScalar.y != uvKernel.y))) mismatches++;
+	}
+	std::cout << "triangle kernel " << name << ": " << (mismatches ? "MISMATCH" : "ok") << " ("
+		<< mismatches << " of " << numRays << " rays differ from scalar)" << std::endl;
+	return mismatches == 0;
+}
+
+bool verifyTriangleKernels(int numRays) {
+	std::mt19937 rng(2023);
+	std::uniform_real_distribution<float> coord(-10, 10);
+	std::uniform_real_distribution<float> offset(-4, 4);
+
+	// largish triangles so a good share of the rays hit something
+	//
+	TriangleSoA triangles;
+	triangles.resize(200);
+	for (int i = 0; i < triangles.size(); i++) {
+		glm::vec3 a(coord(rng), coord(rng), coord(rng));
+		glm::vec3 b = a + glm::vec3(offset(rng), offset(rng), offset(rng));
+		glm::vec3 c = (i % 11 == 5) ? a + (b - a) * 2.0f : a + glm::vec3(offset(rng), offset(rng), offset(rng));
+		triangles.set(i, a, b, c);
+	}
+
+	bool ok = true;
+#ifdef RT_X86
+	ok = verifyKernel("SSE", intersectTrianglesSSE, triangles, numRays) && ok;
+	if (cpuHasAVX2()) ok = verifyKernel("AVX2", intersectTrianglesAVX2, triangles, numRays) && ok;
+#endif
+	return ok;
+}
@@ -0,0 +1,50 @@
+//
+//  TriangleSoA.h - triangles stored as structure-of-arrays for SIMD ray tests
+//
+//  Slot i holds one triangle as its first vertex v0 and the two edges
+//  e1 = v1 - v0, e2 = v2 - v0, each split into x, y and z arrays.  The arrays
+//  are padded with degenerate triangles (never hit) so a kernel can always
+//  load a full 8-wide vector past the last slot.
+//
+//  intersectTriangles() is the Moller-Trumbore test run over a range of slots,
+//  8 triangles at a time with AVX2 or 4 at a time with SSE, and gives
+//  bit-identical results to intersectTrianglesScalar() when the scalar code
+//  is built without FMA contraction (see SphereSoA.h).
+//
+#pragma once
+
+#include <vector>
+#include "glm/glm.hpp"
+
+struct TriangleSoA {
+	void resize(int n);
+	void set(int slot, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+		v0x[slot] = a.x; v0y[slot] = a.y; v0z[slot] = a.z;
+		e1x[slot] = b.x - a.x; e1y[slot] = b.y - a.y; e1z[slot] = b.z - a.z;
+		e2x[slot] = c.x - a.x; e2y[slot] = c.y - a.y; e2z[slot] = c.z - a.z;
+	}
+	int size() const { return n; }
+
+	std::vector<float> v0x, v0y, v0z;
+	std::vector<float> e1x, e1y, e1z;
+	std::vector<float> e2x, e2y, e2z;
+	int n = 0;
+
+	static const int padding = 8;
+};
+
+// Nearest intersection of the ray with slots [first, first + count), with t
+// in (tMin, tNearest).  On a hit tNearest is set to the hit's t, uv to its
+// barycentric coordinates (weights of v1 and v2) and the slot is returned,
+// otherwise returns -1.  dir does not have to be normalized.
+//
+int intersectTriangles(const TriangleSoA& triangles, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float tMin, float& tNearest, glm::vec2& uv);
+
+// reference version, one triangle at a time
+//
+int intersectTrianglesScalar(const TriangleSoA& triangles, int first, int count, const glm::vec3& orig, const glm::vec3& dir, float tMin, float& tNearest, glm::vec2& uv);
+
+// Run every kernel the CPU supports on random rays and triangles and check
+// the results match the scalar path bit for bit.  Prints a line per kernel.
+//
+bool verifyTriangleKernels(int numRays = 10000);
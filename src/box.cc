@@ -1,5 +1,3 @@
-#include "vector3.h"
-#include "ray.h"
 #include "box.h"
   
 /*
@@ -12,26 +10,33 @@
  *
  */
 
-bool Box::intersect(const _Ray &r, float t0, float t1) const {
+bool Box::intersect(const Ray &r, float t0, float t1) const {
+  float tNear, tFar;
+  return intersect(r, t0, t1, tNear, tFar);
+}
+
+bool Box::intersect(const Ray &r, float t0, float t1, float &tNear, float &tFar) const {
   float tmin, tmax, tymin, tymax, tzmin, tzmax;
 
-  tmin = (parameters[r.sign[0]].x() - r.origin.x()) * r.inv_direction.x();
-  tmax = (parameters[1-r.sign[0]].x() - r.origin.x()) * r.inv_direction.x();
-  tymin = (parameters[r.sign[1]].y() - r.origin.y()) * r.inv_direction.y();
-  tymax = (parameters[1-r.sign[1]].y() - r.origin.y()) * r.inv_direction.y();
+  tmin = (parameters[r.sign[0]].x - r.p.x) * r.invDir.x;
+  tmax = (parameters[1-r.sign[0]].x - r.p.x) * r.invDir.x;
+  tymin = (parameters[r.sign[1]].y - r.p.y) * r.invDir.y;
+  tymax = (parameters[1-r.sign[1]].y - r.p.y) * r.invDir.y;
   if ( (tmin > tymax) || (tymin > tmax) ) 
     return false;
   if (tymin > tmin)
     tmin = tymin;
   if (tymax < tmax)
     tmax = tymax;
-  tzmin = (parameters[r.sign[2]].z() - r.origin.z()) * r.inv_direction.z();
-  tzmax = (parameters[1-r.sign[2]].z() - r.origin.z()) * r.inv_direction.z();
+  tzmin = (parameters[r.sign[2]].z - r.p.z) * r.invDir.z;
+  tzmax = (parameters[1-r.sign[2]].z - r.p.z) * r.invDir.z;
   if ( (tmin > tzmax) || (tzmin > tmax) ) 
     return false;
   if (tzmin > tmin)
     tmin = tzmin;
   if (tzmax < tmax)
     tmax = tzmax;
+  tNear = tmin;
+  tFar = tmax;
   return ( (tmin < t1) && (tmax > t0) );
 }
@@ -2,7 +2,6 @@
 #define _BOX_H_
 
 #include <assert.h>
-#include "vector3.h"
 #include "ray.h"
 
 /*
@@ -18,24 +17,28 @@
 class Box {
   public:
     Box() { }
-    Box(const Vector3 &min, const Vector3 &max) {
+    Box(const glm::vec3 &min, const glm::vec3 &max) {
  //     assert(min < max);
       parameters[0] = min;
       parameters[1] = max;
     }
     // (t0, t1) is the interval for valid hits
-    bool intersect(const _Ray &, float t0, float t1) const;
+    bool intersect(const Ray &, float t0, float t1) const;
+
+    // same test, also returning where the ray enters and leaves the box
+    // (tNear may be before t0 if the ray starts inside)
+    bool intersect(const Ray &, float t0, float t1, float &tNear, float &tFar) const;
 
     // corners
-    Vector3 parameters[2];
-	Vector3 min() { return parameters[0]; }
-	Vector3 max() { return parameters[1]; }
-	const bool inside(const Vector3 &p) {
-		return ((p.x() >= parameters[0].x() && p.x() <= parameters[1].x()) &&
-		     	(p.y() >= parameters[0].y() && p.y() <= parameters[1].y()) &&
-			    (p.z() >= parameters[0].z() && p.z() <= parameters[1].z()));
+    glm::vec3 parameters[2];
+	glm::vec3 min() { return parameters[0]; }
+	glm::vec3 max() { return parameters[1]; }
+	const bool inside(const glm::vec3 &p) {
+		return ((p.x >= parameters[0].x && p.x <= parameters[1].x) &&
+		     	(p.y >= parameters[0].y && p.y <= parameters[1].y) &&
+			    (p.z >= parameters[0].z && p.z <= parameters[1].z));
 	}
-	const bool inside(Vector3 *points, int size) {
+	const bool inside(glm::vec3 *points, int size) {
 		bool allInside = true;
 		for (int i = 0; i < size; i++) {
 			if (!inside(points[i])) allInside = false;
@@ -43,8 +46,8 @@ class Box {
 		}
 		return allInside;
 	}
-	Vector3 center() {
-		return ((max() - min()) / 2 + min());
+	glm::vec3 center() {
+		return ((max() - min()) / 2.0f + min());
 	}
 };
 
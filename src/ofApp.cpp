@@ -12,6 +12,7 @@
 
 
 #include "ofApp.h"
+#include "Profiler.h"
 
 //--------------------------------------------------------------
 //
@@ -55,13 +56,31 @@ void ofApp::setup() {
 	gui.add(toggleLambert.setup("Toggle Lambert", false));
 	gui.add(togglePhong.setup("Toggle Phong", false));
 	gui.add(toggleTextures.setup("Toggle Textures", false));
+	gui.add(togglePackets.setup("Toggle Ray Packets", true));
+	gui.add(toggleProgressive.setup("Toggle Progressive", true));
+	gui.add(toggleAntialias.setup("Toggle Antialiasing", false));
+	gui.add(toggleFalloff.setup("Toggle Light Falloff", false));
+	gui.add(lightCutoffSlider.setup("Light Cutoff", 0.01, 0.001, 0.1));
+	gui.add(toggleLightSampling.setup("Toggle Light Sampling", false));
+	gui.add(lightSamplesSlider.setup("Lights Per Sample", 1, 1, 16));
 
 	// The following is to set up controls on the console to understand how to use the
 	// program better. 
 	//
+	// leaves hold up to one AVX2 register worth of spheres
+	//
+	sceneBVH.maxLeafSize = 8;
+	cout << "Sphere intersection kernel: " << sphereKernelName() << endl;
+#ifdef _DEBUG
+	verifySphereKernels();
+	verifyTriangleKernels();
+#endif
+
 	cout << "Controls:" << endl;
 	cout << "1 = create sphere\n";
 	cout << "2 = create light\n";
+	cout << "3 = create sphere area light\n";
+	cout << "4 = create rectangle area light\n";
 	cout << "c = stop camera movement (use to select objects)\n";
 	cout << "mouse left click on object = select object; hold to drag object\n";
 	cout << "selected + d = delete object\n";
@@ -71,16 +90,23 @@ void ofApp::setup() {
 	cout << "selected + GUI + i = change light intensity\n";
 	cout << "s = save current setup\n";
 	cout << "l = load saved setup\n";
+	cout << "S / L = export / import the spheres as text (savedFile.txt)\n";
+	cout << "drag and drop a model file (obj, ply, gltf, ...) = add mesh\n";
 }
 
 //--------------------------------------------------------------
 void ofApp::exit() {
+	cancelRender();
 	delete bottom1;
 	delete bottom2;
 }
 
 //--------------------------------------------------------------
 void ofApp::update() {
+
+	// swap in a re-optimized BVH once the background build is done
+	//
+	checkSceneBVHRebuild();
 	
 	// create sphere
 	//
@@ -91,6 +117,8 @@ void ofApp::update() {
 		joint->setPosition(pos);
 
 		scene.push_back(joint);
+		bSceneBVHDirty = true;
+		markFootprintDirty(joint);
 
 		selected.clear();
 		selected.push_back(joint);
@@ -100,15 +128,18 @@ void ofApp::update() {
 		bCreateSphere = false;
 	}
 
-	// create point light
+	// create point light, or a sphere or rectangle area light
 	//
-	if (bCreateLight) {
+	if (bCreateLight || bCreateSphereLight || bCreateRectLight) {
 		mouseToDragPlane(ofGetMouseX(), ofGetMouseY(), pos);
 		giveLightName = "light" + to_string(lightCount);
-		light = new PointLight(giveLightName, 0.4f, ofColor::yellow);
+		if (bCreateSphereLight) light = new SphereLight(giveLightName, 0.5f, 0.4f, ofColor::yellow);
+		else if (bCreateRectLight) light = new RectLight(giveLightName, 2.0f, 2.0f, 0.4f, ofColor::yellow);
+		else light = new PointLight(giveLightName, 0.4f, ofColor::yellow);
 		light->setPosition(pos);
 
 		pointLightObjs.push_back(light);
+		bFullRender = true;       // lights change the shading everywhere
 
 		selected.clear();
 		selected.push_back(light);
@@ -116,12 +147,18 @@ void ofApp::update() {
 		cout << "successful in creating " << giveLightName << endl;
 		lightCount++;
 		bCreateLight = false;
+		bCreateSphereLight = false;
+		bCreateRectLight = false;
 	}
 	
 	for (int i = 0; i < scene.size(); i++) {
 		if (objSelected() && scene[i] == selected[0] && changeColor) {
 			scene[i]->diffuseColor = ofColor(colorSliderR, colorSliderG, colorSliderB);
 			changeColor = false;
+
+			// same hits, new shading: no tracing needed
+			//
+			if (std::find(recolored.begin(), recolored.end(), scene[i]) == recolored.end()) recolored.push_back(scene[i]);
 		}
 	}
 
@@ -129,6 +166,7 @@ void ofApp::update() {
 		if (objSelected() && pointLightObjs[i] == selected[0] && changeIntensity) {
 			pointLightObjs[i]->intensity = individualIntensitySlider;
 			changeIntensity = false;
+			bFullRender = true;
 		}
 	}
 
@@ -140,13 +178,19 @@ void ofApp::update() {
 		}
 		bDelete = false;
 	}
+
+	updateRender();
 }
 
 void ofApp::removeObject(SceneObject* obj) {
 	if (selected[0] == obj) selected.clear();
 	for (int i = 0; i < scene.size(); i++) {
 		if (scene[i] == obj) {
+			markFootprintDirty(obj);
+			recolored.erase(std::remove(recolored.begin(), recolored.end(), obj), recolored.end());
 			scene.erase(scene.begin() + i);
+			bSceneBVHDirty = true;
+			cout << "deleted " << obj->name << endl;
 			delete obj;
 			break;
 		}
@@ -154,6 +198,8 @@ void ofApp::removeObject(SceneObject* obj) {
 	for (int i = 0; i < pointLightObjs.size(); i++) {
 		if (pointLightObjs[i] == obj) {
 			pointLightObjs.erase(pointLightObjs.begin() + i);
+			bFullRender = true;
+			cout << "deleted " << obj->name << endl;
 			delete obj;
 			break;
 		}
@@ -192,8 +238,8 @@ void ofApp::draw() {
 
 	// draws the image
 	//
-	if (togglePreview == true)
-		image.draw(-renderCam.view.width() / 2, -renderCam.view.height() / 2, 5.0f, renderCam.view.width(), renderCam.view.height());
+	if (togglePreview == true && previewTexture.isAllocated())
+		previewTexture.draw(-renderCam.view.width() / 2, -renderCam.view.height() / 2, 5.0f, renderCam.view.width(), renderCam.view.height());
 
 	material.end();
 	theCam->end();
@@ -280,6 +326,9 @@ void ofApp::keyPressed(int key) {
 	case 'l':
 		loadFromFile();
 		break;
+	case 'L':
+		importFromText();
+		break;
 	case 'j':
 		changeColor = true;
 		break;
@@ -298,6 +347,9 @@ void ofApp::keyPressed(int key) {
 		cout << "Saving to file..." << endl;
 		saveToFile();
 		break;
+	case 'S':
+		exportToText();
+		break;
 	case 't':
 		bScale = true;
 		break;
@@ -316,6 +368,12 @@ void ofApp::keyPressed(int key) {
 	case '2':
 		bCreateLight = true;
 		break;
+	case '3':
+		bCreateSphereLight = true;
+		break;
+	case '4':
+		bCreateRectLight = true;
+		break;
 	case OF_KEY_F1:
 		theCam = &mainCam;
 		break;
@@ -345,6 +403,11 @@ void ofApp::mouseMoved(int x, int y) {
 void ofApp::mouseDragged(int x, int y, int button) {
 
 	if (objSelected() && bDrag) {
+		// the pixels the object covers (and shadows) before and after the
+		// move are the ones that need tracing again
+		//
+		markFootprintDirty(selected[0]);
+
 		glm::vec3 point;
 		mouseToDragPlane(x, y, point);
 		if (bRotateX) {
@@ -368,6 +431,9 @@ void ofApp::mouseDragged(int x, int y, int button) {
 			selected[0]->position += (point - lastPoint);
 		}
 		lastPoint = point;
+		selected[0]->markDirty();
+		refitSceneBVH(selected[0]);
+		markFootprintDirty(selected[0]);
 	}
 
 }
@@ -418,25 +484,20 @@ void ofApp::mousePressed(int x, int y, int button) {
 	glm::vec3 d = p - theCam->getPosition();
 	glm::vec3 dn = glm::normalize(d);
 
-	// check for selection of scene objects
+	// check for selection of scene objects (closest selectable hit in the BVH)
 	//
-	for (int i = 0; i < scene.size(); i++) {
-
-		glm::vec3 point, norm;
-
-		//  We hit an object
-		//
-		if (scene[i]->isSelectable && scene[i]->intersect(Ray(p, dn), point, norm)) {
-			hits.push_back(scene[i]);
-		}
+	if (bSceneBVHDirty) buildSceneBVH();
+	HitRecord sceneHit;
+	if (intersectScene(Ray(p, dn), sceneHit, true)) {
+		hits.push_back(sceneHit.obj);
 	}
 	for (int i = 0; i < pointLightObjs.size(); i++) {
 		
-		glm::vec3 point, norm;
+		HitRecord lightHit;
 
 		//  We hit an object
 		//
-		if (pointLightObjs[i]->isSelectable && pointLightObjs[i]->intersect(Ray(p, dn), point, norm)) {
+		if (pointLightObjs[i]->isSelectable && pointLightObjs[i]->intersect(Ray(p, dn), 0, std::numeric_limits<float>::infinity(), lightHit)) {
 			hits.push_back(pointLightObjs[i]);
 		}
 	}
@@ -493,395 +554,613 @@ void ofApp::gotMessage(ofMessage msg) {
 }
 
 //--------------------------------------------------------------
+// Dropped model files are loaded as meshes and placed where they were dropped
+//
 void ofApp::dragEvent(ofDragInfo dragInfo) {
+	for (auto& path : dragInfo.files) {
+		uint64_t startTime = ofGetElapsedTimeMillis();
+		Mesh* mesh = new Mesh();
+		if (!mesh->load(path)) {
+			delete mesh;
+			continue;
+		}
+		mouseToDragPlane(dragInfo.position.x, dragInfo.position.y, pos);
+		mesh->setPosition(pos);
 
+		scene.push_back(mesh);
+		bSceneBVHDirty = true;
+		markFootprintDirty(mesh);
+
+		selected.clear();
+		selected.push_back(mesh);
+
+		cout << "loaded " << mesh->name << ": " << mesh->numTriangles() << " triangles in "
+			<< ofGetElapsedTimeMillis() - startTime << " ms" << endl;
+	}
 }
 
-ofColor ofApp::lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor& diffuse) {
-	intensity = lightIntensitySlider;
-	ofColor lighting = ofColor::black;
+// Rebuild the scene BVH from the current world space bounds of all objects
+//
+void ofApp::buildSceneBVH() {
+	vector<AABB> bounds;
+	bounds.reserve(scene.size());
+	for (auto object : scene) {
+		bounds.push_back(object->getBounds());
+	}
+	sceneBVH.build(bounds);
+	sceneBVHBuilt();
+}
 
-	for (auto light : pointLightObjs) {
-		lightPos = glm::normalize(light->position - p);
-		dotProd = glm::dot(norm, lightPos);
+// sceneBVH holds a fresh tree over the whole scene
+//
+void ofApp::sceneBVHBuilt() {
+	bSceneBVHDirty = false;
+	bSnapshotStale = true;
 
-		vector<Ray> lightRays;
-		int n = light->getRaySamples(intersectPoint, lightRays);
+	sceneIndex.clear();
+	for (int i = 0; i < (int)scene.size(); i++) sceneIndex[scene[i]] = i;
+	sceneBVHGeneration++;
 
-		// Shadows are created here
-		//
-		bool inShadow = false;
-
-		for (int i = 0; i < n; i++) {
-			Ray shadowRay(p + norm * 0.0001f, lightPos);
-			for (auto object : scene) {
-				if (object->intersect(shadowRay, shadowPoint, shadowNormal)) {
-					inShadow = true;
-				}
-			}
+	buildSceneSpheres();
+}
 
-			// Lambert lighting is made here
-			//
-			if (!inShadow) {
-				lighting += diffuse * (light->intensity + intensity) * light->color * glm::max(dotProd, 0.0f);
-				//lighting = closestObj->diffuseColor;
-			}
-			if (inShadow) {
-				lighting += ofColor::black;
-			}
-		}
+// Once a load knows the bounds of its objects, the tree over the wall, the
+// floor and the new objects is built on another thread, which spreads the
+// build over the render pool while the loader is still creating the
+// objects.  The render must be stopped before loading, the pool is shared.
+//
+SceneLoadOptions ofApp::sceneLoadOptions(std::future<BVH>& tree) {
+	SceneLoadOptions options;
+	options.pool = &renderPool;
+	options.parsed = [this, &tree](vector<AABB>& bounds) {
+		vector<AABB> all;
+		all.reserve(2 + bounds.size());
+		for (int i = 0; i < 2; i++) all.push_back(scene[i]->getBounds());
+		all.insert(all.end(), bounds.begin(), bounds.end());
+		int leafSize = sceneBVH.maxLeafSize;
+		tree = std::async(std::launch::async, [this, all = std::move(all), leafSize]() {
+			BVH bvh;
+			bvh.maxLeafSize = leafSize;
+			bvh.build(all, renderPool);
+			return bvh;
+		});
+	};
+	return options;
+}
+
+// Use the tree built during a load, if the load got that far and the scene
+// is the one it was built for
+//
+void ofApp::adoptLoadedBVH(std::future<BVH>& tree) {
+	if (!tree.valid()) return;
+	BVH bvh = tree.get();
+	if (bvh.primIndices.size() != scene.size()) return;
+	sceneBVH = std::move(bvh);
+	sceneBVHBuilt();
+}
+
+// Copy every sphere into its slot in the SoA arrays; everything else gets an
+// empty slot and is intersected through its virtual intersect()
+//
+void ofApp::buildSceneSpheres() {
+	int n = sceneBVH.primIndices.size();
+	sceneSpheres.resize(n);
+	sceneSlot.resize(n);
+	for (int slot = 0; slot < n; slot++) {
+		int k = sceneBVH.primIndices[slot];
+		sceneSlot[k] = slot;
+		if (scene[k]->isSphere()) sceneSpheres.set(slot, scene[k]->position, scene[k]->radius);
+	}
+}
+
+// An object (and so its children) moved: refit just their leaves and the
+// path up to the root.  Kick off a background rebuild if the refits have
+// degraded the tree too much.
+//
+void ofApp::refitSceneBVH(SceneObject* obj) {
+	if (bSceneBVHDirty) return;     // full rebuild pending anyway
+
+	auto it = sceneIndex.find(obj);
+	if (it != sceneIndex.end()) {
+		sceneBVH.refit(it->second, obj->getBounds());
+		if (obj->isSphere()) sceneSpheres.set(sceneSlot[it->second], obj->position, obj->radius);
+	}
+	for (auto child : obj->childList) {
+		refitSceneBVH(child);
 	}
 
-	return lighting;
+	if (sceneBVH.costRatio() > bvhRebuildThreshold) startSceneBVHRebuild();
 }
 
-ofColor ofApp::phong(const glm::vec3& p, const glm::vec3& norm, const ofColor& diffuse, const ofColor& specular, float power) {
-	intensity = lightIntensitySlider;
-	power = powerExponentSlider;
-	ofColor lighting = ofColor::black;
+// Build a fresh tree from a copy of the current bounds on another thread.
+// Only the copy is shared, so dragging can carry on while it builds.
+//
+void ofApp::startSceneBVHRebuild() {
+	if (pendingSceneBVH.valid()) return;
+
+	vector<AABB> bounds = sceneBVH.primBounds;
+	pendingBVHGeneration = sceneBVHGeneration;
+	int leafSize = sceneBVH.maxLeafSize;
+	pendingSceneBVH = std::async(std::launch::async, [bounds, leafSize]() {
+		BVH bvh;
+		bvh.maxLeafSize = leafSize;
+		bvh.build(bounds);
+		return bvh;
+	});
+}
 
-	for (auto light : pointLightObjs) {
-		lightPos = glm::normalize(light->position - p);
-		dotProd = glm::dot(norm, lightPos);
+// Objects may have moved while the new tree was being built, so it is
+// refit to the current bounds before it replaces the old one.  If objects
+// were added or removed in the meantime the result is thrown away.
+//
+void ofApp::checkSceneBVHRebuild() {
+	if (!pendingSceneBVH.valid()) return;
+	if (pendingSceneBVH.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
 
-		vector<Ray> lightRays;
-		int n = light->getRaySamples(intersectPoint, lightRays);
+	BVH bvh = pendingSceneBVH.get();
+	if (bSceneBVHDirty || pendingBVHGeneration != sceneBVHGeneration) return;
 
-		// Shadows are created here
-		//
-		bool inShadow = false;
-
-		for (int i = 0; i < n; i++) {
-			Ray shadowRay(p + norm * 0.0001f, lightPos);
-			for (auto object : scene) {
-				if (object->intersect(shadowRay, shadowPoint, shadowNormal)) {
-					inShadow = true;
-				}
-			}
+	bvh.refitAll(sceneBVH.primBounds);
+	sceneBVH = std::move(bvh);
+	buildSceneSpheres();
+	bSnapshotTreeStale = true;
+}
 
-			// Phong lighting is made here
-			//
-			if (!inShadow) {
-				lighting += (diffuse * light->intensity * light->color * glm::max(dotProd, 0.0f)) +
-					(specular * glm::pow(glm::max(glm::dot(glm::normalize(renderCam.view.position),
-						glm::reflect(-lightPos, norm)), 0.0f), power) * light->color * (light->intensity + intensity));
-				//lighting = closestObj->diffuseColor;
-			}
-			if (inShadow) {
-				lighting += ofColor::black;
+// Closest hit against the whole scene.  hit.t is used as the initial
+// maximum distance, so a caller can pass in a record that already holds a hit.
+//
+// Spheres in a leaf are tested together by the SIMD kernel; anything else is
+// tested through its own intersect(), bounded by the closest hit so far.
+// Picking (selectableOnly) needs to look at each object, so it always goes
+// one object at a time.
+//
+bool ofApp::intersectScene(const Ray& ray, HitRecord& hit, bool selectableOnly) const {
+	float tMax = hit.t;
+	return sceneBVH.closestHitLeaves(ray.p, ray.d, tMax, [&](int first, int count, float& t) {
+		bool found = false;
+		if (!selectableOnly) {
+			int slot = intersectSpheres(sceneSpheres, first, count, ray.p, ray.d, t);
+			if (slot >= 0) {
+				static_cast<Sphere*>(scene[sceneBVH.primIndices[slot]])->setHit(ray, t, hit);
+				found = true;
 			}
 		}
-	}
+		for (int slot = first; slot < first + count; slot++) {
+			if (!selectableOnly && sceneSpheres.isSphere(slot)) continue;
+
+			SceneObject* object = scene[sceneBVH.primIndices[slot]];
+			if (selectableOnly && !object->isSelectable) continue;
+
+			if (!object->intersect(ray, 0, t, hit)) continue;
+			t = hit.t;
+			found = true;
+		}
+		return found;
+	});
+}
 
-	return lighting;
+// GUI values for the next render
+//
+RenderSettings ofApp::currentSettings() {
+	RenderSettings s;
+	s.lightIntensity = lightIntensitySlider;
+	s.powerExponent = powerExponentSlider;
+	s.lambert = toggleLambert;
+	s.phong = togglePhong;
+	s.textures = toggleTextures;
+	s.packets = togglePackets;
+	s.progressive = toggleProgressive;
+	s.antialias = toggleAntialias;
+	s.lightFalloff = toggleFalloff;
+	s.lightCutoff = lightCutoffSlider;
+	s.sampleLights = toggleLightSampling;
+	s.lightSamples = lightSamplesSlider;
+
+	// neighboring pixels are one view plane pixel apart, seen from the camera
+	//
+	s.pixelSpread = renderCam.view.width() / imageWidth / fabs(renderCam.position.z - renderCam.view.position.z);
+	return s;
 }
 
 // Your main ray trace loop
 //
+// 'r' renders the whole frame and saves it once it is done
+//
 void ofApp::rayTrace() {
-	// Assumptions
+	bFullRender = true;
+	bSaveWhenDone = true;
+	startRender();
+}
+
+// Takes a snapshot of the scene and starts rendering it on renderThread;
+// any render still running is cancelled first (its unfinished work is put
+// back into the pending changes).  Only the pending changes are rendered:
+// the dirty tiles are traced again and the recolored objects re-shaded,
+// unless a full render is needed.  update() shows the image as it fills in.
+//
+void ofApp::startRender() {
+	cancelRender();
+#if RT_PROFILE
+	Profiler::reset();
+#endif
+	PROFILE_SCOPE("setup");
+
+	if (bSceneBVHDirty) buildSceneBVH();
+
+	// The snapshot is kept between renders and only the objects edited
+	// since the last one are cloned again, so restarting on every frame of
+	// a drag doesn't copy the whole scene.  Adding or removing objects
+	// rebuilds the BVH, which asks for a new snapshot.  Cached matrices are
+	// brought up to date first, so the clones carry them.
+	//
+	for (auto light : pointLightObjs) light->getMatrix();
+	if (!renderScene || bSnapshotStale) {
+		for (auto object : scene) object->getMatrix();
+		renderScene.reset(new RenderScene());
+		renderScene->copyObjects(scene, pointLightObjs);
+		renderScene->sceneBVH = sceneBVH;
+		renderScene->sceneSpheres = sceneSpheres;
+	}
+	else {
+		if (bSnapshotTreeStale) {
+			renderScene->sceneBVH = sceneBVH;
+			renderScene->sceneSpheres = sceneSpheres;
+		}
+		for (auto object : recolored) snapshotChanged.insert(object);
+		vector<int> changed;
+		for (auto object : snapshotChanged) {
+			auto it = sceneIndex.find(object);
+			if (it == sceneIndex.end()) continue;
+			object->getMatrix();
+			changed.push_back(it->second);
+		}
+		renderScene->syncObjects(scene, pointLightObjs, changed, sceneBVH, sceneSlot);
+		renderScene->resetWork();
+	}
+	bSnapshotStale = false;
+	bSnapshotTreeStale = false;
+	snapshotChanged.clear();
+
+	renderScene->renderCam = renderCam;
+	renderScene->settings = currentSettings();
+	renderScene->backgroundColor = ofGetBackgroundColor();
+	renderScene->floorTexture = textureCache.get("floor.jpg");
+	renderScene->wallTexture = textureCache.get("wall3.jpg");
+	renderScene->imageWidth = imageWidth;
+	renderScene->imageHeight = imageHeight;
+
+	// the previous image stays in the buffer until it is drawn over
 	//
-	//  we are rendering an ofImage  (part of OpenFrameworks)
-	//  we have allocated an image to render  that is Nx x Ny in size
-	//    see ofImage::allocate
+	if (frameBuffer.getWidth() != imageWidth || frameBuffer.getHeight() != imageHeight) {
+		frameBuffer.resize(imageWidth, imageHeight);
+		gBuffer.assign((size_t)imageWidth * imageHeight, GBufferSample());
+		bImageValid = false;
+	}
+	if (previewPixels.getWidth() != (size_t)imageWidth || previewPixels.getHeight() != (size_t)imageHeight) {
+		previewPixels.allocate(imageWidth, imageHeight, OF_PIXELS_RGBA);
+		previewTexture.allocate(imageWidth, imageHeight, GL_RGBA8);
+	}
+	renderScene->gBuffer = gBuffer.data();
+	renderScene->regionDone = [this](int x0, int y0, int x1, int y1) { publishRegion(x0, y0, x1, y1); };
+
+	// hand the pending changes over to the render
 	//
-	image.allocate(imageWidth, imageHeight, OF_IMAGE_COLOR);
+	if (!bImageValid || renderScene->settings != lastSettings) bFullRender = true;
+	lastSettings = renderScene->settings;
+	resizeDirtyTiles();
+	renderScene->bFullFrame = bFullRender;
+	if (!bFullRender) {
+		for (int tile = 0; tile < (int)dirtyTiles.size(); tile++) {
+			if (dirtyTiles[tile]) renderScene->tiles.push_back(tile);
+		}
+		renderScene->recolored = recolored;
 
-	ofImage imageBottom;
-	imageBottom.load("floor.jpg");
+		// an antialiased pixel may mix several objects, but the G-buffer
+		// only knows one; recolored objects are traced again instead
+		//
+		if (renderScene->settings.antialias) {
+			for (auto object : recolored) markFootprintDirty(object);
+			for (int tile = 0; tile < (int)dirtyTiles.size(); tile++) {
+				if (dirtyTiles[tile] && std::find(renderScene->tiles.begin(), renderScene->tiles.end(), tile) == renderScene->tiles.end())
+					renderScene->tiles.push_back(tile);
+			}
+			renderScene->recolored.clear();
+			renderScene->bFullFrame = bFullRender;
+		}
+	}
+	bFullRender = false;
+	std::fill(dirtyTiles.begin(), dirtyTiles.end(), 0);
+	recolored.clear();
+
+	renderStartTime = ofGetElapsedTimeMillis();
+	bCancelRender = false;
+	bRenderFinished = false;
+	RenderScene* snapshot = renderScene.get();
+	renderThread = std::thread([this, snapshot]() {
+		if (snapshot->render(frameBuffer, renderPool, bCancelRender)) bRenderFinished = true;
+	});
+}
 
-	ofImage imageWall;
-	imageWall.load("wall3.jpg");
+// Stop the render in flight, if any.  Workers give up at their next tile,
+// so this only waits for the tiles already being traced.  Whatever the
+// render was asked to do goes back into the pending changes, since it may
+// be half done.
+//
+void ofApp::cancelRender() {
+	if (!renderThread.joinable()) return;
+	bCancelRender = true;
+	renderThread.join();
+	if (bRenderFinished) return;
+
+	if (renderScene->bFullFrame) bFullRender = true;
+	resizeDirtyTiles();
+	for (int tile : renderScene->tiles) dirtyTiles[tile] = 1;
+	for (auto object : renderScene->recolored) {
+		if (std::find(recolored.begin(), recolored.end(), object) == recolored.end()) recolored.push_back(object);
+	}
+}
 
-	//for each j  (row)  until j = Ny
-	for (int j = 0; j < imageHeight; j++) {
-		//for each i  (columnn)  until i = Nx
-		for (int i = 0; i < imageWidth; i++) {
-			//
-			//  convert each i, j to (u, v)
+bool ofApp::hasPendingChanges() {
+	if (bFullRender || !recolored.empty()) return true;
+	return std::find(dirtyTiles.begin(), dirtyTiles.end(), 1) != dirtyTiles.end();
+}
 
-			// Nx  (image resolution in X)
-			// Ny  (image resolution in Y)
-			// See Raycaster
+// Called from update(): restart the render if the scene or the GUI changed
+// under it, show its progress, and save it once it is done.  Once there is
+// a complete image, edits re-render just what they changed while the
+// preview is on.
+//
+void ofApp::updateRender() {
+	if (bImageValid && currentSettings() != lastSettings) bFullRender = true;
+
+	if (renderThread.joinable()) {
+		if (!bRenderFinished) {
+			if (hasPendingChanges()) startRender();
+			else uploadPreview();
+			return;
+		}
 
-			//u = (i + 0.5) / Nx;
-			//v = (j + 0.5) / Ny;
-			u = (i + 0.5) / imageWidth;
-			v = (j + 0.5) / imageHeight;
+		renderThread.join();
+		uploadPreview();
+		bImageValid = true;
 
-			// see Raycaster
-			//
-			//ray = camera.getRay(u, v)
-			ray = renderCam.getRay(u, v);
-
-			hit = false;
-
-			//distance = infinity;   // you can initialize to a very big number OR  std::numeric_limits<float>::infinity();
-			distance = std::numeric_limits<float>::infinity();
-
-			closestObj = NULL;
-
-			float uFloor;
-			float vFloor;
-			float uWall;
-			float vWall;
-
-			//for each obj in scene
-			for (int i = 0; i < scene.size(); i++) {
-				// determine if we hit the object and save closest obj
-				// record in a variable "closestObject"
-				// record closest distance
-
-				//if (obj.intersect(ray, -> intersectPoint, -> normal))
-				//	determine if object is closest
-
-				//	if (closestObject) hit = true;
-				if (scene[i]->intersect(ray, intersectPoint, normal)) {
-					hit = true;
-					float temp = glm::distance(ray.p, intersectPoint);
-					if (temp < distance) {
-						distance = temp;
-						shadedPoint = intersectPoint;
-						normalPoint = normal;
-						closestObj = scene[i];
-						uFloor = ofMap(intersectPoint.x, bottom2->position.x - bottom2->width / 2,
-							bottom2->position.x + bottom2->width / 2, 0, imageBottom.getWidth());
-						vFloor = ofMap(intersectPoint.z, bottom2->position.z - bottom2->height / 2,
-							bottom2->position.z + bottom2->height / 2, 0, imageBottom.getHeight());
-
-						uWall = ofMap(intersectPoint.x, bottom1->position.x - bottom1->width / 2,
-							bottom1->position.x + bottom1->width / 2, 0, imageWall.getWidth());
-						vWall = ofMap(intersectPoint.y, bottom1->position.y - bottom1->height / 2,
-							bottom1->position.y + bottom1->height / 2, 0, imageWall.getHeight());
-					}
-				}
-			}
-			//if (hit)
-				//	so something if hit
-				//	obj was closest object hit
-				//
-				//	color = obj.diffuseColor;
-				//
-				//	image.setColor(i, j, color);
-				//
-			if (hit) {
-				if (toggleLambert == true) {
-					if (toggleTextures) {
-						if (closestObj == scene[1]) {
-							color = lambert(shadedPoint, normalPoint, imageBottom.getColor(uFloor, vFloor));
-						}
-						else if (closestObj == scene[0]) {
-							color = lambert(shadedPoint, normalPoint, imageWall.getColor(uWall, vWall));
-						}
-						else {
-							color = lambert(shadedPoint, normalPoint, closestObj->diffuseColor);
-						}
-					}
-					else {
-						color = lambert(shadedPoint, normalPoint, closestObj->diffuseColor);
-					}
-				}
-				if (togglePhong == true) {
-					if (toggleTextures) {
-						if (closestObj == scene[1]) {
-							color = phong(shadedPoint, normalPoint, imageBottom.getColor(uFloor, vFloor), closestObj->specularColor, lightIntensitySlider);
-						}
-						else if (closestObj == scene[0]) {
-							color = phong(shadedPoint, normalPoint, imageWall.getColor(uWall, vWall), closestObj->specularColor, lightIntensitySlider);
-						}
-						else {
-							color = phong(shadedPoint, normalPoint, closestObj->diffuseColor, closestObj->specularColor, lightIntensitySlider);
-						}
-					}
-					else {
-						color = phong(shadedPoint, normalPoint, closestObj->diffuseColor, closestObj->specularColor, lightIntensitySlider);
-					}
-				}
-				if (toggleLambert == false && togglePhong == false) {
-					if (toggleTextures) {
-						if (closestObj == scene[1]) {
-							color = imageBottom.getColor(uFloor, vFloor);
-						}
-						else if (closestObj == scene[0]) {
-							color = imageWall.getColor(uWall, vWall);
-						}
-						else {
-							color = closestObj->diffuseColor;
-						}
-					}
-					else {
-						color = closestObj->diffuseColor;
-					}
-				}
-				image.setColor(i, j, color);
-			}
-			//else
-			//	image.setColor(i, j, backgroundColor)
-			else {
-				image.setColor(i, j, ofGetBackgroundColor());
-			}
+		// the writer takes a copy, so the next render can start while it
+		// encodes.  With the profiler built in the frame also gets a trace,
+		// which has the save in it only if the writer was that quick.
+		//
+		if (bSaveWhenDone) {
+			string path = ofToDataPath(output.fileName(frameNumber++));
+			imageWriter.write(frameBuffer, path, output.format, output.pngCompression);
+			bSaveWhenDone = false;
+#if RT_PROFILE
+			if (Profiler::writeTrace(path + ".trace.json")) cout << "Wrote " << path << ".trace.json" << endl;
+#endif
 		}
+
+#if RT_PROFILE
+		cout << "Rendered " << imageWidth << "x" << imageHeight << " in " << ofGetElapsedTimeMillis() - renderStartTime << " ms on " << renderPool.size() << " threads" << endl;
+		Profiler::printSummary();
+#else
+		int traced = renderScene->bFullFrame ? -1 : (int)renderScene->tiles.size();
+		cout << "Rendered " << imageWidth << "x" << imageHeight;
+		if (traced >= 0) cout << " (" << traced << " tiles traced, " << renderScene->recolored.size() << " objects re-shaded)";
+		long long samples = renderScene->samplesTraced;
+		cout << ", " << samples << " primary rays (" << fixed << setprecision(2) << (double)samples / ((double)imageWidth * imageHeight)
+			<< " per pixel)" << defaultfloat << " in " << ofGetElapsedTimeMillis() - renderStartTime << " ms on " << renderPool.size() << " threads" << endl;
+#endif
 	}
 
-	//--> don't forget to save image...
-	//
-	//	  see ofImage functions:
+	if (bImageValid && togglePreview && hasPendingChanges()) startRender();
+}
+
+void ofApp::resizeDirtyTiles() {
+	int tilesX = (imageWidth + RenderScene::tileSize - 1) / RenderScene::tileSize;
+	int tilesY = (imageHeight + RenderScene::tileSize - 1) / RenderScene::tileSize;
+	if (dirtyTiles.size() != (size_t)(tilesX * tilesY)) dirtyTiles.assign(tilesX * tilesY, 0);
+}
+
+// Mark the tiles the box covers in the render camera's image.  A box that
+// reaches behind the camera covers the whole image, unless clipToEye is
+// set: then only the part of it in front of the camera counts, which is all
+// of a shadow that can be seen.
+//
+void ofApp::markBoxDirty(const AABB& box, bool clipToEye) {
+	resizeDirtyTiles();
+	glm::vec3 eye = renderCam.position;
+	float planeZ = renderCam.view.position.z;
+	float nearZ = eye.z - 0.001f;
+	if (box.max.z >= nearZ) {
+		if (!clipToEye) {
+			bFullRender = true;
+			return;
+		}
+		if (box.min.z >= nearZ) return;     // all of it behind the camera
+	}
+	AABB front = box;
+	front.max.z = std::min(front.max.z, nearZ);
+
+	float iMin = std::numeric_limits<float>::max(), jMin = iMin;
+	float iMax = -iMin, jMax = -iMin;
+	for (int k = 0; k < 8; k++) {
+		glm::vec3 corner((k & 1) ? front.max.x : front.min.x, (k & 2) ? front.max.y : front.min.y, (k & 4) ? front.max.z : front.min.z);
+
+		// where the line from the eye to the corner crosses the view plane,
+		// in pixels (j counts up from the bottom, like the render)
+		//
+		float s = (planeZ - eye.z) / (corner.z - eye.z);
+		glm::vec3 p = eye + (corner - eye) * s;
+		float i = (p.x - renderCam.view.min.x) / renderCam.view.width() * imageWidth;
+		float j = (p.y - renderCam.view.min.y) / renderCam.view.height() * imageHeight;
+		iMin = std::min(iMin, i);
+		iMax = std::max(iMax, i);
+		jMin = std::min(jMin, j);
+		jMax = std::max(jMax, j);
+	}
+
+	// a pixel of margin for rays that graze the edge
 	//
-	//	  image.load();
-	//	  image.save();
-	//	  image.allocate();
-	image.mirror(true, false); //  is image upside down ? "flip"
-	image.update();
-	image.save("test.png");
+	if (iMax < -1 || jMax < -1 || iMin > imageWidth || jMin > imageHeight) return;
+	int tilesX = (imageWidth + RenderScene::tileSize - 1) / RenderScene::tileSize;
+	int tx0 = (int)std::max(iMin - 1, 0.0f) / RenderScene::tileSize;
+	int tx1 = (int)std::min(iMax + 1, imageWidth - 1.0f) / RenderScene::tileSize;
+	int ty0 = (int)std::max(jMin - 1, 0.0f) / RenderScene::tileSize;
+	int ty1 = (int)std::min(jMax + 1, imageHeight - 1.0f) / RenderScene::tileSize;
+
+	for (int ty = ty0; ty <= ty1; ty++) {
+		for (int tx = tx0; tx <= tx1; tx++) dirtyTiles[ty * tilesX + tx] = 1;
+	}
 }
 
-void ofApp::saveToFile() {
-	ofFile newFile("savedFile.txt", ofFile::WriteOnly);
-	newFile.create();
+// Mark what the object (and everything below it) can change in the image:
+// its own box, and for every light the part of the scene its shadow can
+// reach.  Moving a light changes the shading everywhere.
+//
+// The shadow of a box from a light at L is inside the hull of the box's
+// corners c and the points c + s (c - L).  With s large enough that every
+// point of the box moves further than the size of the scene, the part of
+// the shadow inside the scene lies in the bounds of those points, clipped
+// to the scene's bounds and to the near side of the camera.  An area light
+// casts the union of the shadows from its points, which is inside the hull
+// of the shadows from the corners of its bounds, so those are used as L.
+// Only the object's own box reaching behind the camera forces a full frame.
+//
+void ofApp::markFootprintDirty(SceneObject* obj) {
+	markSnapshotChanged(obj);
+	if (std::find(pointLightObjs.begin(), pointLightObjs.end(), obj) != pointLightObjs.end()) {
+		bFullRender = true;
+		return;
+	}
+
+	AABB box = obj->getBounds();
+	markBoxDirty(box);
 
-	newFile.open("savedFile.txt", ofFile::WriteOnly);
-	for (int i = 2; i < scene.size(); i++) {
-		newFile << fixed << setprecision(1) << "create -sphere " << ofToString(scene.at(i)->name)
-				<< " -rotate <" << ofToString(scene.at(i)->rotation)
-				<< "> -scale " << ofToString(scene.at(i)->radius)
-				<< " -translate <" << ofToString(scene.at(i)->getPosition()) 
-				<< "> -color <" << ofToString(scene.at(i)->diffuseColor)
-				<< ">" << "\n";
+	// The root of the scene BVH is kept current by the refits, so during a
+	// drag the scene's bounds come for free.  Only when objects were added
+	// or removed since the last build are they gathered again.
+	//
+	AABB sceneBox;
+	if (!bSceneBVHDirty && !sceneBVH.empty()) sceneBox = sceneBVH.nodes[0].bounds;
+	else {
+		for (auto object : scene) sceneBox.grow(object->getBounds());
 	}
-	newFile.close();
-	cout << "Successfully added objects to savedFile.txt" << endl;
+	sceneBox.grow(box);
+	float size = glm::length(sceneBox.extent());
+
+	for (auto light : pointLightObjs) {
+		glm::vec3 l = light->getPosition();
+		AABB lightBox = light->numSamples() > 0 ? light->getBounds() : AABB(l, l);
+		float dist = glm::length(glm::max(glm::max(box.min - lightBox.max, lightBox.min - box.max), glm::vec3(0)));
+		if (dist <= 0) {
+			bFullRender = true;
+			return;
+		}
+		float s = size / dist;
+
+		AABB shadow = box;
+		for (int m = 0; m < 8; m++) {
+			l = glm::vec3((m & 1) ? lightBox.max.x : lightBox.min.x, (m & 2) ? lightBox.max.y : lightBox.min.y, (m & 4) ? lightBox.max.z : lightBox.min.z);
+			for (int k = 0; k < 8; k++) {
+				glm::vec3 corner((k & 1) ? box.max.x : box.min.x, (k & 2) ? box.max.y : box.min.y, (k & 4) ? box.max.z : box.min.z);
+				shadow.grow(corner + (corner - l) * s);
+			}
+		}
+		shadow.min = glm::max(shadow.min, sceneBox.min);
+		shadow.max = glm::min(shadow.max, sceneBox.max);
+		if (!shadow.isEmpty()) markBoxDirty(shadow, true);
+	}
+
+	for (auto child : obj->childList) markFootprintDirty(child);
+}
+
+// The object and everything below it have to be cloned into the render
+// snapshot again.  Lights are copied on every render anyway.
+//
+void ofApp::markSnapshotChanged(SceneObject* obj) {
+	snapshotChanged.insert(obj);
+	for (auto child : obj->childList) markSnapshotChanged(child);
+}
+
+// Called by the render workers for each piece of the frame buffer they
+// finish: it is converted into the preview's pixels, which is the only
+// copy of the image the UI thread reads while a render runs.
+//
+void ofApp::publishRegion(int x0, int y0, int x1, int y1) {
+	std::lock_guard<std::mutex> lock(previewMutex);
+	frameBuffer.toRGBA8(previewPixels.getData(), x0, y0, x1, y1);
+	bPreviewChanged = true;
+}
+
+// upload the finished pieces published so far
+//
+void ofApp::uploadPreview() {
+	PROFILE_SCOPE("mirror preview");
+	std::lock_guard<std::mutex> lock(previewMutex);
+	if (!bPreviewChanged) return;
+	previewTexture.loadData(previewPixels);
+	bPreviewChanged = false;
 }
 
+// The setup (spheres, meshes, lights and the render camera) is saved in the
+// binary format, which loads back exactly.  The text format only has the
+// spheres and is kept for exchanging scenes with other tools.
+//
+void ofApp::saveToFile() {
+	if (saveSceneBinary("savedScene.rtscene", scene, pointLightObjs, &renderCam, 2)) cout << "Successfully saved the scene to savedScene.rtscene" << endl;
+}
+
+// falls back to the text file when there is no binary save yet
+//
 void ofApp::loadFromFile() {
+	if (!ofFile::doesFileExist("savedScene.rtscene")) {
+		importFromText();
+		return;
+	}
+	// the render in flight works on copies, but gives its pending work back
+	// when cancelled; drop that before the old objects go.  It also frees
+	// the pool for the load.
+	//
+	cancelRender();
+
+	vector<SceneObject*> objects;
+	vector<Light*> lights;
+	RenderCam loadedCam = renderCam;
+	std::future<BVH> tree;
+	if (!loadSceneBinary("savedScene.rtscene", objects, lights, &loadedCam, sceneLoadOptions(tree))) return;
+
+	recolored.clear();
+	for (int i = 2; i < (int)scene.size(); i++) delete scene[i];
+	for (auto old : pointLightObjs) delete old;
 	scene.erase(scene.begin() + 2, scene.end());
+	scene.insert(scene.end(), objects.begin(), objects.end());
+	pointLightObjs = lights;
+	renderCam = loadedCam;
+	previewCam.setPosition(renderCam.position);
+	previewCam.lookAt(renderCam.aim);
+	bSceneBVHDirty = true;
+	bFullRender = true;
 	selected.clear();
-	count = 0;
+	adoptLoadedBVH(tree);
 
-	ofBuffer buffer = ofBufferFromFile("savedFile.txt");
+	count = (int)scene.size() - 2;
+	lightCount = (int)pointLightObjs.size();
+	cout << "Loaded " << count << " objects and " << lightCount << " lights from savedScene.rtscene" << endl;
+}
 
-	for (auto line : buffer.getLines()) {
-		istringstream iss(line);
-		string letter;
-		iss >> letter;
+void ofApp::exportToText() {
+	if (saveSceneText("savedFile.txt", scene, 2)) cout << "Successfully added objects to savedFile.txt" << endl;
+}
 
-		while (iss >> letter) {
+void ofApp::importFromText() {
+	cancelRender();
+	recolored.clear();
+	for (int i = 2; i < (int)scene.size(); i++) delete scene[i];
+	scene.erase(scene.begin() + 2, scene.end());
+	bSceneBVHDirty = true;
+	bFullRender = true;
+	selected.clear();
 
-			if (letter == "create") {
-				cout << "Continue ";
-			}
-			if (letter == "-sphere") { //find sphere name
-				iss >> giveName;
-				cout << "\n" << giveName << " ";
-			}
-			if (letter == "-rotate") {
-				vector<string> fLine;
-				istringstream iss(line);
-				string letter;
-
-				while (iss >> letter) {
-					fLine.push_back(letter);
-				}
-
-				for (int i = 1; i < fLine.size(); i++) {
-					string temp;
-					for (char c : fLine[i]) {
-						if (c == '<') {
-							fLine[i] = temp;
-							temp = "";
-							continue;
-						}
-						else if (c == ',' || c == '>') {
-							fLine[i] = temp;
-							temp = "";
-							break;
-						}
-						temp += c;
-					}
-				}
-				cout << "rotX: " << fLine[4] << " ";
-				cout << "rotY: " << fLine[5] << " ";
-				cout << "rotZ " << fLine[6] << " ";
-				rotX = stoi(fLine[4]);
-				rotY = stoi(fLine[5]);
-				rotZ = stoi(fLine[6]);
-			}
-			if (letter == "-scale") {
-				iss >> loadScale;
-				cout << "scale: " << loadScale << " ";
-			}
-			if (letter == "-translate") {
-				vector<string> fLine;
-				istringstream iss(line);
-				string letter;
-
-				while (iss >> letter) {
-					fLine.push_back(letter);
-				}
-
-				for (int i = 1; i < fLine.size(); i++) {
-					string temp;
-					for (char c : fLine[i]) {
-						if (c == '<') {
-							fLine[i] = temp;
-							temp = "";
-							continue;
-						}
-						else if (c == ',' || c == '>') {
-							fLine[i] = temp;
-							temp = "";
-							break;
-						}
-						temp += c;
-					}
-				}
-				cout << "posX: " << fLine[10] << " ";
-				cout << "posY: " << fLine[11] << " ";
-				cout << "posZ: " << fLine[12] << " ";
-				posX = stoi(fLine[10]);
-				posY = stoi(fLine[11]);
-				posZ = stoi(fLine[12]);
-				pos = glm::vec3(posX, posY, posZ);
-			}
-			if (letter == "-color") {
-				vector<string> fLine;
-				istringstream iss(line);
-				string letter;
-
-				while (iss >> letter) {
-					fLine.push_back(letter);
-				}
-
-				for (int i = 1; i < fLine.size(); i++) {
-					string temp;
-					for (char c : fLine[i]) {
-						if (c == '<') {
-							fLine[i] = temp;
-							temp = "";
-							continue;
-						}
-						else if (c == ',' || c == '>') {
-							fLine[i] = temp;
-							temp = "";
-							break;
-						}
-						temp += c;
-					}
-				}
-				cout << "colorR: " << fLine[14] << " ";
-				cout << "colorG: " << fLine[15] << " ";
-				cout << "colorB: " << fLine[16] << " ";
-				colorR = stoi(fLine[14]);
-				colorG = stoi(fLine[15]);
-				colorB = stoi(fLine[16]);
-			}
-		}
-		for (int i = 0; i < scene.size(); i++) {
-			joint = new Joint(giveName, loadScale, ofColor(colorR, colorG, colorB));
-			joint->rotation = glm::vec3(rotX, rotY, rotZ);
-			joint->setPosition(pos);
-			scene.push_back(joint);
-			count++;
-			break;
-		}
-	}
+	std::future<BVH> tree;
+	loadSceneText("savedFile.txt", scene, sceneLoadOptions(tree));
+	adoptLoadedBVH(tree);
+	count = (int)scene.size() - 2;
 }
\ No newline at end of file
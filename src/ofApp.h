@@ -11,11 +11,25 @@
 //
 
 #include "ofMain.h"
+#include <future>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include "box.h"
 #include "Primitives.h"
+#include "BVH.h"
+#include "SphereSoA.h"
+#include "ThreadPool.h"
+#include "TextureCache.h"
+#include "FrameBuffer.h"
+#include "ImageWriter.h"
+#include "RenderScene.h"
+#include "SceneFile.h"
+#include "SceneBinary.h"
 #include "ofxGui.h"
 
-
 class ofApp : public ofBaseApp {
 
 public:
@@ -43,8 +57,25 @@ public:
 	void removeObject(SceneObject* parentJoint);
 	void ofApp::saveToFile();
 	void ofApp::loadFromFile();
+	void exportToText();
+	void importFromText();
 
 	void rayTrace();
+	void startRender();
+	void cancelRender();
+	void updateRender();
+	void uploadPreview();
+	void publishRegion(int x0, int y0, int x1, int y1);
+	RenderSettings currentSettings();
+
+	// dirty regions: what changed since the last render, so the next one
+	// only traces the tiles an edit touched
+	//
+	void resizeDirtyTiles();
+	void markBoxDirty(const AABB& box, bool clipToEye = false);
+	void markFootprintDirty(SceneObject* obj);
+	void markSnapshotChanged(SceneObject* obj);
+	bool hasPendingChanges();
 	void drawGrid() {}
 
 	// Lights
@@ -67,6 +98,43 @@ public:
 	//
 	vector<SceneObject*> scene;
 	vector<SceneObject*> selected;
+
+	// acceleration structure over scene (prim i is scene[i]).  Set
+	// bSceneBVHDirty whenever objects are added or removed; the tree is
+	// rebuilt on the next query.  Objects that only move are refit in place
+	// with refitSceneBVH().
+	//
+	BVH sceneBVH;
+	bool bSceneBVHDirty = true;
+	unordered_map<SceneObject*, int> sceneIndex;   // scene[sceneIndex[obj]] == obj
+
+	// spheres laid out in BVH leaf order (slot i is scene[sceneBVH.primIndices[i]]),
+	// so a whole leaf goes through the SIMD kernel at once
+	//
+	SphereSoA sceneSpheres;
+	vector<int> sceneSlot;                         // slot of scene[i]
+	void buildSceneSpheres();
+
+	void buildSceneBVH();
+	void sceneBVHBuilt();
+	void refitSceneBVH(SceneObject* obj);
+
+	// loads parse on the render pool and build the scene BVH there while
+	// the objects are being created
+	//
+	SceneLoadOptions sceneLoadOptions(std::future<BVH>& tree);
+	void adoptLoadedBVH(std::future<BVH>& tree);
+
+	// once refits have made the tree this much worse than a fresh build, a
+	// new tree is built on a background thread and swapped in by update()
+	//
+	float bvhRebuildThreshold = 1.5;
+	std::future<BVH> pendingSceneBVH;
+	int sceneBVHGeneration = 0;
+	int pendingBVHGeneration = -1;
+	void startSceneBVHRebuild();
+	void checkSceneBVHRebuild();
+	bool intersectScene(const Ray& ray, HitRecord& hit, bool selectableOnly = false) const;
 	ofPlanePrimitive plane;
 
 	Plane* bottom1 = NULL;
@@ -87,6 +155,8 @@ public:
 	bool bDelete = false;
 
 	bool bCreateLight = false;
+	bool bCreateSphereLight = false;
+	bool bCreateRectLight = false;
 	bool bDeleteLight = false;
 
 	// for the create function
@@ -107,7 +177,6 @@ public:
 	// Values set when loading
 	//
 	string giveParentName = "nothing";
-	float rotX, rotY, rotZ, posX, posY, posZ, loadScale, colorR, colorG, colorB;
 	float lightX, lightY, lightZ;
 
 	bool bShowImage = false;
@@ -116,38 +185,41 @@ public:
 	// set up one render camera to render image throughn
 	//
 	RenderCam renderCam;
-	ofImage image;
+	FrameBuffer frameBuffer;     // float RGBA, traced into directly, kept between renders
+	ofPixels previewPixels;      // 8 bit copy of frameBuffer, loaded into previewTexture
+	std::mutex previewMutex;     // guards previewPixels and bPreviewChanged, written by the workers
+	bool bPreviewChanged = false;
+	ofTexture previewTexture;
+	ImageWriter imageWriter;     // saves finished frames off the UI thread
+	OutputSettings output;
+	int frameNumber = 0;
 
 	int imageWidth = 1200;
 	int imageHeight = 800;
 
-	// for rayTrace function
-	//
-	glm::vec3 intersectPoint;
-	glm::vec3 normal;
-	float u;
-	float v;
-	Ray ray = Ray(glm::vec3(0, 0, 0), glm::vec3(0, 0, 0));
-	bool hit;
-	float distance;
-	SceneObject* closestObj;
-	ofColor color;
-	glm::vec3 shadedPoint; // for shading
-	glm::vec3 normalPoint; // for shading
-
-	ofColor lambert(const glm::vec3& p, const glm::vec3& norm, const ofColor& diffuse);
-	ofColor phong(const glm::vec3& p, const glm::vec3& norm, const ofColor& diffuse, const ofColor& specular, float power);
-
-	// for shading
-	//
-	glm::vec3 lightPos;
-
-	// for both Lambert and Phong shading
+	// for rayTrace function.  Renders run on renderThread against
+	// renderScene, a copy of the scene brought up to date when they start.
+	// Edits record what they changed (bFullRender, dirtyTiles, recolored,
+	// snapshotChanged); update() then cancels the render in flight and
+	// starts one for just those changes.
 	//
-	float intensity;
-	float dotProd;
-	glm::vec3 shadowPoint;
-	glm::vec3 shadowNormal;
+	ThreadPool renderPool;   // persistent workers, one per core
+	TextureCache textureCache;               // files are decoded once, on first use
+	std::unique_ptr<RenderScene> renderScene;
+	std::thread renderThread;
+	std::atomic<bool> bCancelRender{ false };
+	std::atomic<bool> bRenderFinished{ false };
+	uint64_t renderStartTime = 0;
+	bool bFullRender = true;
+	vector<uint8_t> dirtyTiles;              // per tile, indexed like RenderScene::tiles
+	vector<SceneObject*> recolored;          // only the color changed, re-shade from gBuffer
+	std::unordered_set<SceneObject*> snapshotChanged;   // objects to clone into renderScene again
+	bool bSnapshotStale = true;              // objects added or removed: copy everything
+	bool bSnapshotTreeStale = false;         // sceneBVH was swapped: copy the tree and spheres
+	vector<GBufferSample> gBuffer;           // primary hits of the current image
+	bool bImageValid = false;                // frameBuffer/gBuffer hold a finished render
+	bool bSaveWhenDone = false;              // 'r' renders are saved, edit updates are not
+	RenderSettings lastSettings;
 
 	// GUI stuff
 	//
@@ -158,15 +230,22 @@ public:
 	ofxSlider<float> colorSliderG;
 	ofxSlider<float> colorSliderB;
 	ofxSlider<float> individualIntensitySlider;
+	ofxSlider<float> lightCutoffSlider;
+	ofxSlider<int> lightSamplesSlider;
 	ofxToggle togglePreview;
 	ofxToggle toggleLambert;
 	ofxToggle togglePhong;
 	ofxToggle toggleTextures;
+	ofxToggle togglePackets;
+	ofxToggle toggleProgressive;
+	ofxToggle toggleAntialias;
+	ofxToggle toggleFalloff;
+	ofxToggle toggleLightSampling;
 
 	// For creating point lights
 	//
-	vector<PointLight*> pointLightObjs;
-	PointLight* light;
+	vector<Light*> pointLightObjs;
+	Light* light;
 
 	bool changeColor = false;
 	bool changeIntensity = false;
@@ -1,39 +1,37 @@
 #ifndef _RAY_H_
 #define _RAY_H_
 
-#include "vector3.h"
+#include "ofMain.h"
 
 /*
- * Ray class, for use with the optimized ray-box intersection test
- * described in:
+ * General purpose ray.  The reciprocal direction and its signs are
+ * precomputed for the optimized ray-box intersection test described in:
  *
  *      Amy Williams, Steve Barrus, R. Keith Morley, and Peter Shirley
  *      "An Efficient and Robust Ray-Box Intersection Algorithm"
  *      Journal of graphics tools, 10(1):49-54, 2005
- * 
+ *
+ * Points along the ray are p + t * d, so t is a distance when d is normalized.
  */
 
-class _Ray {
+class Ray {
   public:
-    _Ray() { }
-    _Ray(Vector3 o, Vector3 d) {
-      origin = o;
-      direction = d;
-      inv_direction = Vector3(1/d.x(), 1/d.y(), 1/d.z());
-      sign[0] = (inv_direction.x() < 0);
-      sign[1] = (inv_direction.y() < 0);
-      sign[2] = (inv_direction.z() < 0);
+    Ray(glm::vec3 p, glm::vec3 d) {
+      this->p = p;
+      this->d = d;
+      invDir = 1.0f / d;
+      sign[0] = (invDir.x < 0);
+      sign[1] = (invDir.y < 0);
+      sign[2] = (invDir.z < 0);
     }
-    _Ray(const _Ray &r) {
-      origin = r.origin;
-      direction = r.direction;
-      inv_direction = r.inv_direction;
-      sign[0] = r.sign[0]; sign[1] = r.sign[1]; sign[2] = r.sign[2];
+    void draw(float t) const { ofDrawLine(p, p + t * d); }
+
+    glm::vec3 evalPoint(float t) const {
+      return (p + t * d);
     }
 
-    Vector3 origin;
-    Vector3 direction;
-    Vector3 inv_direction;
+    glm::vec3 p, d;
+    glm::vec3 invDir;
     int sign[3];
 };
 